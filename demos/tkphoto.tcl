@@ -10,7 +10,8 @@ package require Tk
 ffidl::typedef Tk_PhotoHandle pointer
 
 # define a structure for Tk_PhotoImageBlock
-ffidl::typedef Tk_PhotoImageBlock pointer int int int int int int int int
+ffidl::typedef -fields {pixelPtr width height pitch pixelSize red green blue reserved} \
+    Tk_PhotoImageBlock pointer int int int int int int int int
 
 # bind to tk
 ffidl::callout ffidl-find-photo {pointer pointer-utf8} Tk_PhotoHandle \
@@ -30,17 +31,14 @@ ffidl::callout ffidl-photo-get-size {Tk_PhotoHandle pointer-var pointer-var} voi
 ffidl::callout ffidl-photo-set-size {Tk_PhotoHandle int int} void \
     [ffidl::stubsymbol tk stubs 150]; #Tk_PhotoSetSize
 
-# use the ffidl::info format for Tk_PhotoImageBlock to get the fields
+# read the fields of a Tk_PhotoImageBlock
 proc ffidl-photo-block-fields {pib} {
-    binary scan $pib [ffidl::info format Tk_PhotoImageBlock] \
+    ffidl::struct get Tk_PhotoImageBlock $pib \
 	pixelPtr width height pitch pixelSize red green blue reserved
-    list $pixelPtr $width $height $pitch $pixelSize $red $green $blue $reserved
 }
 # define accessors for the fields
-foreach {name offset} {
-    pixelPtr 0 width 1 height 2 pitch 3 pixelSize 4 red 5 green 6 blue 7 reserved 8
-} {
-    proc ffidl-photo-block.$name {pib} "lindex \[ffidl-photo-block-fields \$pib] $offset"
+foreach name {pixelPtr width height pitch pixelSize red green blue reserved} {
+    proc ffidl-photo-block.$name {pib} "ffidl::struct get Tk_PhotoImageBlock \$pib $name"
 }
 
 proc ffidl-photo-get-block-bytes {block} {
@@ -98,6 +98,18 @@ static void *tkStubsPtr, *tkPlatStubsPtr, *tkIntStubsPtr, *tkIntPlatStubsPtr, *t
 #include <string.h>
 #include <stdlib.h>
 
+#if defined(__WIN32__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef WIN32_LEAN_AND_MEAN
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 /*
  * We can use either
  * libffi, with a no strings attached license,
@@ -120,14 +132,22 @@ static void *tkStubsPtr, *tkPlatStubsPtr, *tkIntStubsPtr, *tkIntPlatStubsPtr, *t
 #endif
 
 /*
- * We use two defines from ffi.h:
- *  FFI_NATIVE_RAW_API which indicates support for raw ffi api.
+ * We use three defines from ffi.h:
+ *  FFI_NO_RAW_API which indicates the raw ffi api is missing.
+ *  FFI_NATIVE_RAW_API which indicates native support for raw ffi api,
+ *    otherwise libffi emulates it on top of ffi_call.
  *  FFI_CLOSURES which indicates support for callbacks.
  * libffi-1.20 doesn't define the latter, so we default it.
  */
 #include <ffi.h>
 
-#define USE_LIBFFI_RAW_API FFI_NATIVE_RAW_API
+#if defined(FFI_NO_RAW_API) && FFI_NO_RAW_API
+#define USE_LIBFFI_RAW_API 0
+#else
+#define USE_LIBFFI_RAW_API 1
+#endif
+/* only use the raw api by default where it saves work */
+#define FFIDL_RAW_API_DEFAULT FFI_NATIVE_RAW_API
 
 
 #ifndef FFI_CLOSURES
@@ -430,6 +450,9 @@ enum ffidl_typecode {
     FFIDL_PTR_VAR	= 18,	/* byte array in variable */
     FFIDL_PTR_OBJ	= 19,	/* Tcl_Obj pointer */
     FFIDL_PTR_PROC	= 20,	/* Pointer to Tcl proc */
+    FFIDL_PTR_STRING	= 21,	/* string pointer in a Tcl encoding */
+    FFIDL_PTR_UTF32	= 22,	/* UTF-32 string pointer */
+    FFIDL_ARRAY		= 23,	/* fixed size array of elements[0] */
 
 /*
  * aliases for unsized type names
@@ -565,11 +588,13 @@ enum ffidl_typecode {
 #  if defined(TCL_WIDE_INT_IS_LONG)
 #    define HAVE_WIDE_INT		0
 #    define Ffidl_NewInt64Obj		Tcl_NewLongObj
+#    define Ffidl_SetInt64Obj		Tcl_SetLongObj
 #    define Ffidl_GetInt64FromObj	Tcl_GetLongFromObj
 #    define Ffidl_Int64			long
 #  else
 #    define HAVE_WIDE_INT		1
 #    define Ffidl_NewInt64Obj		Tcl_NewWideIntObj
+#    define Ffidl_SetInt64Obj		Tcl_SetWideIntObj
 #    define Ffidl_GetInt64FromObj	Tcl_GetWideIntFromObj
 #    define Ffidl_Int64			Tcl_WideInt
 #  endif
@@ -608,30 +633,528 @@ enum ffidl_typecode {
 #endif
 
 #if FFIDL_POINTER_IS_LONG
+#  define FFIDL_GETPOINTER FFIDL_GETINT
+#else
+#  define FFIDL_GETPOINTER FFIDL_GETWIDEINT
+#endif
+
+/*
+ * Pointers made by ffidl are ffidl-pointer objects, which hold the
+ * address and an optional tag object, and print as the same integer
+ * the wrapped type would.  The string rep is only made on demand and
+ * the address is read back without parsing.  Integers of the wrapped
+ * type are accepted as pointers too; the tag is lost when the object
+ * shimmers, for instance in expr.
+ */
+#define FFIDL_POINTER_ADDR(obj) ((obj)->internalRep.twoPtrValue.ptr1)
+#define FFIDL_POINTER_TAG(obj) ((Tcl_Obj *)(obj)->internalRep.twoPtrValue.ptr2)
+
+static void pointer_free(Tcl_Obj *obj)
+{
+  if (FFIDL_POINTER_TAG(obj) != NULL) {
+    Tcl_DecrRefCount(FFIDL_POINTER_TAG(obj));
+  }
+}
+static void pointer_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  dup->internalRep = src->internalRep;
+  dup->typePtr = src->typePtr;
+  if (FFIDL_POINTER_TAG(dup) != NULL) {
+    Tcl_IncrRefCount(FFIDL_POINTER_TAG(dup));
+  }
+}
+static void pointer_update_string(Tcl_Obj *obj)
+{
+  char buff[TCL_INTEGER_SPACE*2];
+#if FFIDL_POINTER_IS_LONG
+  sprintf(buff, "%ld", (long)FFIDL_POINTER_ADDR(obj));
+#else
+  sprintf(buff, "%" TCL_LL_MODIFIER "d", (Tcl_WideInt)FFIDL_POINTER_ADDR(obj));
+#endif
+  obj->length = strlen(buff);
+  obj->bytes = Tcl_Alloc(obj->length+1);
+  memcpy(obj->bytes, buff, obj->length+1);
+}
+
+static const Tcl_ObjType ffidl_pointer_ObjType = {
+  "ffidl-pointer",
+  pointer_free,
+  pointer_dup,
+  pointer_update_string,
+  NULL
+};
+
+/* make obj, which must be unshared, a pointer to ptr tagged with tag */
+static void Ffidl_SetTaggedPointerObj(Tcl_Obj *obj, void *ptr, Tcl_Obj *tag) {
+  if (tag != NULL) {
+    Tcl_IncrRefCount(tag);
+  }
+  Tcl_InvalidateStringRep(obj);
+  if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+    obj->typePtr->freeIntRepProc(obj);
+  }
+  obj->internalRep.twoPtrValue.ptr1 = ptr;
+  obj->internalRep.twoPtrValue.ptr2 = tag;
+  obj->typePtr = &ffidl_pointer_ObjType;
+}
+static void Ffidl_SetPointerObj(Tcl_Obj *obj, void *ptr) {
+  Ffidl_SetTaggedPointerObj(obj, ptr, NULL);
+}
 static Tcl_Obj *Ffidl_NewPointerObj(void *ptr) {
-  return Tcl_NewLongObj((long)ptr);
+  Tcl_Obj *obj = Tcl_NewObj();
+  Ffidl_SetPointerObj(obj, ptr);
+  return obj;
 }
 static int Ffidl_GetPointerFromObj(Tcl_Interp *interp, Tcl_Obj *obj, void **ptr) {
   int status;
+#if FFIDL_POINTER_IS_LONG
   long l;
+#else
+  Tcl_WideInt l;
+#endif
+  if (obj->typePtr == &ffidl_pointer_ObjType) {
+    *ptr = FFIDL_POINTER_ADDR(obj);
+    return TCL_OK;
+  }
+#if FFIDL_POINTER_IS_LONG
   status = Tcl_GetLongFromObj(interp, obj, &l);
+#else
+  status = Tcl_GetWideIntFromObj(interp, obj, &l);
+#endif
   *ptr = (void *)l;
   return status;
 }
-#  define FFIDL_GETPOINTER FFIDL_GETINT
+
+/*
+ * Native buffers.
+ *
+ * An ffidl-buffer object owns a block of native memory, or a view into
+ * another buffer's block, and frees it when the last object referring
+ * to it goes.  Buffers are passed to pointer, pointer-byte and
+ * pointer-var arguments by address, without copying.  An owner made by
+ * ::ffidl::mmap holds a file mapping instead of allocated memory, and
+ * unmaps it when it goes.
+ *
+ * The string rep of a buffer is a handle naming it, never its contents,
+ * so every value sharing the storage reads the same.  The live buffers
+ * of a thread are kept in a table, and a value which shimmered to
+ * another type, as with string length, is found again by its handle.
+ * When a buffer's last object shimmers, the buffer keeps the reference
+ * for the handle until the value is used as a buffer again or the
+ * thread exits.
+ */
+typedef struct ffidl_buffer ffidl_buffer;
+struct ffidl_buffer {
+  int refs;			/* Objects and views referring to this buffer. */
+  ffidl_buffer *base;		/* Buffer viewed into, or NULL for an owner. */
+  unsigned char *bytes;
+  Tcl_WideInt size;
+  void *map;			/* Start of the owner's file mapping, or NULL. */
+  size_t maplen;		/* Length of the mapping. */
+  int readonly;			/* Scripts may not write the contents. */
+  int orphans;			/* References kept for values that shimmered. */
+};
+
+#define FFIDL_BUFFER(obj) ((ffidl_buffer *)(obj)->internalRep.twoPtrValue.ptr1)
+#define FFIDL_BUFFER_PREFIX "ffidl-buffer"
+
+typedef struct ffidl_buffer_table {
+  int initialized;
+  Tcl_HashTable buffers;	/* Live buffers of this thread, by address. */
+} ffidl_buffer_table;
+
+static Tcl_ThreadDataKey buffer_table_key;
+
+static void buffer_dec_ref(ffidl_buffer *buffer);
+
+/* drop the references kept for shimmered values when the thread exits */
+static void buffer_table_exit(ClientData clientData)
+{
+  ffidl_buffer_table *table = (ffidl_buffer_table *)clientData;
+  Tcl_HashSearch search;
+  Tcl_HashEntry *entry;
+  ffidl_buffer **orphaned;
+  int i, n = 0;
+
+  orphaned = (ffidl_buffer **)Tcl_Alloc((table->buffers.numEntries+1)*sizeof(ffidl_buffer *));
+  for (entry = Tcl_FirstHashEntry(&table->buffers, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    if (((ffidl_buffer *)Tcl_GetHashValue(entry))->orphans > 0) {
+      orphaned[n++] = (ffidl_buffer *)Tcl_GetHashValue(entry);
+    }
+  }
+  /* each keeps itself alive until its own references go */
+  for (i = 0; i < n; i++) {
+    while (orphaned[i]->orphans > 0) {
+      orphaned[i]->orphans -= 1;
+      buffer_dec_ref(orphaned[i]);
+    }
+  }
+  Tcl_Free((char *)orphaned);
+  Tcl_DeleteHashTable(&table->buffers);
+  table->initialized = 0;
+}
+static Tcl_HashTable *buffer_table(void)
+{
+  ffidl_buffer_table *table = (ffidl_buffer_table *)Tcl_GetThreadData(&buffer_table_key, sizeof(ffidl_buffer_table));
+  if ( ! table->initialized) {
+    Tcl_InitHashTable(&table->buffers, TCL_ONE_WORD_KEYS);
+    table->initialized = 1;
+    Tcl_CreateThreadExitHandler(buffer_table_exit, (ClientData)table);
+  }
+  return &table->buffers;
+}
+
+static void buffer_dec_ref(ffidl_buffer *buffer)
+{
+  if (--buffer->refs == 0) {
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(buffer_table(), (char *)buffer);
+    if (entry != NULL) {
+      Tcl_DeleteHashEntry(entry);
+    }
+    if (buffer->base != NULL) {
+      buffer_dec_ref(buffer->base);
+    } else if (buffer->map != NULL) {
+#if defined(__WIN32__)
+      UnmapViewOfFile(buffer->map);
 #else
-static Tcl_Obj *Ffidl_NewPointerObj(void *ptr) {
-  return Tcl_NewWideIntObj((Tcl_WideInt)ptr);
+      munmap(buffer->map, buffer->maplen);
+#endif
+    } else {
+      Tcl_Free((char *)buffer->bytes);
+    }
+    Tcl_Free((char *)buffer);
+  }
 }
-static int Ffidl_GetPointerFromObj(Tcl_Interp *interp, Tcl_Obj *obj, void **ptr) {
-  int status;
-  Tcl_WideInt w;
-  status = Tcl_GetWideIntFromObj(interp, obj, &w);
-  *ptr = (void *)w;
-  return status;
+static void buffer_free(Tcl_Obj *obj)
+{
+  if (obj->bytes != NULL && obj->refCount > 0) {
+    /* shimmering, the value lives on as the handle */
+    FFIDL_BUFFER(obj)->orphans += 1;
+  } else {
+    buffer_dec_ref(FFIDL_BUFFER(obj));
+  }
 }
-#  define FFIDL_GETPOINTER FFIDL_GETWIDEINT
+static void buffer_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  FFIDL_BUFFER(src)->refs += 1;
+  dup->internalRep.twoPtrValue.ptr1 = FFIDL_BUFFER(src);
+  dup->typePtr = src->typePtr;
+}
+static void buffer_update_string(Tcl_Obj *obj)
+{
+  char buff[64];
+  sprintf(buff, FFIDL_BUFFER_PREFIX "%p", (void *)FFIDL_BUFFER(obj));
+  obj->length = strlen(buff);
+  obj->bytes = Tcl_Alloc(obj->length+1);
+  memcpy(obj->bytes, buff, obj->length+1);
+}
+
+static const Tcl_ObjType ffidl_buffer_ObjType = {
+  "ffidl-buffer",
+  buffer_free,
+  buffer_dup,
+  buffer_update_string,
+  NULL
+};
+
+/* make a new object for buffer, entering a new buffer in the table */
+static Tcl_Obj *buffer_new_obj(ffidl_buffer *buffer)
+{
+  Tcl_Obj *obj = Tcl_NewObj();
+  int isNew;
+  if (buffer->refs == 0) {
+    buffer->orphans = 0;
+    Tcl_SetHashValue(Tcl_CreateHashEntry(buffer_table(), (char *)buffer, &isNew), buffer);
+  }
+  Tcl_InvalidateStringRep(obj);
+  buffer->refs += 1;
+  obj->internalRep.twoPtrValue.ptr1 = buffer;
+  obj->typePtr = &ffidl_buffer_ObjType;
+  return obj;
+}
+/*
+ * The buffer obj holds or names, making obj a buffer again if it
+ * shimmered, or NULL if it is not a buffer.
+ */
+static ffidl_buffer *buffer_from_obj(Tcl_Obj *obj)
+{
+  Tcl_HashEntry *entry;
+  ffidl_buffer *buffer;
+  void *ptr;
+  int n;
+
+  if (obj->typePtr == &ffidl_buffer_ObjType) {
+    return FFIDL_BUFFER(obj);
+  }
+  /* a handle always has a string rep */
+  if (obj->bytes == NULL || strncmp(obj->bytes, FFIDL_BUFFER_PREFIX, sizeof(FFIDL_BUFFER_PREFIX)-1) != 0 ||
+      sscanf(obj->bytes+sizeof(FFIDL_BUFFER_PREFIX)-1, "%p%n", &ptr, &n) != 1 ||
+      n != obj->length-(int)sizeof(FFIDL_BUFFER_PREFIX)+1) {
+    return NULL;
+  }
+  entry = Tcl_FindHashEntry(buffer_table(), (char *)ptr);
+  if (entry == NULL) {
+    return NULL;
+  }
+  buffer = (ffidl_buffer *)Tcl_GetHashValue(entry);
+  if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+    obj->typePtr->freeIntRepProc(obj);
+  }
+  /* take back a reference kept for a shimmered value */
+  if (buffer->orphans > 0) {
+    buffer->orphans -= 1;
+  } else {
+    buffer->refs += 1;
+  }
+  obj->internalRep.twoPtrValue.ptr1 = buffer;
+  obj->typePtr = &ffidl_buffer_ObjType;
+  return buffer;
+}
+
+/*
+ * Encoded strings.
+ *
+ * A string passed to a pointer-string:ENC, pointer-utf16 or
+ * pointer-utf32 argument keeps its external form in an ffidl-extstring
+ * internal rep, so passing the same value again costs no conversion.
+ * The rep holds a reference to its encoding and is only reused for the
+ * same encoding, or for the same code unit width when it has none.
+ * It is reference counted, so that a callout frame can keep the bytes
+ * it passes alive while another argument converts the same object.
+ */
+typedef struct ffidl_extstring ffidl_extstring;
+struct ffidl_extstring {
+  int refCount;			/* The object's and those of callout frames. */
+  Tcl_Encoding encoding;	/* NULL for UTF-16 and UTF-32. */
+  int unit;			/* Code unit size of UTF-16 and UTF-32. */
+  int length;			/* Bytes, not counting the terminator. */
+  char *bytes;			/* Follows the struct, zero padded. */
+};
+
+#define FFIDL_EXTSTRING(obj) ((ffidl_extstring *)(obj)->internalRep.otherValuePtr)
+/* enough terminating zeroes for any encoding */
+#define FFIDL_EXTSTRING_PAD 4
+
+static void extstring_release(ffidl_extstring *ext)
+{
+  if (--ext->refCount > 0) {
+    return;
+  }
+  if (ext->encoding != NULL) {
+    Tcl_FreeEncoding(ext->encoding);
+  }
+  Tcl_Free((char *)ext);
+}
+static void extstring_free(Tcl_Obj *obj)
+{
+  extstring_release(FFIDL_EXTSTRING(obj));
+}
+/* duplicates are left as plain strings */
+static void extstring_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+}
+
+static const Tcl_ObjType ffidl_extstring_ObjType = {
+  "ffidl-extstring",
+  extstring_free,
+  extstring_dup,
+  NULL,				/* the string rep is never invalidated */
+  NULL
+};
+
+/* allocate an external string with room for size bytes */
+static ffidl_extstring *extstring_alloc(Tcl_Encoding encoding, int unit, int size)
+{
+  ffidl_extstring *ext = (ffidl_extstring *)Tcl_Alloc(sizeof(ffidl_extstring)+size+FFIDL_EXTSTRING_PAD);
+  ext->refCount = 1;
+  ext->encoding = encoding == NULL ? NULL : Tcl_GetEncoding(NULL, Tcl_GetEncodingName(encoding));
+  ext->unit = unit;
+  ext->length = 0;
+  ext->bytes = (char *)(ext+1);
+  return ext;
+}
+/* terminate ext and make it the internal rep of obj, which has a string rep */
+static void extstring_set(Tcl_Obj *obj, ffidl_extstring *ext)
+{
+  memset(ext->bytes+ext->length, 0, FFIDL_EXTSTRING_PAD);
+  if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+    obj->typePtr->freeIntRepProc(obj);
+  }
+  obj->internalRep.otherValuePtr = ext;
+  obj->typePtr = &ffidl_extstring_ObjType;
+}
+
+/* convert obj to encoding, short strings through a stack buffer */
+static void extstring_convert(Tcl_Obj *obj, Tcl_Encoding encoding)
+{
+  char stack[256];
+  Tcl_DString ds;
+  ffidl_extstring *ext;
+  const char *src, *dst = stack;
+  int srclen, dstlen;
+
+  src = Tcl_GetStringFromObj(obj, &srclen);
+  Tcl_DStringInit(&ds);
+  if (Tcl_UtfToExternal(NULL, encoding, src, srclen, TCL_ENCODING_START|TCL_ENCODING_END, NULL,
+			stack, sizeof(stack), NULL, &dstlen, NULL) != TCL_OK) {
+    dst = Tcl_UtfToExternalDString(encoding, src, srclen, &ds);
+    dstlen = Tcl_DStringLength(&ds);
+  }
+  ext = extstring_alloc(encoding, 0, dstlen);
+  memcpy(ext->bytes, dst, dstlen);
+  ext->length = dstlen;
+  Tcl_DStringFree(&ds);
+  extstring_set(obj, ext);
+}
+
+/*
+ * UTF-16 and UTF-32 transcoding, done here rather than through
+ * Tcl_UniChar, whose width depends on how Tcl was built.  Runs of
+ * ASCII are copied a machine word at a time.
+ */
+#define FFIDL_ASCII_MASK (~0UL/255*128)
+#define FFIDL_SURROGATE_HI(ch) ((ch) >= 0xD800 && (ch) < 0xDC00)
+#define FFIDL_SURROGATE_LO(ch) ((ch) >= 0xDC00 && (ch) < 0xE000)
+
+/* decode one character of Tcl's utf-8, bytes that are not utf-8 stand for themselves */
+static int utf_decode(const unsigned char *src, const unsigned char *end, unsigned long *ch)
+{
+  unsigned long c = src[0];
+  if (c >= 0xC0 && c < 0xE0 && end-src >= 2 && (src[1]&0xC0) == 0x80) {
+    *ch = ((c&0x1F)<<6)|(src[1]&0x3F);
+    return 2;
+  }
+  if (c >= 0xE0 && c < 0xF0 && end-src >= 3 && (src[1]&0xC0) == 0x80 && (src[2]&0xC0) == 0x80) {
+    *ch = ((c&0x0F)<<12)|((src[1]&0x3F)<<6)|(src[2]&0x3F);
+    return 3;
+  }
+  if (c >= 0xF0 && c < 0xF5 && end-src >= 4 && (src[1]&0xC0) == 0x80 && (src[2]&0xC0) == 0x80 &&
+      (src[3]&0xC0) == 0x80) {
+    *ch = ((c&0x07)<<18)|((src[1]&0x3F)<<12)|((src[2]&0x3F)<<6)|(src[3]&0x3F);
+    return 4;
+  }
+  *ch = c;
+  return 1;
+}
+/* encode one character as Tcl's utf-8 into dst, returning the bytes written */
+static int utf_encode(unsigned long ch, char *dst)
+{
+  if (ch > 0 && ch < 0x80) {
+    dst[0] = (char)ch;
+    return 1;
+  }
+  if (ch < 0x800) {		/* including the two byte form of NUL */
+    dst[0] = (char)(0xC0|(ch>>6));
+    dst[1] = (char)(0x80|(ch&0x3F));
+    return 2;
+  }
+  if (ch > 0xFFFF) {
+#if TCL_UTF_MAX <= 3
+    /* as a surrogate pair */
+    ch -= 0x10000;
+    return utf_encode(0xD800|(ch>>10), dst) + utf_encode(0xDC00|(ch&0x3FF), dst+3);
+#else
+    dst[0] = (char)(0xF0|(ch>>18));
+    dst[1] = (char)(0x80|((ch>>12)&0x3F));
+    dst[2] = (char)(0x80|((ch>>6)&0x3F));
+    dst[3] = (char)(0x80|(ch&0x3F));
+    return 4;
 #endif
+  }
+  dst[0] = (char)(0xE0|(ch>>12));
+  dst[1] = (char)(0x80|((ch>>6)&0x3F));
+  dst[2] = (char)(0x80|(ch&0x3F));
+  return 3;
+}
+
+/* convert obj to UTF-16 or UTF-32, as given by unit */
+static void extstring_convert_units(Tcl_Obj *obj, int unit)
+{
+  ffidl_extstring *ext;
+  const unsigned char *src, *end;
+  UINT16_T *d16;
+  UINT32_T *d32;
+  unsigned long ch, lo, word;
+  int srclen, n = 0, k;
+
+  src = (const unsigned char *)Tcl_GetStringFromObj(obj, &srclen);
+  end = src+srclen;
+  /* no utf-8 sequence makes more code units than it has bytes */
+  ext = extstring_alloc(NULL, unit, srclen*unit);
+  d16 = (UINT16_T *)ext->bytes;
+  d32 = (UINT32_T *)ext->bytes;
+  while (src < end) {
+    while (end-src >= (int)sizeof(word)) {
+      memcpy(&word, src, sizeof(word));
+      if (word & FFIDL_ASCII_MASK) break;
+      if (unit == 2) {
+	for (k = 0; k < (int)sizeof(word); k += 1) d16[n+k] = src[k];
+      } else {
+	for (k = 0; k < (int)sizeof(word); k += 1) d32[n+k] = src[k];
+      }
+      n += sizeof(word);
+      src += sizeof(word);
+    }
+    if (src == end) break;
+    src += utf_decode(src, end, &ch);
+    if (unit == 2) {
+      if (ch > 0xFFFF) {
+	ch -= 0x10000;
+	d16[n++] = (UINT16_T)(0xD800|(ch>>10));
+	d16[n++] = (UINT16_T)(0xDC00|(ch&0x3FF));
+      } else {
+	d16[n++] = (UINT16_T)ch;
+      }
+    } else {
+      /* join surrogate pairs from Tcl's utf-8 */
+      if (FFIDL_SURROGATE_HI(ch) && src < end && utf_decode(src, end, &lo) == 3 &&
+	  FFIDL_SURROGATE_LO(lo)) {
+	src += 3;
+	ch = 0x10000+((ch-0xD800)<<10)+(lo-0xDC00);
+      }
+      d32[n++] = (UINT32_T)ch;
+    }
+  }
+  ext->length = n*unit;
+  extstring_set(obj, ext);
+}
+
+/* make a string object from NUL terminated UTF-16 or UTF-32 */
+static Tcl_Obj *units_new_obj(const void *units, int unit)
+{
+  const UINT16_T *s16 = (const UINT16_T *)units;
+  const UINT32_T *s32 = (const UINT32_T *)units;
+  Tcl_DString ds;
+  Tcl_Obj *obj;
+  unsigned long ch;
+  char buff[8];
+  int i;
+
+  if (units == NULL) {
+    return Tcl_NewObj();
+  }
+  Tcl_DStringInit(&ds);
+  for (i = 0; ; i += 1) {
+    ch = unit == 2 ? s16[i] : s32[i];
+    if (ch == 0) break;
+    if (ch < 0x80) {
+      buff[0] = (char)ch;
+      Tcl_DStringAppend(&ds, buff, 1);
+      continue;
+    }
+    if (unit == 2 && FFIDL_SURROGATE_HI(ch) && FFIDL_SURROGATE_LO(s16[i+1])) {
+      ch = 0x10000+((ch-0xD800)<<10)+(s16[i+1]-0xDC00);
+      i += 1;
+    }
+    if (ch > 0x10FFFF) {
+      ch = 0xFFFD;
+    }
+    Tcl_DStringAppend(&ds, buff, utf_encode(ch, buff));
+  }
+  obj = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+  Tcl_DStringFree(&ds);
+  return obj;
+}
 
 /*****************************************
  * Due to an ancient libffi defect, not fixed due to compatibility concerns,
@@ -752,6 +1275,21 @@ typedef struct ffidl_callout ffidl_callout;
 typedef struct ffidl_callback ffidl_callback;
 typedef struct ffidl_closure ffidl_closure;
 typedef struct ffidl_lib ffidl_lib;
+typedef struct ffidl_framechunk ffidl_framechunk;
+
+/*
+ * Argument marshallers convert the Tcl_Obj for argument i into the value
+ * area pointed to by *argp, or redirect *argp to the value, and return a
+ * Tcl result code.  Return value marshallers convert the return value area
+ * into a new Tcl_Obj, or NULL for void.
+ */
+typedef int (ffidl_marshal_proc)(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp);
+typedef Tcl_Obj *(ffidl_unmarshal_proc)(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse);
+/*
+ * Native call stubs call fn with the arguments pointed to by args,
+ * and store its return value at ret.
+ */
+typedef void (ffidl_stub_proc)(void (*fn)(), void *ret, void **args);
 
 /*
  * The ffidl_value structure contains a union used
@@ -800,6 +1338,10 @@ struct ffidl_type {
    enum __AVtype lib_type;	/* ffcall's type data */
    int splittable;
 #endif
+   Tcl_Encoding encoding;	/* Encoding of a pointer-string type */
+   size_t *offsets;		/* Offsets of an aggregate's elements */
+   char **fields;		/* Field names of an aggregate, or NULL */
+   size_t count;		/* Number of elements of an array */
 };
 
 /*
@@ -816,6 +1358,38 @@ struct ffidl_client {
   Tcl_HashTable callouts;
   Tcl_HashTable libs;
   Tcl_HashTable callbacks;
+  ffidl_framechunk *frames;	/* Stack of callout frames. */
+  Tcl_Obj *results[4];		/* Recycled scalar result objects. */
+  unsigned long generation;	/* Tells clients apart in cached type names. */
+  int nextresult;		/* Slot the next new result replaces. */
+};
+
+/*
+ * Scalar callout results are written into an object nobody else
+ * refers to whenever one is at hand: the interpreter's own result, or
+ * one of the few objects the client keeps for the purpose.
+ */
+#define FFIDL_RESULT_CACHE (sizeof(((ffidl_client *)0)->results)/sizeof(Tcl_Obj *))
+
+/*
+ * Each invocation of a callout converts its arguments into a frame
+ * of its own, laid out as the return value area, the argument value
+ * area, the argument pointers and, for each argument, the external
+ * string it holds until the call returns.  Frames of up to
+ * FFIDL_FRAME_STACK_VALUES values live on the C stack, larger ones
+ * are taken from a per client stack of chunks, so that nested and
+ * recursive calls of the same callout never share storage.
+ */
+#define FFIDL_FRAME_STACK_VALUES 32
+#define FFIDL_FRAME_CHUNK_VALUES 1024
+/* number of ffidl_values needed to hold bytes */
+#define FFIDL_VALUES(bytes) (((bytes)+sizeof(ffidl_value)-1)/sizeof(ffidl_value))
+
+struct ffidl_framechunk {
+  ffidl_framechunk *prev;	/* Next chunk down the stack. */
+  size_t size;			/* Capacity, in ffidl_values. */
+  size_t used;			/* Values in use, in ffidl_values. */
+  ffidl_value data[1];		/* The frames. */
 };
 
 /*
@@ -826,7 +1400,8 @@ struct ffidl_client {
  */
 struct ffidl_cif {
    int refs;		   /* Reference counting. */
-   ffidl_client *client;   /* Backpointer to the ffidl_client. */
+   ffidl_client *client;   /* Backpointer to the ffidl_client, NULL once it is gone. */
+   Tcl_HashEntry *entry;   /* Entry in the client's cif table. */
    int protocol;	   /* Calling convention. */
    ffidl_type *rtype;	   /* Type of return value. */
    int argc;		   /* Number of arguments. */
@@ -835,6 +1410,12 @@ struct ffidl_cif {
    ffi_type **lib_atypes;	/* Pointer to storage area for libffi's internal
 				 * argument types. */
    ffi_cif lib_cif;		/* Libffi's internal data. */
+#if USE_LIBFFI_RAW_API
+   ptrdiff_t *raw_offsets;	/* Argument offsets in libffi's raw
+				 * argument area, NULL if the raw api
+				 * can't be used for this signature. */
+   size_t raw_size;		/* Size of the raw argument area. */
+#endif
 #endif
 };
 
@@ -848,12 +1429,19 @@ struct ffidl_callout {
   ffidl_cif *cif;
   void (*fn)();
   ffidl_client *client;
-  void *ret;		   /* Where to store the return value. */
-  void **args;		   /* Where to store each of the arguments' values. */
+  Tcl_HashEntry *entry;	   /* Entry in the client's callout table. */
+  ptrdiff_t *offsets;	   /* Byte offset of each argument's value in the value area. */
+  size_t retsize;	   /* Size of the return value area, in ffidl_values. */
+  size_t valuesize;	   /* Size of the argument value area, in ffidl_values. */
+  size_t framesize;	   /* Size of a whole frame, in ffidl_values. */
+  ffidl_marshal_proc **marshal;	/* Converter for each of the arguments. */
+  ffidl_unmarshal_proc *unmarshal; /* Converter for the return value. */
   char *usage;
-#if USE_LIBFFI && USE_LIBFFI_RAW_API
   int use_raw_api;		/* Whether to use libffi's raw API. */
-#endif
+  ffidl_stub_proc *stub;	/* Native call stub, or NULL. */
+  int scalar;			/* Whether the result can be set in place. */
+  int holds;			/* Whether arguments hold external strings. */
+  Tcl_Obj *retvar;		/* Variable receiving a struct result, or NULL. */
 };
 
 #if USE_CALLBACKS
@@ -869,6 +1457,45 @@ struct ffidl_closure {
    callback_t lib_closure;
 #endif
 };
+/*
+ * The ffidl_compare describes a comparison function made by
+ * ::ffidl::callback -native, which never enters Tcl.  Elements are
+ * compared as the scalar type given by typecode, as bytes
+ * (FFIDL_PTR_BYTE) or as the strings they point to (FFIDL_PTR_UTF8).
+ */
+typedef struct ffidl_compare {
+  int typecode;			/* How keys compare, FFIDL_VOID for a script callback. */
+  size_t offset;		/* Of the key within each element. */
+  size_t length;		/* Of the key compared as bytes. */
+  int sign;			/* 1, or -1 for descending order. */
+} ffidl_compare;
+/*
+ * A queued callback's calls wait in a bounded ring of cells, each a
+ * sequence number followed by the arguments of one call.  Producers
+ * on any thread claim and fill cells without a lock, and the thread
+ * of the callback drains them in batches.
+ */
+typedef struct ffidl_queue {
+  size_t mask;			/* Number of cells less one. */
+  size_t cellsize;		/* Bytes per cell. */
+  int overflow;			/* What a call does when the ring is full. */
+  char *cells;
+  size_t *offsets;		/* Argument offsets in a cell. */
+  volatile size_t head;		/* Next cell to fill. */
+  char pad1[64];		/* Keep producers and consumer apart. */
+  volatile size_t tail;		/* Next cell to drain. */
+  char pad2[64];
+  volatile size_t drops;	/* Calls dropped for want of room. */
+  volatile size_t scheduled;	/* Whether a drain is queued. */
+  int waiters;			/* Producers blocked for room. */
+  Tcl_Condition room;		/* Notified when a drain made room. */
+} ffidl_queue;
+
+enum {
+  FFIDL_QUEUE_BLOCK,		/* Wait for room. */
+  FFIDL_QUEUE_DROP_OLDEST,	/* Drop the oldest call to make room. */
+  FFIDL_QUEUE_COUNT_DROPS	/* Drop the new call. */
+};
 /*
  * The ffidl_callback binds a ffidl_cif pointer to
  * a Tcl proc name, it defines the signature of the
@@ -877,12 +1504,23 @@ struct ffidl_closure {
 struct ffidl_callback {
   ffidl_cif *cif;
   int cmdc;			/* Number of command prefix words. */
-  Tcl_Obj **cmdv;		/* Command prefix Tcl_Objs. */
+  Tcl_Obj **cmdv;		/* Command prefix Tcl_Objs, then argument slots. */
+  int depth;			/* Invocations in progress. */
+  Tcl_Command token;		/* Command cmdv[0] resolved to, or NULL. */
+  int epoch;			/* Its cmdEpoch when resolved. */
+  int nsepoch;			/* The global namespace's cmdRefEpoch then. */
+  ffidl_compare compare;	/* Native comparison instead of a script. */
   Tcl_Interp *interp;
+  Tcl_ThreadId thread;		/* Thread of interp, which runs the callback. */
+  int async;			/* Whether other threads return without waiting. */
+  ffidl_queue *queue;		/* Ring calls are batched through, or NULL. */
+  int users;			/* Calls from other threads in progress. */
+  int closed;			/* Being freed, other threads keep out. */
+  Tcl_Condition gone;		/* Notified when the last user leaves. */
   ffidl_closure closure;
 #if USE_LIBFFI_RAW_API
   int use_raw_api;		/* Whether to use libffi's raw API. */
-  ptrdiff_t *offsets;		/* Raw argument offsets. */
+  ptrdiff_t *offsets;		/* Raw argument offsets, from the cif. */
 #endif
 };
 #endif
@@ -904,6 +1542,7 @@ static const Tcl_ObjType *ffidl_int_ObjType;
 static const Tcl_ObjType *ffidl_wideInt_ObjType;
 #endif
 static const Tcl_ObjType *ffidl_double_ObjType;
+static const Tcl_ObjType *ffidl_list_ObjType;
 
 /*
  * base types, the ffi base types and some additional bits.
@@ -948,6 +1587,7 @@ static ffidl_type ffidl_type_pointer       = init_type(SIZEOF_VOID_P, FFIDL_PTR,
 static ffidl_type ffidl_type_pointer_obj   = init_type(SIZEOF_VOID_P, FFIDL_PTR_OBJ,   FFIDL_ARGRET|FFIDL_CBARG|FFIDL_CBRET, ALIGNOF_VOID_P, lib_type_pointer);
 static ffidl_type ffidl_type_pointer_utf8  = init_type(SIZEOF_VOID_P, FFIDL_PTR_UTF8,  FFIDL_ARGRET|FFIDL_CBARG,             ALIGNOF_VOID_P, lib_type_pointer);
 static ffidl_type ffidl_type_pointer_utf16 = init_type(SIZEOF_VOID_P, FFIDL_PTR_UTF16, FFIDL_ARGRET|FFIDL_CBARG,             ALIGNOF_VOID_P, lib_type_pointer);
+static ffidl_type ffidl_type_pointer_utf32 = init_type(SIZEOF_VOID_P, FFIDL_PTR_UTF32, FFIDL_ARGRET|FFIDL_CBARG,             ALIGNOF_VOID_P, lib_type_pointer);
 static ffidl_type ffidl_type_pointer_byte  = init_type(SIZEOF_VOID_P, FFIDL_PTR_BYTE,  FFIDL_ARG,                            ALIGNOF_VOID_P, lib_type_pointer);
 static ffidl_type ffidl_type_pointer_var   = init_type(SIZEOF_VOID_P, FFIDL_PTR_VAR,   FFIDL_ARG,                            ALIGNOF_VOID_P, lib_type_pointer);
 #if USE_CALLBACKS
@@ -1178,6 +1818,7 @@ static void *entry_lookup(Tcl_HashTable *table, char *name)
   return entry ? Tcl_GetHashValue(entry) : NULL;
 }
 /* find an entry by it's hash value */
+/*
 static Tcl_HashEntry *entry_find(Tcl_HashTable *table, void *datum)
 {
   Tcl_HashSearch search;
@@ -1189,6 +1830,7 @@ static Tcl_HashEntry *entry_find(Tcl_HashTable *table, void *datum)
   }
   return NULL;
 }
+*/
 /*
  * type management
  */
@@ -1198,9 +1840,57 @@ static void type_define(ffidl_client *client, char *tname, ffidl_type *ttype)
   entry_define(&client->types,tname,(void*)ttype);
 }
 /* lookup an existing type */
+static ffidl_type *type_string_define(ffidl_client *client, char *tname);
+static ffidl_type *type_array_define(ffidl_client *client, char *tname);
 static ffidl_type *type_lookup(ffidl_client *client, char *tname)
 {
-  return entry_lookup(&client->types,tname);
+  ffidl_type *type = entry_lookup(&client->types,tname);
+  if (type == NULL && strncmp(tname, "pointer-string:", 15) == 0) {
+    type = type_string_define(client, tname);
+  } else if (type == NULL && tname[0] != '\0' && tname[strlen(tname)-1] == ']') {
+    type = type_array_define(client, tname);
+  }
+  return type;
+}
+/*
+ * Type names cache the type they resolve to in an ffidl-type internal
+ * rep, together with the generation of the client that resolved them.
+ * Types are never redefined and live as long as their client, and
+ * each client has a generation of its own, so no other check is needed.
+ */
+static unsigned long type_generation = 0;
+TCL_DECLARE_MUTEX(type_generation_mutex)
+
+static const Tcl_ObjType ffidl_signature_ObjType;
+static const Tcl_ObjType ffidl_type_ObjType = {
+  "ffidl-type",
+  NULL,
+  NULL,
+  NULL,				/* the string rep is never invalidated */
+  NULL
+};
+
+/* lookup the type named by obj, NULL if there is none */
+static ffidl_type *type_lookup_obj(ffidl_client *client, Tcl_Obj *obj)
+{
+  ffidl_type *type;
+
+  if (obj->typePtr == &ffidl_type_ObjType &&
+      obj->internalRep.ptrAndLongRep.value == client->generation) {
+    return (ffidl_type *)obj->internalRep.ptrAndLongRep.ptr;
+  }
+  type = type_lookup(client, Tcl_GetString(obj));
+  /* a caller may hold the elements of a list rep, leave it alone */
+  if (type != NULL && obj->typePtr != ffidl_list_ObjType &&
+      obj->typePtr != &ffidl_signature_ObjType) {
+    if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+      obj->typePtr->freeIntRepProc(obj);
+    }
+    obj->internalRep.ptrAndLongRep.ptr = type;
+    obj->internalRep.ptrAndLongRep.value = client->generation;
+    obj->typePtr = &ffidl_type_ObjType;
+  }
+  return type;
 }
 /* find a type by it's ffidl_type */
 /*
@@ -1224,7 +1914,7 @@ static Tcl_HashEntry *type_find(ffidl_client *client, ffidl_type *type)
 /* build a binary format string */
 static int type_format(Tcl_Interp *interp, ffidl_type *type, int *offset)
 {
-  int i;
+  int i, length;
   char buff[128];
   /* Handle void case. */
   if (type->size == 0) {
@@ -1253,6 +1943,8 @@ static int type_format(Tcl_Interp *interp, ffidl_type *type, int *offset)
   case FFIDL_PTR_OBJ:
   case FFIDL_PTR_UTF8:
   case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_UTF32:
+  case FFIDL_PTR_STRING:
   case FFIDL_PTR_VAR:
   case FFIDL_PTR_PROC:
     switch (type->size) {
@@ -1297,6 +1989,22 @@ static int type_format(Tcl_Interp *interp, ffidl_type *type, int *offset)
       Tcl_AppendResult(interp, buff, NULL);
       return TCL_OK;
     }
+  case FFIDL_ARRAY:
+    /* a count on a single letter format, else the element's format repeated */
+    Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &i);
+    if (type_format(interp, type->elements[0], offset) != TCL_OK)
+      return TCL_ERROR;
+    Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &length);
+    if (length-i == 1) {
+      *offset += (type->count-1)*type->elements[0]->size;
+      sprintf(buff, "%lu", (long)(type->count));
+      Tcl_AppendResult(interp, buff, NULL);
+    } else {
+      for (i = 1; i < type->count; i += 1)
+	if (type_format(interp, type->elements[0], offset) != TCL_OK)
+	  return TCL_ERROR;
+    }
+    return TCL_OK;
   case FFIDL_STRUCT:
     for (i = 0; i < type->nelts; i += 1)
       if (type_format(interp, type->elements[i], offset) != TCL_OK)
@@ -1319,6 +2027,7 @@ static ffidl_type *type_alloc(ffidl_client *client, int nelts)
   ffidl_type *newtype;
   newtype = (ffidl_type *)Tcl_Alloc(sizeof(ffidl_type)
 				  +nelts*sizeof(ffidl_type*)
+				  +nelts*sizeof(size_t)
 #if USE_LIBFFI
 				  +sizeof(ffi_type)+(nelts+1)*sizeof(ffi_type *)
 #endif
@@ -1334,8 +2043,11 @@ static ffidl_type *type_alloc(ffidl_client *client, int nelts)
   newtype->refs = 0;
   newtype->nelts = nelts;
   newtype->elements = (ffidl_type **)(newtype+1);
+  newtype->offsets = (size_t *)(newtype->elements+nelts);
+  newtype->fields = NULL;
+  newtype->encoding = NULL;
 #if USE_LIBFFI
-  newtype->lib_type = (ffi_type *)(newtype->elements+nelts);
+  newtype->lib_type = (ffi_type *)(newtype->offsets+nelts);
   newtype->lib_type->size = 0;
   newtype->lib_type->alignment = 0;
   newtype->lib_type->type = FFI_TYPE_STRUCT;
@@ -1346,6 +2058,12 @@ static ffidl_type *type_alloc(ffidl_client *client, int nelts)
 /* free a type */
 static void type_free(ffidl_type *type)
 {
+  if (type->encoding != NULL) {
+    Tcl_FreeEncoding(type->encoding);
+  }
+  if (type->fields != NULL) {
+    Tcl_Free((void *)type->fields);
+  }
   Tcl_Free((void *)type);
 }
 /* maintain reference counts on type's */
@@ -1359,30 +2077,129 @@ static void type_dec_ref(ffidl_type *type)
     type_free(type);
   }
 }
-/* prep a type for use by the library */
-static int type_prep(ffidl_type *type)
+/*
+ * define pointer-string:ENC on first use, ENC naming a Tcl encoding
+ * or "system" for the system encoding at the time of definition.
+ */
+static ffidl_type *type_string_define(ffidl_client *client, char *tname)
 {
+  ffidl_type *newtype;
+  Tcl_Encoding encoding;
+  char *ename = tname+15;
+
+  encoding = Tcl_GetEncoding(NULL, strcmp(ename, "system") == 0 ? NULL : ename);
+  if (encoding == NULL) {
+    return NULL;
+  }
+  newtype = (ffidl_type *)Tcl_Alloc(sizeof(ffidl_type));
+  *newtype = ffidl_type_pointer_utf8;
+  newtype->refs = 0;
+  newtype->typecode = FFIDL_PTR_STRING;
+  newtype->class = FFIDL_ARGRET;
+  newtype->encoding = encoding;
+  type_define(client, tname, newtype);
+  type_inc_ref(newtype);
+  return newtype;
+}
+/*
+ * define T[N] on first use, an array of N elements of type T, which
+ * may itself be an array.  The array keeps one pointer to its element
+ * type, only libffi needs the element spelled out N times.
+ */
+static ffidl_type *type_array_define(ffidl_client *client, char *tname)
+{
+  ffidl_type *newtype, *base;
+  Tcl_DString ds;
+  char *open = strrchr(tname, '['), *end;
+  long count;
+  size_t header = sizeof(ffidl_type)+sizeof(ffidl_type *);
 #if USE_LIBFFI
   ffi_cif cif;
-  int i;
-  for (i = 0; i < type->nelts; i += 1)
-    type->lib_type->elements[i] = type->elements[i]->lib_type;
-  type->lib_type->elements[i] = NULL;
-  /* try out new type in a temporary cif, which should set size and alignment */
-  if (ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 0, type->lib_type, NULL) != FFI_OK)
-    return TCL_ERROR;
-  if (type->size != type->lib_type->size) {
-    fprintf(stderr, "ffidl disagrees with libffi about aggregate size of type %u! %lu != %lu\n", type->typecode, (long)(type->size), (long)(type->lib_type->size));
+  long i;
+  header += sizeof(ffi_type)+sizeof(ffi_type *);
+#endif
+
+  if (open == NULL || open == tname || open[1] < '0' || open[1] > '9') {
+    return NULL;
   }
-  if (type->alignment != type->lib_type->alignment) {
-    fprintf(stderr, "ffidl disagrees with libffi about aggregate alignment of type  %u! %hu != %hu\n", type->typecode, type->alignment, type->lib_type->alignment);
+  count = strtol(open+1, &end, 10);
+  if (*end != ']' || end[1] != '\0' || count < 1) {
+    return NULL;
   }
-#elif USE_LIBFFCALL
-  /* decide if the structure can be split into parts for register return */
-  /* Determine whether a struct type is word-splittable, i.e. whether each of
-   * its components fit into a register.
-   * These macros are adapted from ffcall-1.6/avcall/avcall.h/av_word_splittable*()
-   */
+  Tcl_DStringInit(&ds);
+  Tcl_DStringAppend(&ds, tname, open-tname);
+  base = type_lookup(client, Tcl_DStringValue(&ds));
+  Tcl_DStringFree(&ds);
+  if (base == NULL || (base->class & FFIDL_ELT) == 0 || base->size == 0 ||
+      count > INT_MAX/(long)base->size) {
+    return NULL;
+  }
+#if USE_LIBFFI
+  /* Tcl_AttemptAlloc takes an unsigned int, so bound the whole block */
+  if ((size_t)count > (INT_MAX-header)/sizeof(ffi_type *)) {
+    return NULL;
+  }
+  newtype = (ffidl_type *)Tcl_AttemptAlloc(header+count*sizeof(ffi_type *));
+#else
+  newtype = (ffidl_type *)Tcl_AttemptAlloc(header);
+#endif
+  if (newtype == NULL) {
+    return NULL;
+  }
+  memset(newtype, 0, sizeof(ffidl_type));
+  newtype->size = base->size*count;
+  newtype->typecode = FFIDL_ARRAY;
+  newtype->class = FFIDL_ELT;
+  newtype->alignment = base->alignment;
+  newtype->nelts = 1;
+  newtype->elements = (ffidl_type **)(newtype+1);
+  newtype->elements[0] = base;
+  newtype->count = count;
+#if USE_LIBFFI
+  newtype->lib_type = (ffi_type *)(newtype->elements+1);
+  newtype->lib_type->size = 0;
+  newtype->lib_type->alignment = 0;
+  newtype->lib_type->type = FFI_TYPE_STRUCT;
+  newtype->lib_type->elements = (ffi_type **)(newtype->lib_type+1);
+  for (i = 0; i < count; i += 1)
+    newtype->lib_type->elements[i] = base->lib_type;
+  newtype->lib_type->elements[count] = NULL;
+  if (ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 0, newtype->lib_type, NULL) != FFI_OK) {
+    type_free(newtype);
+    return NULL;
+  }
+#elif USE_LIBFFCALL
+  newtype->lib_type = lib_type_struct;
+  newtype->splittable = 0;
+#endif
+  type_define(client, tname, newtype);
+  type_inc_ref(newtype);
+  return newtype;
+}
+/* prep a type for use by the library */
+static int type_prep(ffidl_type *type)
+{
+#if USE_LIBFFI
+  ffi_cif cif;
+  int i;
+  for (i = 0; i < type->nelts; i += 1)
+    type->lib_type->elements[i] = type->elements[i]->lib_type;
+  type->lib_type->elements[i] = NULL;
+  /* try out new type in a temporary cif, which should set size and alignment */
+  if (ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 0, type->lib_type, NULL) != FFI_OK)
+    return TCL_ERROR;
+  if (type->size != type->lib_type->size) {
+    fprintf(stderr, "ffidl disagrees with libffi about aggregate size of type %u! %lu != %lu\n", type->typecode, (long)(type->size), (long)(type->lib_type->size));
+  }
+  if (type->alignment != type->lib_type->alignment) {
+    fprintf(stderr, "ffidl disagrees with libffi about aggregate alignment of type  %u! %hu != %hu\n", type->typecode, type->alignment, type->lib_type->alignment);
+  }
+#elif USE_LIBFFCALL
+  /* decide if the structure can be split into parts for register return */
+  /* Determine whether a struct type is word-splittable, i.e. whether each of
+   * its components fit into a register.
+   * These macros are adapted from ffcall-1.6/avcall/avcall.h/av_word_splittable*()
+   */
 #define ffidl_word_splittable_1(slot1)  \
   (__ffidl_offset1(slot1)/sizeof(__avword) == (__ffidl_offset1(slot1)+__ffidl_sizeof(slot1)-1)/sizeof(__avword))
 #define ffidl_word_splittable_2(slot1,slot2)  \
@@ -1433,18 +2250,15 @@ static int type_prep(ffidl_type *type)
 /* define a new cif */
 static void cif_define(ffidl_client *client, char *cname, ffidl_cif *cif)
 {
-  entry_define(&client->cifs,cname,(void*)cif);
+  int dummy;
+  cif->entry = Tcl_CreateHashEntry(&client->cifs,cname,&dummy);
+  Tcl_SetHashValue(cif->entry, cif);
 }
 /* lookup an existing cif */
 static ffidl_cif *cif_lookup(ffidl_client *client, char *cname)
 {
   return entry_lookup(&client->cifs,cname);
 }
-/* find a cif by it's ffidl_cif */
-static Tcl_HashEntry *cif_find(ffidl_client *client, ffidl_cif *cif)
-{
-  return entry_find(&client->cifs,(void *)cif);
-}
 /* allocate a cif and its parts */
 static ffidl_cif *cif_alloc(ffidl_client *client, int argc)
 {
@@ -1459,6 +2273,9 @@ static ffidl_cif *cif_alloc(ffidl_client *client, int argc)
 			       +argc*sizeof(ffidl_type*) /* atypes */
 #if USE_LIBFFI
 			       +argc*sizeof(ffi_type*) /* lib_atypes */
+#if USE_LIBFFI_RAW_API
+			       +argc*sizeof(ptrdiff_t) /* raw_offsets */
+#endif
 #endif /* USE_LIBFFI */
     );
   if (cif == NULL) {
@@ -1467,10 +2284,15 @@ static ffidl_cif *cif_alloc(ffidl_client *client, int argc)
   /* initialize the cif */
   cif->refs = 0;
   cif->client = client;
+  cif->entry = NULL;
   cif->argc = argc;
   cif->atypes = (ffidl_type **)(cif+1);
 #if USE_LIBFFI
   cif->lib_atypes = (ffi_type **)(cif->atypes+argc);
+#if USE_LIBFFI_RAW_API
+  cif->raw_offsets = NULL;
+  cif->raw_size = 0;
+#endif
 #endif /* USE_LIBFFI */
   return cif;
 }
@@ -1487,7 +2309,9 @@ static void cif_inc_ref(ffidl_cif *cif)
 static void cif_dec_ref(ffidl_cif *cif)
 {
   if (--cif->refs == 0) {
-    Tcl_DeleteHashEntry(cif_find(cif->client, cif));
+    if (cif->client != NULL) {
+      Tcl_DeleteHashEntry(cif->entry);
+    }
     cif_free(cif);
   }
 }
@@ -1512,12 +2336,10 @@ static void cif_dec_ref(ffidl_cif *cif)
  */
 static int cif_type_parse(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *typename, ffidl_type **typePtr)
 {
-  char *arg = Tcl_GetString(typename);
-
   /* lookup the type */
-  *typePtr = type_lookup(client, arg);
+  *typePtr = type_lookup_obj(client, typename);
   if (*typePtr == NULL) {
-    Tcl_AppendResult(interp, "no type defined for: ", arg, NULL);
+    Tcl_AppendResult(interp, "no type defined for: ", Tcl_GetString(typename), NULL);
     return TCL_ERROR;
   }
   return TCL_OK;
@@ -1560,7 +2382,7 @@ static int cif_raw_supported(ffidl_cif *cif)
        libffi < 3.3). */
     if (atype->typecode == FFIDL_STRUCT
 #if HAVE_LONG_DOUBLE
-	|| atypes->typecode == FFIDL_LONGDOUBLE
+	|| atype->typecode == FFIDL_LONGDOUBLE
 #endif
       )
       raw_api_supported = 0;
@@ -1569,7 +2391,7 @@ static int cif_raw_supported(ffidl_cif *cif)
 }
 
 /**
- * Prepare the arguments and return value areas and pointers.
+ * Compute the offset of each argument in the raw argument area.
  */
 static int cif_raw_prep_offsets(ffidl_cif *cif, ptrdiff_t *offsets)
 {
@@ -1585,11 +2407,43 @@ static int cif_raw_prep_offsets(ffidl_cif *cif, ptrdiff_t *offsets)
       offset = (offset|(FFI_SIZEOF_ARG-1))+1;
   }
   if (offset != bytes) {
-    fprintf(stderr, "ffidl and libffi disagree about bytes of argument! %d != %d\n", offset, bytes);
     return TCL_ERROR;
   }
   return TCL_OK;
 }
+
+/**
+ * Decide whether the raw API can be used on the @p cif, checking
+ * our argument offsets against the ones libffi uses.
+ */
+static void cif_raw_prep(ffidl_cif *cif)
+{
+  ptrdiff_t *offsets = (ptrdiff_t *)(cif->lib_atypes+cif->argc);
+  char *raw;
+  void **args;
+  int i, ok;
+
+  cif->raw_offsets = NULL;
+  cif->raw_size = ffi_raw_size(&cif->lib_cif);
+  if (!cif_raw_supported(cif) || cif_raw_prep_offsets(cif, offsets) != TCL_OK) {
+    return;
+  }
+  /* libffi only computes addresses here, no values are read */
+  raw = Tcl_Alloc(cif->raw_size+sizeof(ffi_raw));
+  args = (void **)Tcl_Alloc((cif->argc+1)*sizeof(void *));
+  ffi_raw_to_ptrarray(&cif->lib_cif, (ffi_raw *)raw, args);
+  ok = 1;
+  for (i = 0; i < cif->argc; i += 1) {
+    if ((char *)args[i] != raw+offsets[i]) {
+      ok = 0;
+    }
+  }
+  Tcl_Free((void *)args);
+  Tcl_Free(raw);
+  if (ok) {
+    cif->raw_offsets = offsets;
+  }
+}
 #endif
 
 /* do any library dependent prep for this cif */
@@ -1607,6 +2461,9 @@ static int cif_prep(ffidl_cif *cif)
   if (ffi_prep_cif(&cif->lib_cif, cif->protocol, cif->argc, lib_rtype, lib_atypes) != FFI_OK) {
     return TCL_ERROR;
   }
+#if USE_LIBFFI_RAW_API
+  cif_raw_prep(cif);
+#endif
 #endif
   return TCL_OK;
 }
@@ -1657,6 +2514,82 @@ static int cif_protocol(Tcl_Interp *interp, Tcl_Obj *obj, int *protocolp, char *
 #endif	/* USE_LIBFFCALL */
   return TCL_OK;
 }
+/*
+ * Argument lists remember the cif they were last parsed into in an
+ * ffidl-signature internal rep, which holds a reference to the cif and
+ * a copy of the list for its elements.  The cif is checked against the
+ * return type and protocol on each use.  Cached cifs may outlive their
+ * client, which then leaves them orphaned.
+ */
+typedef struct ffidl_signature {
+  unsigned long generation;	/* Generation of the client the cif belongs to. */
+  ffidl_cif *cif;
+  Tcl_Obj *list;		/* The argument list as a list. */
+} ffidl_signature;
+
+#define FFIDL_SIGNATURE(obj) ((ffidl_signature *)(obj)->internalRep.twoPtrValue.ptr1)
+
+static void signature_free(Tcl_Obj *obj)
+{
+  ffidl_signature *sig = FFIDL_SIGNATURE(obj);
+  cif_dec_ref(sig->cif);
+  Tcl_DecrRefCount(sig->list);
+  Tcl_Free((char *)sig);
+}
+static void signature_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  ffidl_signature *sig = (ffidl_signature *)Tcl_Alloc(sizeof(ffidl_signature));
+  *sig = *FFIDL_SIGNATURE(src);
+  cif_inc_ref(sig->cif);
+  Tcl_IncrRefCount(sig->list);
+  dup->internalRep.twoPtrValue.ptr1 = sig;
+  dup->typePtr = src->typePtr;
+}
+
+static const Tcl_ObjType ffidl_signature_ObjType = {
+  "ffidl-signature",
+  signature_free,
+  signature_dup,
+  NULL,				/* the string rep is never invalidated */
+  NULL
+};
+
+/* fetch the elements of an argument list, cached or not */
+static int cif_args(Tcl_Interp *interp, Tcl_Obj *args, int *argcp, Tcl_Obj ***argvp)
+{
+  if (args->typePtr == &ffidl_signature_ObjType) {
+    args = FFIDL_SIGNATURE(args)->list;
+  }
+  return Tcl_ListObjGetElements(interp, args, argcp, argvp);
+}
+
+/* remember cif in the argument list args */
+static void cif_remember(ffidl_client *client, Tcl_Obj *args, ffidl_cif *cif)
+{
+  ffidl_signature *sig;
+
+  if (args->typePtr == &ffidl_signature_ObjType) {
+    sig = FFIDL_SIGNATURE(args);
+    cif_inc_ref(cif);
+    cif_dec_ref(sig->cif);
+  } else {
+    /* the string rep must exist before the list rep goes */
+    Tcl_GetString(args);
+    sig = (ffidl_signature *)Tcl_Alloc(sizeof(ffidl_signature));
+    /* the copy shares the list's elements, which callers may hold */
+    sig->list = Tcl_DuplicateObj(args);
+    Tcl_IncrRefCount(sig->list);
+    cif_inc_ref(cif);
+    if (args->typePtr != NULL && args->typePtr->freeIntRepProc != NULL) {
+      args->typePtr->freeIntRepProc(args);
+    }
+    args->internalRep.twoPtrValue.ptr1 = sig;
+    args->typePtr = &ffidl_signature_ObjType;
+  }
+  sig->generation = client->generation;
+  sig->cif = cif;
+}
+
 /*
  * parse a cif argument list, return type, and protocol,
  * and find or create it in the cif table.
@@ -1668,10 +2601,21 @@ static int cif_parse(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *args, Tc
   char *protocolname;
   Tcl_DString signature;
   ffidl_cif *cif = NULL;
-  /* fetch argument types */
-  if (Tcl_ListObjGetElements(interp, args, &argc, &argv) == TCL_ERROR) return TCL_ERROR;
   /* fetch protocol */
   if (cif_protocol(interp, pro, &protocol, &protocolname) == TCL_ERROR) return TCL_ERROR;
+  /* try the cif this argument list was last parsed into */
+  if (args->typePtr == &ffidl_signature_ObjType) {
+    ffidl_signature *sig = FFIDL_SIGNATURE(args);
+    if (sig->generation == client->generation &&
+	sig->cif->protocol == protocol &&
+	type_lookup_obj(client, ret) == sig->cif->rtype) {
+      cif_inc_ref(sig->cif);
+      *cifp = sig->cif;
+      return TCL_OK;
+    }
+  }
+  /* fetch argument types */
+  if (cif_args(interp, args, &argc, &argv) == TCL_ERROR) return TCL_ERROR;
   /* build the cif signature key */
   Tcl_DStringInit(&signature);
   if (protocolname != NULL) {
@@ -1716,6 +2660,7 @@ static int cif_parse(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *args, Tc
   Tcl_DStringFree(&signature);
   /* mark the cif as referenced */
   cif_inc_ref(cif);
+  cif_remember(client, args, cif);
   /* return success */
   *cifp = cif;
   return TCL_OK;
@@ -1726,57 +2671,173 @@ error:
   Tcl_DStringFree(&signature);
   return TCL_ERROR;
 }
+/*
+ * Native call stubs.
+ *
+ * Hand-written calls for the most common signatures, which bypass
+ * libffi and ffcall altogether.  They are keyed by a canonical form of
+ * the signature string built by cif_parse, in which typedefs are
+ * resolved and every pointer flavour is a pointer.
+ */
+static void stub_double_double(void (*fn)(), void *ret, void **args)
+{
+  FFIDL_RVALUE_POKE_WIDENED(DOUBLE, ret, ((double (*)(double))fn)(*(double *)args[0]));
+}
+static void stub_double_double_double(void (*fn)(), void *ret, void **args)
+{
+  FFIDL_RVALUE_POKE_WIDENED(DOUBLE, ret, ((double (*)(double, double))fn)(*(double *)args[0], *(double *)args[1]));
+}
+#if SIZEOF_INT == 4
+static void stub_int_pointer(void (*fn)(), void *ret, void **args)
+{
+  FFIDL_RVALUE_POKE_WIDENED(SINT32, ret, ((int (*)(void *))fn)(*(void **)args[0]));
+}
+static void stub_int_pointer_int(void (*fn)(), void *ret, void **args)
+{
+  FFIDL_RVALUE_POKE_WIDENED(SINT32, ret, ((int (*)(void *, int))fn)(*(void **)args[0], *(int *)args[1]));
+}
+#endif
+static void stub_pointer_pointer(void (*fn)(), void *ret, void **args)
+{
+  FFIDL_RVALUE_POKE_WIDENED(PTR, ret, ((void *(*)(void *))fn)(*(void **)args[0]));
+}
+
+static const struct {
+  const char *signature;
+  ffidl_stub_proc *stub;
+} stub_table[] = {
+  { "double(double)", stub_double_double },
+  { "double(double,double)", stub_double_double_double },
+#if SIZEOF_INT == 4
+  { "int(pointer)", stub_int_pointer },
+  { "int(pointer,int)", stub_int_pointer_int },
+#endif
+  { "pointer(pointer)", stub_pointer_pointer },
+  { NULL, NULL }
+};
+
+/* name a type in a canonical signature, NULL if no stub handles it */
+static const char *stub_type_name(ffidl_type *type)
+{
+  switch (type->typecode) {
+  case FFIDL_DOUBLE:	return "double";
+#if SIZEOF_INT == 4
+  case FFIDL_SINT32:	return "int";
+#endif
+  case FFIDL_PTR:
+  case FFIDL_PTR_OBJ:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_UTF32:
+  case FFIDL_PTR_STRING:
+  case FFIDL_PTR_BYTE:
+  case FFIDL_PTR_VAR:
+  case FFIDL_PTR_PROC:	return "pointer";
+  default:		return NULL;
+  }
+}
+/* find the native stub for a cif, if any */
+static ffidl_stub_proc *cif_stub(ffidl_cif *cif)
+{
+  Tcl_DString signature;
+  const char *name;
+  ffidl_stub_proc *stub = NULL;
+  int i;
+
+#if USE_LIBFFI
+  if (cif->protocol != FFI_DEFAULT_ABI) {
+    return NULL;
+  }
+#endif
+  /* build the canonical signature */
+  Tcl_DStringInit(&signature);
+  if ((name = stub_type_name(cif->rtype)) == NULL) {
+    goto done;
+  }
+  Tcl_DStringAppend(&signature, name, -1);
+  Tcl_DStringAppend(&signature, "(", 1);
+  for (i = 0; i < cif->argc; i += 1) {
+    if ((name = stub_type_name(cif->atypes[i])) == NULL) {
+      goto done;
+    }
+    if (i != 0) Tcl_DStringAppend(&signature, ",", 1);
+    Tcl_DStringAppend(&signature, name, -1);
+  }
+  Tcl_DStringAppend(&signature, ")", 1);
+  /* look it up */
+  for (i = 0; stub_table[i].signature != NULL; i += 1) {
+    if (strcmp(stub_table[i].signature, Tcl_DStringValue(&signature)) == 0) {
+      stub = stub_table[i].stub;
+      break;
+    }
+  }
+done:
+  Tcl_DStringFree(&signature);
+  return stub;
+}
 /*
  * callout management
  */
 /* define a new callout */
 static void callout_define(ffidl_client *client, char *pname, ffidl_callout *callout)
 {
-  entry_define(&client->callouts,pname,(void*)callout);
+  int dummy;
+  callout->entry = Tcl_CreateHashEntry(&client->callouts,pname,&dummy);
+  Tcl_SetHashValue(callout->entry, callout);
 }
 /* lookup an existing callout */
 static ffidl_callout *callout_lookup(ffidl_client *client, char *pname)
 {
   return entry_lookup(&client->callouts,pname);
 }
-/* find a callout by it's ffidl_callout */
-static Tcl_HashEntry *callout_find(ffidl_client *client, ffidl_callout *callout)
-{
-  return entry_find(&client->callouts,(void *)callout);
-}
 /* cleanup on ffidl_callout_call deletion */
 static void callout_delete(ClientData clientData)
 {
   ffidl_callout *callout = (ffidl_callout *)clientData;
-  Tcl_HashEntry *entry = callout_find(callout->client, callout);
+  Tcl_HashEntry *entry = callout->entry;
   if (entry) {
     cif_dec_ref(callout->cif);
+    if (callout->retvar != NULL) {
+      Tcl_DecrRefCount(callout->retvar);
+    }
     Tcl_Free((void *)callout);
     Tcl_DeleteHashEntry(entry);
   }
 }
+/* find the callout behind a Tcl command */
+static ffidl_callout *callout_command(Tcl_Interp *interp, Tcl_Obj *nameObj)
+{
+  Tcl_CmdInfo info;
+  if (Tcl_GetCommandInfo(interp, Tcl_GetString(nameObj), &info) == 0 ||
+      info.deleteProc != callout_delete) {
+    Tcl_AppendResult(interp, "no callout named \"", Tcl_GetString(nameObj), "\" is defined", NULL);
+    return NULL;
+  }
+  return (ffidl_callout *)info.deleteData;
+}
+/* name the way a callout calls its function */
+static const char *callout_path(ffidl_callout *callout)
+{
+  if (callout->stub != NULL) {
+    return "native";
+  }
+#if USE_LIBFFI
+  return callout->use_raw_api ? "libffi-raw" : "libffi";
+#elif USE_LIBFFCALL
+  return "ffcall";
+#endif
+}
 /**
- * Parse an argument or return type specification.
- *
- * After invoking this function, @p type points to the @c ffidl_type
- * corresponding to @p typename, and @p argp is initialized
+ * Check an argument or return type specification.
  *
  * @param[in] interp Tcl interpreter.
- * @param[in] client Ffidle data.
  * @param[in] context Context where the type has been found.
- * @param[in] typename Tcl_Obj whose string representation is a type name.
- * @param[out] typePtr Points to the place to store the pointer to the parsed @c
- *     ffidl_type.
- * @param[in] valueArea Points to the area where values @p argp values should be
- *     stored.
- * @param[out] valuePtr Points to the place to store the address within @p valueArea
- *     where the arguments are to be retrieved or the return value shall be
- *     placed upon callout.
+ * @param[in] typeNameObj Tcl_Obj whose string representation is a type name.
+ * @param[in] typePtr The parsed @c ffidl_type.
  * @return TCL_OK if successful, TCL_ERROR otherwise.
  */
 static int callout_prep_value(Tcl_Interp *interp, unsigned context,
-			      Tcl_Obj *typeNameObj, ffidl_type *typePtr,
-			      ffidl_value *valueArea, void **valuePtr)
+			      Tcl_Obj *typeNameObj, ffidl_type *typePtr)
 {
   char buff[128];
 
@@ -1784,16 +2845,10 @@ static int callout_prep_value(Tcl_Interp *interp, unsigned context,
   if (cif_type_check_context(interp, context, typeNameObj, typePtr) != TCL_OK) {
     return TCL_ERROR;
   }
-  /* set arg value pointer */
+  /* test the type */
   switch (typePtr->typecode) {
   case FFIDL_VOID:
-    /* libffi depends on this being NULL on some platforms ! */
-    *valuePtr = NULL;
-    break;
   case FFIDL_STRUCT:
-    /* Will be set to a pointer to the structure's contents. */
-    *valuePtr = NULL;
-    break;
   case FFIDL_INT:
   case FFIDL_FLOAT:
   case FFIDL_DOUBLE:
@@ -1815,9 +2870,10 @@ static int callout_prep_value(Tcl_Interp *interp, unsigned context,
   case FFIDL_PTR_OBJ:
   case FFIDL_PTR_UTF8:
   case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_UTF32:
+  case FFIDL_PTR_STRING:
   case FFIDL_PTR_VAR:
   case FFIDL_PTR_PROC:
-    *valuePtr = (void *)valueArea;
     break;
   default:
     sprintf(buff, "unknown ffidl_type.t = %d", typePtr->typecode);
@@ -1827,50 +2883,105 @@ static int callout_prep_value(Tcl_Interp *interp, unsigned context,
   return TCL_OK;
 }
 
-static int callout_prep(ffidl_callout *callout)
+/* lay out the frame used by each invocation of a callout */
+static void callout_prep(ffidl_callout *callout, int raw)
 {
-#if USE_LIBFFI_RAW_API
-  int i;
   ffidl_cif *cif = callout->cif;
+  size_t valuebytes = cif->argc*sizeof(ffidl_value);
+  int i;
 
-  callout->use_raw_api = cif_raw_supported(cif);
-  callout->use_raw_api = 0;
-
-  if (callout->use_raw_api) {
-    /* rewrite callout->args[i] into a stack image */
-    ptrdiff_t *offsets;
-    offsets = (ptrdiff_t *)Tcl_Alloc(sizeof(ptrdiff_t) * cif->argc);
-    if (TCL_OK != cif_raw_prep_offsets(cif, offsets)) {
-      Tcl_Free((void *)offsets);
-      return TCL_ERROR;
-    }
-    /* fprintf(stderr, "using raw api for %d args\n", cif->argc); */
-    for (i = 0; i < cif->argc; i++) {
-      /* set args[i] to args[0]+offset */
-      /* fprintf(stderr, "  arg[%d] was %08x ...", i, callout->args[i]); */
-      callout->args[i] = (void *)(((char *)callout->args[0])+offsets[i]);
-      /* fprintf(stderr, " becomes %08x\n", callout->args[i]); */
+  callout->stub = cif_stub(cif);
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:
+  case FFIDL_STRUCT:
+  case FFIDL_PTR_OBJ:
+  case FFIDL_PTR_UTF8:
+  case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_UTF32:
+  case FFIDL_PTR_STRING:
+    callout->scalar = 0;
+    break;
+  default:
+    callout->scalar = 1;
+    break;
+  }
+  callout->holds = 0;
+  for (i = 0; i < cif->argc; i += 1) {
+    switch (cif->atypes[i]->typecode) {
+    case FFIDL_PTR_UTF16:
+    case FFIDL_PTR_UTF32:
+    case FFIDL_PTR_STRING:
+      callout->holds = 1;
+      break;
+    default:
+      break;
     }
-    /* fprintf(stderr, "  final offset %d, bytes %d\n", offset, bytes); */
-    Tcl_Free((void *)offsets);
   }
+  callout->use_raw_api = 0;
+#if USE_LIBFFI && USE_LIBFFI_RAW_API
+  /* fall back to ffi_call when the signature has no raw layout */
+  if (raw && cif->raw_offsets != NULL && callout->stub == NULL) {
+    /* arguments are packed into a stack image */
+    callout->use_raw_api = 1;
+    memcpy(callout->offsets, cif->raw_offsets, cif->argc*sizeof(ptrdiff_t));
+    valuebytes = cif->raw_size;
+  } else
 #endif
-  return TCL_OK;
+  for (i = 0; i < cif->argc; i += 1) {
+    callout->offsets[i] = i*sizeof(ffidl_value);
+  }
+  /* libffi depends on the return value pointer being NULL for void */
+  if (cif->rtype->typecode == FFIDL_VOID) {
+    callout->retsize = 0;
+  } else {
+    callout->retsize = FFIDL_VALUES(cif->rtype->size);
+    if (callout->retsize == 0) callout->retsize = 1;
+  }
+  callout->valuesize = FFIDL_VALUES(valuebytes);
+  callout->framesize = callout->retsize + callout->valuesize + FFIDL_VALUES(2*cif->argc*sizeof(void *));
+}
+
+/* take a frame of size values from the client's frame stack */
+static ffidl_value *callout_frame_alloc(ffidl_client *client, size_t size)
+{
+  ffidl_framechunk *chunk = client->frames;
+  ffidl_value *frame;
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    size_t csize = size > FFIDL_FRAME_CHUNK_VALUES ? size : FFIDL_FRAME_CHUNK_VALUES;
+    chunk = (ffidl_framechunk *)Tcl_Alloc(sizeof(ffidl_framechunk)+(csize-1)*sizeof(ffidl_value));
+    chunk->prev = client->frames;
+    chunk->size = csize;
+    chunk->used = 0;
+    client->frames = chunk;
+  }
+  frame = chunk->data + chunk->used;
+  chunk->used += size;
+  return frame;
+}
+/* return the topmost frame to the client's frame stack */
+static void callout_frame_free(ffidl_client *client, size_t size)
+{
+  ffidl_framechunk *chunk = client->frames;
+  chunk->used -= size;
+  /* keep the bottom chunk for reuse, release the others */
+  if (chunk->used == 0 && chunk->prev != NULL) {
+    client->frames = chunk->prev;
+    Tcl_Free((void *)chunk);
+  }
 }
 
-/* make a call */
-/* consider what happens if we reenter using the same cif */  
-static void callout_call(ffidl_callout *callout)
+/* make a call, with ret and args pointing into the invocation's frame */
+static void callout_call(ffidl_callout *callout, void *ret, void **args)
 {
   ffidl_cif *cif = callout->cif;
 #if USE_LIBFFI
 #if USE_LIBFFI_RAW_API
   if (callout->use_raw_api)
-    ffi_raw_call(&cif->lib_cif, callout->fn, callout->ret, (ffi_raw *)callout->args[0]);
+    ffi_raw_call(&cif->lib_cif, callout->fn, ret, cif->argc ? (ffi_raw *)args[0] : NULL);
   else
-    ffi_call(&cif->lib_cif, callout->fn, callout->ret, callout->args);
+    ffi_call(&cif->lib_cif, callout->fn, ret, args);
 #else
-  ffi_call(&cif->lib_cif, callout->fn, callout->ret, callout->args);
+  ffi_call(&cif->lib_cif, callout->fn, ret, args);
 #endif
 #elif USE_LIBFFCALL
   av_alist alist;
@@ -1880,106 +2991,110 @@ static void callout_call(ffidl_callout *callout)
     av_start_void(alist,callout->fn);
     break;
   case FFIDL_INT:
-    av_start_int(alist,callout->fn,callout->ret);
+    av_start_int(alist,callout->fn,ret);
     break;
   case FFIDL_FLOAT:
-    av_start_float(alist,callout->fn,callout->ret);
+    av_start_float(alist,callout->fn,ret);
     break;
   case FFIDL_DOUBLE:
-    av_start_double(alist,callout->fn,callout->ret);
+    av_start_double(alist,callout->fn,ret);
     break;
   case FFIDL_UINT8:
-    av_start_uint8(alist,callout->fn,callout->ret);
+    av_start_uint8(alist,callout->fn,ret);
     break;
   case FFIDL_SINT8:
-    av_start_sint8(alist,callout->fn,callout->ret);
+    av_start_sint8(alist,callout->fn,ret);
     break;
   case FFIDL_UINT16:
-    av_start_uint16(alist,callout->fn,callout->ret);
+    av_start_uint16(alist,callout->fn,ret);
     break;
   case FFIDL_SINT16:
-    av_start_sint16(alist,callout->fn,callout->ret);
+    av_start_sint16(alist,callout->fn,ret);
     break;
   case FFIDL_UINT32:
-    av_start_uint32(alist,callout->fn,callout->ret);
+    av_start_uint32(alist,callout->fn,ret);
     break;
   case FFIDL_SINT32:
-    av_start_sint32(alist,callout->fn,callout->ret);
+    av_start_sint32(alist,callout->fn,ret);
     break;
 #if HAVE_INT64
   case FFIDL_UINT64:
-    av_start_uint64(alist,callout->fn,callout->ret);
+    av_start_uint64(alist,callout->fn,ret);
     break;
   case FFIDL_SINT64:
-    av_start_sint64(alist,callout->fn,callout->ret);
+    av_start_sint64(alist,callout->fn,ret);
     break;
 #endif
   case FFIDL_STRUCT:
-    _av_start_struct(alist,callout->fn,cif->rtype->size,cif->rtype->splittable,callout->ret);
+    _av_start_struct(alist,callout->fn,cif->rtype->size,cif->rtype->splittable,ret);
     break;
   case FFIDL_PTR:
   case FFIDL_PTR_OBJ:
   case FFIDL_PTR_UTF8:
   case FFIDL_PTR_UTF16:
+  case FFIDL_PTR_UTF32:
+  case FFIDL_PTR_STRING:
   case FFIDL_PTR_BYTE:
   case FFIDL_PTR_VAR:
 #if USE_CALLBACKS
   case FFIDL_PTR_PROC:
 #endif
-    av_start_ptr(alist,callout->fn,void *,callout->ret);
+    av_start_ptr(alist,callout->fn,void *,ret);
     break;
   }
 
   for (i = 0; i < cif->argc; i += 1) {
     switch (cif->atypes[i]->typecode) {
     case FFIDL_INT:
-      av_int(alist,*(int *)callout->args[i]);
+      av_int(alist,*(int *)args[i]);
       continue;
     case FFIDL_FLOAT:
-      av_float(alist,*(float *)callout->args[i]);
+      av_float(alist,*(float *)args[i]);
       continue;
     case FFIDL_DOUBLE:
-      av_double(alist,*(double *)callout->args[i]);
+      av_double(alist,*(double *)args[i]);
       continue;
     case FFIDL_UINT8:
-      av_uint8(alist,*(UINT8_T *)callout->args[i]);
+      av_uint8(alist,*(UINT8_T *)args[i]);
       continue;
     case FFIDL_SINT8:
-      av_sint8(alist,*(SINT8_T *)callout->args[i]);
+      av_sint8(alist,*(SINT8_T *)args[i]);
       continue;
     case FFIDL_UINT16:
-      av_uint16(alist,*(UINT16_T *)callout->args[i]);
+      av_uint16(alist,*(UINT16_T *)args[i]);
       continue;
     case FFIDL_SINT16:
-      av_sint16(alist,*(SINT16_T *)callout->args[i]);
+      av_sint16(alist,*(SINT16_T *)args[i]);
       continue;
     case FFIDL_UINT32:
-      av_uint32(alist,*(UINT32_T *)callout->args[i]);
+      av_uint32(alist,*(UINT32_T *)args[i]);
       continue;
     case FFIDL_SINT32:
-      av_sint32(alist,*(SINT32_T *)callout->args[i]);
+      av_sint32(alist,*(SINT32_T *)args[i]);
       continue;
 #if HAVE_INT64
     case FFIDL_UINT64:
-      av_uint64(alist,*(UINT64_T *)callout->args[i]);
+      av_uint64(alist,*(UINT64_T *)args[i]);
       continue;
     case FFIDL_SINT64:
-      av_sint64(alist,*(SINT64_T *)callout->args[i]);
+      av_sint64(alist,*(SINT64_T *)args[i]);
       continue;
 #endif
     case FFIDL_STRUCT:
-      _av_struct(alist,cif->atypes[i]->size,cif->atypes[i]->alignment,callout->args[i]);
+      _av_struct(alist,cif->atypes[i]->size,cif->atypes[i]->alignment,args[i]);
       continue;
     case FFIDL_PTR:
     case FFIDL_PTR_OBJ:
     case FFIDL_PTR_UTF8:
     case FFIDL_PTR_UTF16:
+    case FFIDL_PTR_UTF32:
+    case FFIDL_PTR_STRING:
     case FFIDL_PTR_BYTE:
     case FFIDL_PTR_VAR:
 #if USE_CALLBACKS
     case FFIDL_PTR_PROC:
 #endif
-      av_ptr(alist,void *,*(void **)callout->args[i]);
+      av_ptr(alist,void *,*(void **)args[i]);
       continue;
     }
     /* Note: change "continue" to "break" if further work must be done here. */
@@ -2018,295 +3133,854 @@ static ffidl_LoadHandle lib_lookup(ffidl_client *client,
 /*
  * callback management
  */
-/* free a defined callback */
-static void callback_free(ffidl_callback *callback)
-{
-  if (callback) {
-    int i;
-    cif_dec_ref(callback->cif);
-    for (i = 0; i < callback->cmdc; i++) {
-      Tcl_DecrRefCount(callback->cmdv[i]);
-    }
+#if TCL_THREADS
+/*
+ * A callback fired on a thread other than the one which defined it
+ * is queued to its thread as an event.  The calling thread waits for
+ * the event to be handled, unless the callback is asynchronous, in
+ * which case the event carries a copy of the arguments.
+ *
+ * Calls from other threads count as users of the callback while they
+ * run, and only queue events while it is open, under the event mutex.
+ * Freeing the callback closes it, drops its queued events and waits
+ * for the users to leave.
+ */
+typedef struct ffidl_callback_event {
+  Tcl_Event header;
+  ffidl_callback *callback;
 #if USE_LIBFFI
-    ffi_closure_free(callback->closure.lib_closure);
+  ffi_cif *fficif;
+  void *ret;
+  void **args;
 #elif USE_LIBFFCALL
-    free_callback(callback->closure.lib_closure);
+  va_alist alist;
 #endif
-    Tcl_Free((void *)callback);
+  int *donep;			/* Set once handled, NULL when nobody waits. */
+  Tcl_Condition *condp;
+} ffidl_callback_event;
+
+TCL_DECLARE_MUTEX(callback_event_mutex)
+/* events queued to any thread, for threads waiting on their workers */
+static int callback_event_posts;
+static Tcl_Condition callback_event_posted;
+
+#if USE_LIBFFI
+static void callback_callback(ffi_cif *fficif, void *ret, void **args, void *user_data);
+static int callback_drain_proc(Tcl_Event *evPtr, int flags);
+#elif USE_LIBFFCALL
+static void callback_callback(void *user_data, va_alist alist);
+#endif
+
+/* become a user of callback, unless it is being freed */
+static int callback_enter(ffidl_callback *callback)
+{
+  int open;
+  Tcl_MutexLock(&callback_event_mutex);
+  open = ! callback->closed;
+  if (open) {
+    callback->users++;
   }
+  Tcl_MutexUnlock(&callback_event_mutex);
+  return open;
 }
-/* define a new callback */
-static void callback_define(ffidl_client *client, char *cname, ffidl_callback *callback)
+static void callback_leave(ffidl_callback *callback)
 {
-  ffidl_callback *old_callback = NULL;
-  /* if callback is already defined, clean it up. */
-  old_callback = entry_lookup(&client->callbacks,cname);
-  callback_free(old_callback);
-  entry_define(&client->callbacks,cname,(void*)callback);
+  Tcl_MutexLock(&callback_event_mutex);
+  if (--callback->users == 0 && callback->closed) {
+    Tcl_ConditionNotify(&callback->gone);
+  }
+  Tcl_MutexUnlock(&callback_event_mutex);
 }
-/* lookup an existing callback */
-static ffidl_callback *callback_lookup(ffidl_client *client, char *cname)
+/* queue event to the callback's thread, with the event mutex held */
+static void callback_event_post(ffidl_callback *callback, ffidl_callback_event *event)
 {
-  return entry_lookup(&client->callbacks,cname);
+  Tcl_ThreadQueueEvent(callback->thread, &event->header, TCL_QUEUE_TAIL);
+  callback_event_posts++;
+  Tcl_ConditionNotify(&callback_event_posted);
 }
-/* find a callback by it's ffidl_callback */
 /*
-static Tcl_HashEntry *callback_find(ffidl_client *client, ffidl_callback *callback)
+ * Handle the events queued to this thread until *countp drops to
+ * zero, for a thread joining workers which may be waiting on it to
+ * run a callback.  Only the callback events run, others stay queued.
+ */
+static void callback_service_while(int *countp)
 {
-  return entry_find(&client->callbacks,(void *)callback);
+  int posts;
+  Tcl_MutexLock(&callback_event_mutex);
+  while (*countp > 0) {
+    posts = callback_event_posts;
+    Tcl_MutexUnlock(&callback_event_mutex);
+    while (Tcl_ServiceEvent(TCL_IDLE_EVENTS)) {
+      /* next */
+    }
+    Tcl_MutexLock(&callback_event_mutex);
+    if (*countp > 0 && posts == callback_event_posts) {
+      Tcl_ConditionWait(&callback_event_posted, &callback_event_mutex, NULL);
+    }
+  }
+  Tcl_MutexUnlock(&callback_event_mutex);
 }
-*/
-/* delete a callback definition */
-/*
-static void callback_delete(ffidl_client *client, ffidl_callback *callback)
+/* count down for callback_service_while */
+static void callback_service_done(int *countp)
 {
-  Tcl_HashEntry *entry = callback_find(client, callback);
-  if (entry) {
-    callback_free(callback);
-    Tcl_DeleteHashEntry(entry);
+  Tcl_MutexLock(&callback_event_mutex);
+  *countp -= 1;
+  Tcl_ConditionNotify(&callback_event_posted);
+  Tcl_MutexUnlock(&callback_event_mutex);
+}
+static void callback_event_done(ffidl_callback_event *event)
+{
+  if (event->donep != NULL) {
+    Tcl_MutexLock(&callback_event_mutex);
+    *event->donep = 1;
+    Tcl_ConditionNotify(event->condp);
+    Tcl_MutexUnlock(&callback_event_mutex);
   }
 }
-*/
-#if USE_LIBFFI
-/* call a tcl proc from a libffi closure */
-static void callback_callback(ffi_cif *fficif, void *ret, void **args, void *user_data)
+static int callback_event_proc(Tcl_Event *evPtr, int flags)
 {
-  ffidl_callback *callback = (ffidl_callback *)user_data;
-  Tcl_Interp *interp = callback->interp;
-  ffidl_cif *cif = callback->cif;
-  Tcl_Obj **objv, *obj;
-  char buff[128];
-  int i, status;
-  long ltmp;
-  double dtmp;
-#if HAVE_INT64
-  Ffidl_Int64 wtmp;
+  ffidl_callback_event *event = (ffidl_callback_event *)evPtr;
+#if USE_LIBFFI
+  callback_callback(event->fficif, event->ret, event->args, event->callback);
+#elif USE_LIBFFCALL
+  callback_callback(event->callback, event->alist);
 #endif
-  /* test for valid scope */
-  if (interp == NULL) {
-    Tcl_Panic("callback called out of scope!\n");
+  callback_event_done(event);
+  return 1;
+}
+/* drop the events queued for a callback being freed, releasing their callers */
+static int callback_event_delete(Tcl_Event *evPtr, ClientData clientData)
+{
+  ffidl_callback_event *event = (ffidl_callback_event *)evPtr;
+#if USE_LIBFFI
+  if (evPtr->proc == callback_drain_proc && event->callback == (ffidl_callback *)clientData) {
+    return 1;
   }
-  /* initialize argument list */
-  objv = callback->cmdv+callback->cmdc;
-  /* fetch and convert argument values */
-  for (i = 0; i < cif->argc; i += 1) {
-    void *argp;
-#if USE_LIBFFI_RAW_API
-    if (callback->use_raw_api) {
-      ptrdiff_t offset = callback->offsets[i] - callback->offsets[0];
-      argp = (void *)(((char *)args)+offset);
-    } else {
-      argp = args[i];
-    }
-#else
-    argp = args[i];
 #endif
-    switch (cif->atypes[i]->typecode) {
-    case FFIDL_INT:
-      objv[i] = Tcl_NewLongObj((long)(*(int *)argp));
-      break;
-    case FFIDL_FLOAT:
-      objv[i] = Tcl_NewDoubleObj((double)(*(float *)argp));
-      break;
-    case FFIDL_DOUBLE:
-      objv[i] = Tcl_NewDoubleObj(*(double *)argp);
-      break;
-#if HAVE_LONG_DOUBLE
-    case FFIDL_LONGDOUBLE:
-      objv[i] = Tcl_NewDoubleObj((double)(*(long double *)argp));
-      break;
+  if (evPtr->proc != callback_event_proc || event->callback != (ffidl_callback *)clientData) {
+    return 0;
+  }
+#if USE_LIBFFI
+  if (event->ret != NULL) {
+    memset(event->ret, 0, event->callback->cif->rtype->size);
+  }
 #endif
-    case FFIDL_UINT8:
-      objv[i] = Tcl_NewLongObj((long)(*(UINT8_T *)argp));
-      break;
-    case FFIDL_SINT8:
-      objv[i] = Tcl_NewLongObj((long)(*(SINT8_T *)argp));
-      break;
-    case FFIDL_UINT16:
-      objv[i] = Tcl_NewLongObj((long)(*(UINT16_T *)argp));
-      break;
-    case FFIDL_SINT16:
-      objv[i] = Tcl_NewLongObj((long)(*(SINT16_T *)argp));
-      break;
-    case FFIDL_UINT32:
-      objv[i] = Tcl_NewLongObj((long)(*(UINT32_T *)argp));
-      break;
-    case FFIDL_SINT32:
-      objv[i] = Tcl_NewLongObj((long)(*(SINT32_T *)argp));
-      break;
-#if HAVE_INT64
-    case FFIDL_UINT64:
-      objv[i] = Ffidl_NewInt64Obj((Ffidl_Int64)(*(UINT64_T *)argp));
-      break;
-    case FFIDL_SINT64:
-      objv[i] = Ffidl_NewInt64Obj((Ffidl_Int64)(*(SINT64_T *)argp));
-      break;
+  callback_event_done(event);
+  return 1;
+}
+#if USE_LIBFFI
+static void callback_marshal(ffidl_callback *callback, ffi_cif *fficif, void *ret, void **args)
+#elif USE_LIBFFCALL
+static void callback_marshal(ffidl_callback *callback, va_alist alist)
 #endif
-    case FFIDL_STRUCT:
-      objv[i] = Tcl_NewByteArrayObj((unsigned char *)argp, cif->atypes[i]->size);
-      break;
-    case FFIDL_PTR:
-      objv[i] = Ffidl_NewPointerObj((*(void **)argp));
-      break;
-    case FFIDL_PTR_OBJ:
-      objv[i] = *(Tcl_Obj **)argp;
-      break;
-    case FFIDL_PTR_UTF8:
-      objv[i] = Tcl_NewStringObj(*(char **)argp, -1);
-      break;
-    case FFIDL_PTR_UTF16:
-      objv[i] = Tcl_NewUnicodeObj(*(Tcl_UniChar **)argp, -1);
-      break;
-    default:
-      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
-      Tcl_AppendResult(interp, buff, NULL);
-      while (i-- >= 0) {
-	Tcl_DecrRefCount(objv[i]);
-      }
-      goto escape;
+{
+  ffidl_callback_event *event;
+  Tcl_Condition cond = NULL;
+  int done = 0, open;
+  if ( ! callback_enter(callback)) {
+#if USE_LIBFFI
+    if (ret != NULL) {
+      memset(ret, 0, callback->cif->rtype->size);
     }
-    Tcl_IncrRefCount(objv[i]);
-  }
-  /* call */
-  status = Tcl_EvalObjv(interp, callback->cmdc+cif->argc, callback->cmdv, TCL_EVAL_GLOBAL);
-  /* clean up arguments */
-  for (i = 0; i < cif->argc; i++) {
-    Tcl_DecrRefCount(objv[i]);
-  }
-  if (status == TCL_ERROR) {
-    goto escape;
+#endif
+    return;
   }
-  /* fetch return value */
-  obj = Tcl_GetObjResult(interp);
-  if (cif->rtype->class & FFIDL_GETINT) {
-    if (obj->typePtr == ffidl_double_ObjType) {
-      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
+#if USE_LIBFFI
+  if (callback->async) {
+    /* copy the arguments, laid out as the closure passed them */
+    ffidl_cif *cif = callback->cif;
+    size_t offset = sizeof(ffidl_callback_event) + cif->argc*sizeof(void *);
+    int i;
+#if USE_LIBFFI_RAW_API
+    if (callback->use_raw_api) {
+      event = (ffidl_callback_event *)Tcl_Alloc(offset + cif->raw_size + sizeof(ffi_raw));
+      event->args = (void **)(event+1);
+      memcpy(event->args, args, cif->raw_size);
+    } else
+#endif
+    {
+      /* each argument at its alignment from the start of the event */
+      for (i = 0; i < cif->argc; i++) {
+	while ((offset % cif->atypes[i]->alignment) != 0) offset++;
+	offset += cif->atypes[i]->size;
       }
-      ltmp = (long)dtmp;
-      if (dtmp != ltmp) {
-	if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
+      event = (ffidl_callback_event *)Tcl_Alloc(offset);
+      event->args = (void **)(event+1);
+      offset = sizeof(ffidl_callback_event) + cif->argc*sizeof(void *);
+      for (i = 0; i < cif->argc; i++) {
+	while ((offset % cif->atypes[i]->alignment) != 0) offset++;
+	event->args[i] = (char *)event + offset;
+	memcpy(event->args[i], args[i], cif->atypes[i]->size);
+	offset += cif->atypes[i]->size;
       }
-    } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-      Tcl_AppendResult(interp, ", converting callback return value", NULL);
-      goto escape;
     }
-#if HAVE_INT64
-  } else if (cif->rtype->class & FFIDL_GETWIDEINT) {
-    if (obj->typePtr == ffidl_double_ObjType) {
-      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
-      }
-      wtmp = (Ffidl_Int64)dtmp;
-      if (dtmp != wtmp) {
-	if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
-      }
-    } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-      Tcl_AppendResult(interp, ", converting callback return value", NULL);
-      goto escape;
+    event->ret = NULL;
+    event->donep = NULL;
+  } else {
+    event = (ffidl_callback_event *)Tcl_Alloc(sizeof(ffidl_callback_event));
+    event->ret = ret;
+    event->args = args;
+    event->donep = &done;
+  }
+  event->fficif = fficif;
+#elif USE_LIBFFCALL
+  event = (ffidl_callback_event *)Tcl_Alloc(sizeof(ffidl_callback_event));
+  event->alist = alist;
+  event->donep = &done;
+#endif
+  event->header.proc = callback_event_proc;
+  event->callback = callback;
+  event->condp = &cond;
+  /* a closed callback's events have been dropped already */
+  Tcl_MutexLock(&callback_event_mutex);
+  open = ! callback->closed;
+  if (open) {
+    callback_event_post(callback, event);
+  }
+  Tcl_MutexUnlock(&callback_event_mutex);
+  if ( ! open) {
+#if USE_LIBFFI
+    if (ret != NULL) {
+      memset(ret, 0, callback->cif->rtype->size);
     }
 #endif
-  } else if (cif->rtype->class & FFIDL_GETDOUBLE) {
-    if (obj->typePtr == ffidl_int_ObjType) {
-      if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
-      }
-      dtmp = (double)ltmp;
-      if (dtmp != ltmp) {
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
-      }
-#if HAVE_WIDE_INT
-    } else if (obj->typePtr == ffidl_wideInt_ObjType) {
-      if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
-      }
-      dtmp = (double)wtmp;
-      if (dtmp != wtmp) {
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
+    Tcl_Free((char *)event);
+  } else {
+    Tcl_ThreadAlert(callback->thread);
+    if ( ! callback->async) {
+      Tcl_MutexLock(&callback_event_mutex);
+      while ( ! done) {
+	Tcl_ConditionWait(&cond, &callback_event_mutex, NULL);
       }
-#endif
-    } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-      Tcl_AppendResult(interp, ", converting callback return value", NULL);
-      goto escape;
+      Tcl_MutexUnlock(&callback_event_mutex);
     }
   }
-  
-  /* convert return value */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	break;
-  case FFIDL_INT:	FFIDL_RVALUE_POKE_WIDENED(INT, ret, ltmp); break;
-  case FFIDL_FLOAT:	FFIDL_RVALUE_POKE_WIDENED(FLOAT, ret, dtmp); break;
-  case FFIDL_DOUBLE:	FFIDL_RVALUE_POKE_WIDENED(DOUBLE, ret, dtmp); break;
-#if HAVE_LONG_DOUBLE
-  case FFIDL_UINT8:	FFIDL_RVALUE_POKE_WIDENED(LONGDOUBLE, ret, ltmp); break;
+  Tcl_ConditionFinalize(&cond);
+  callback_leave(callback);
+}
 #endif
-  case FFIDL_UINT8:	FFIDL_RVALUE_POKE_WIDENED(UINT8, ret, ltmp); break;
-  case FFIDL_SINT8:	FFIDL_RVALUE_POKE_WIDENED(SINT8, ret, ltmp); break;
-  case FFIDL_UINT16:	FFIDL_RVALUE_POKE_WIDENED(UINT16, ret, ltmp); break;
-  case FFIDL_SINT16:	FFIDL_RVALUE_POKE_WIDENED(SINT16, ret, ltmp); break;
-  case FFIDL_UINT32:	FFIDL_RVALUE_POKE_WIDENED(UINT32, ret, ltmp); break;
-  case FFIDL_SINT32:	FFIDL_RVALUE_POKE_WIDENED(SINT32, ret, ltmp); break;
-#if HAVE_INT64
-  case FFIDL_UINT64:	FFIDL_RVALUE_POKE_WIDENED(UINT64, ret, wtmp); break;
-  case FFIDL_SINT64:	FFIDL_RVALUE_POKE_WIDENED(SINT64, ret, wtmp); break;
+/* free a defined callback */
+static void callback_free(ffidl_callback *callback)
+{
+  if (callback) {
+    int i;
+#if TCL_THREADS
+    /* keep other threads out, release those waiting and wait for the rest */
+    Tcl_MutexLock(&callback_event_mutex);
+    callback->closed = 1;
+    if (callback->queue != NULL && callback->queue->waiters > 0) {
+      Tcl_ConditionNotify(&callback->queue->room);
+    }
+    Tcl_MutexUnlock(&callback_event_mutex);
+    Tcl_DeleteEvents(callback_event_delete, (ClientData)callback);
+    Tcl_MutexLock(&callback_event_mutex);
+    while (callback->users > 0) {
+      Tcl_ConditionWait(&callback->gone, &callback_event_mutex, NULL);
+    }
+    Tcl_MutexUnlock(&callback_event_mutex);
+    Tcl_ConditionFinalize(&callback->gone);
 #endif
-  case FFIDL_STRUCT:
-    {
-      int len;
-      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
-      if (len != cif->rtype->size) {
-	Tcl_ResetResult(interp);
-	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
-	Tcl_AppendResult(interp, buff, NULL);
-	goto escape;
+    for (i = 0; i < callback->cmdc; i++) {
+      Tcl_DecrRefCount(callback->cmdv[i]);
+    }
+    if (callback->token != NULL) {
+      Command *cmdPtr = (Command *)callback->token;
+      TclCleanupCommandMacro(cmdPtr);
+    }
+#if USE_LIBFFI
+    /* the argument objects kept from the last call */
+    for (i = callback->cmdc; i < callback->cmdc+callback->cif->argc; i++) {
+      if (callback->cmdv[i] != NULL) {
+	Tcl_DecrRefCount(callback->cmdv[i]);
       }
-      memcpy(ret, bytes, cif->rtype->size);
-      break;
     }
-#if FFIDL_POINTER_IS_LONG
-  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, ltmp); break;
-#else
-  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, wtmp); break;
+#if TCL_THREADS
+    if (callback->queue != NULL) {
+      Tcl_ConditionFinalize(&callback->queue->room);
+      Tcl_Free(callback->queue->cells);
+      Tcl_Free((char *)callback->queue);
+    }
 #endif
-  case FFIDL_PTR_OBJ:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj); break;
-  default:
-    Tcl_ResetResult(interp);
-    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto escape;
+    /* native comparisons may need no closure */
+    if (callback->closure.lib_closure != NULL) {
+      ffi_closure_free(callback->closure.lib_closure);
+    }
+#elif USE_LIBFFCALL
+    free_callback(callback->closure.lib_closure);
+#endif
+    cif_dec_ref(callback->cif);
+    Tcl_Free((void *)callback);
   }
-  /* done */
-  return;
-escape:
-  Tcl_BackgroundError(interp);
-  memset(ret, 0, cif->rtype->size);
 }
-#elif USE_LIBFFCALL
-static void callback_callback(void *user_data, va_alist alist)
+/*
+ * Callback names passed as pointer-proc arguments cache their
+ * resolution in an ffidl-callback internal rep, which holds while
+ * callback_epoch is unchanged.  The epoch moves whenever a callback
+ * is freed, by redefinition or with its client.  An unqualified name
+ * holds only in a namespace of the same name, as namespaces are freed
+ * and their memory reused without notice.
+ */
+typedef struct ffidl_callback_ref {
+  ffidl_client *client;		/* Client the name was resolved in. */
+  char *nsName;			/* Namespace an unqualified name was resolved in, or NULL. */
+  unsigned long epoch;		/* Value of callback_epoch at resolution. */
+  ffidl_callback *callback;
+} ffidl_callback_ref;
+
+static unsigned long callback_epoch = 0;
+TCL_DECLARE_MUTEX(callback_epoch_mutex)
+
+static void callback_epoch_bump(void)
 {
-  ffidl_callback *callback = (ffidl_callback *)user_data;
-  Tcl_Interp *interp = callback->interp;
-  ffidl_cif *cif = callback->cif;
-  Tcl_Obj **objv, *obj;
-  char buff[128];
-  int i, status;
-  long ltmp;
+  Tcl_MutexLock(&callback_epoch_mutex);
+  callback_epoch += 1;
+  Tcl_MutexUnlock(&callback_epoch_mutex);
+}
+
+static char *callback_ref_name(const char *name)
+{
+  return name == NULL ? NULL : strcpy(Tcl_Alloc(strlen(name)+1), name);
+}
+static void callback_ref_free(Tcl_Obj *obj)
+{
+  ffidl_callback_ref *ref = (ffidl_callback_ref *)obj->internalRep.twoPtrValue.ptr1;
+  if (ref->nsName != NULL) {
+    Tcl_Free(ref->nsName);
+  }
+  Tcl_Free((char *)ref);
+}
+static void callback_ref_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  ffidl_callback_ref *ref = (ffidl_callback_ref *)Tcl_Alloc(sizeof(ffidl_callback_ref));
+  *ref = *(ffidl_callback_ref *)src->internalRep.twoPtrValue.ptr1;
+  ref->nsName = callback_ref_name(ref->nsName);
+  dup->internalRep.twoPtrValue.ptr1 = ref;
+  dup->typePtr = src->typePtr;
+}
+
+static const Tcl_ObjType ffidl_callback_ObjType = {
+  "ffidl-callback",
+  callback_ref_free,
+  callback_ref_dup,
+  NULL,				/* the string rep is never invalidated */
+  NULL
+};
+
+/* define a new callback */
+static void callback_define(ffidl_client *client, char *cname, ffidl_callback *callback)
+{
+  ffidl_callback *old_callback = NULL;
+  /* if callback is already defined, clean it up. */
+  old_callback = entry_lookup(&client->callbacks,cname);
+  if (old_callback != NULL) {
+    callback_epoch_bump();
+  }
+  callback_free(old_callback);
+  entry_define(&client->callbacks,cname,(void*)callback);
+}
+/* lookup an existing callback */
+static ffidl_callback *callback_lookup(ffidl_client *client, char *cname)
+{
+  return entry_lookup(&client->callbacks,cname);
+}
+/*
+ * Find the callback named by obj, qualified against the current
+ * namespace, and remember it in obj.  Leaves an error message and
+ * returns NULL if there is none.
+ */
+static ffidl_callback *callback_from_obj(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *obj)
+{
+  ffidl_callback *callback;
+  ffidl_callback_ref *ref;
+  Tcl_Namespace *ns = NULL;
+  Tcl_DString ds;
+  char *name;
+
+  if (obj->typePtr == &ffidl_callback_ObjType) {
+    ref = (ffidl_callback_ref *)obj->internalRep.twoPtrValue.ptr1;
+    if (ref->epoch == callback_epoch && ref->client == client &&
+	(ref->nsName == NULL || strcmp(ref->nsName, Tcl_GetCurrentNamespace(interp)->fullName) == 0)) {
+      return ref->callback;
+    }
+  }
+  name = Tcl_GetString(obj);
+  Tcl_DStringInit(&ds);
+  if (!strstr(name, "::")) {
+    ns = Tcl_GetCurrentNamespace(interp);
+    if (ns != Tcl_GetGlobalNamespace(interp)) {
+      Tcl_DStringAppend(&ds, ns->fullName, -1);
+    }
+    Tcl_DStringAppend(&ds, "::", 2);
+    Tcl_DStringAppend(&ds, name, -1);
+    name = Tcl_DStringValue(&ds);
+  }
+  callback = callback_lookup(client, name);
+  Tcl_DStringFree(&ds);
+  if (callback == NULL) {
+    Tcl_AppendResult(interp, "no callback named \"", Tcl_GetString(obj), "\" is defined", NULL);
+    return NULL;
+  }
+  if (obj->typePtr == &ffidl_callback_ObjType) {
+    ref = (ffidl_callback_ref *)obj->internalRep.twoPtrValue.ptr1;
+    if (ref->nsName != NULL) {
+      Tcl_Free(ref->nsName);
+    }
+  } else {
+    ref = (ffidl_callback_ref *)Tcl_Alloc(sizeof(ffidl_callback_ref));
+    if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+      obj->typePtr->freeIntRepProc(obj);
+    }
+    obj->internalRep.twoPtrValue.ptr1 = ref;
+    obj->typePtr = &ffidl_callback_ObjType;
+  }
+  ref->client = client;
+  ref->nsName = ns == NULL ? NULL : callback_ref_name(ns->fullName);
+  ref->epoch = callback_epoch;
+  ref->callback = callback;
+  return callback;
+}
+/* find a callback by it's ffidl_callback */
+/*
+static Tcl_HashEntry *callback_find(ffidl_client *client, ffidl_callback *callback)
+{
+  return entry_find(&client->callbacks,(void *)callback);
+}
+*/
+/* delete a callback definition */
+/*
+static void callback_delete(ffidl_client *client, ffidl_callback *callback)
+{
+  Tcl_HashEntry *entry = callback_find(client, callback);
+  if (entry) {
+    callback_free(callback);
+    Tcl_DeleteHashEntry(entry);
+  }
+}
+*/
+/*
+ * Evaluate a callback's words at global level.  The command the first
+ * word names is resolved once and kept, with its epoch and that of the
+ * global namespace, and its objProc is called directly for as long as
+ * neither changes.  Whatever needs the full evaluation path, such as
+ * traces, limits, cancellation, pending async handlers or a missing
+ * command, goes through Tcl_EvalObjv.  The command frame is left as
+ * it is, which is what Tcl_EvalObjv does too.
+ */
+static int callback_eval(ffidl_callback *callback, int objc, Tcl_Obj **objv)
+{
+  Tcl_Interp *interp = callback->interp;
+  Interp *iPtr = (Interp *)interp;
+  Namespace *globalNsPtr = iPtr->globalNsPtr;
+  Command *cmdPtr = (Command *)callback->token;
+  CallFrame *framePtr;
+  Tcl_Obj *listPtr;
+  char *cmdString;
+  int status, cmdLen;
+
+  if (cmdPtr != NULL && ((cmdPtr->flags & CMD_IS_DELETED) || cmdPtr->cmdEpoch != callback->epoch ||
+			 globalNsPtr->cmdRefEpoch != callback->nsepoch)) {
+    /* deleted, renamed or shadowed since it was resolved */
+    TclCleanupCommandMacro(cmdPtr);
+    cmdPtr = NULL;
+    callback->token = NULL;
+  }
+  if (cmdPtr == NULL) {
+    cmdPtr = (Command *)Tcl_FindCommand(interp, Tcl_GetString(objv[0]), NULL, TCL_GLOBAL_ONLY);
+    if (cmdPtr != NULL) {
+      cmdPtr->refCount++;
+      callback->token = (Tcl_Command)cmdPtr;
+      callback->epoch = cmdPtr->cmdEpoch;
+      callback->nsepoch = globalNsPtr->cmdRefEpoch;
+    }
+  }
+  if (cmdPtr == NULL || cmdPtr->objProc == NULL || (cmdPtr->flags & CMD_HAS_EXEC_TRACES) ||
+      iPtr->tracePtr != NULL || iPtr->limit.active || TclCanceled(iPtr) || TclAsyncReady(iPtr) ||
+      iPtr->numLevels >= iPtr->maxNestingDepth || Tcl_InterpDeleted(interp)) {
+    return Tcl_EvalObjv(interp, objc, objv, TCL_EVAL_GLOBAL);
+  }
+
+  /* as Tcl_EvalObjv would, in the global frame, holding on to the command */
+  Tcl_ResetResult(interp);
+  iPtr->ensembleRewrite.sourceObjs = NULL;
+  iPtr->ensembleRewrite.numRemovedObjs = 0;
+  iPtr->ensembleRewrite.numInsertedObjs = 0;
+  framePtr = iPtr->varFramePtr;
+  iPtr->varFramePtr = iPtr->rootFramePtr;
+  iPtr->numLevels++;
+  iPtr->cmdCount++;
+  cmdPtr->refCount++;
+  status = cmdPtr->objProc(cmdPtr->objClientData, interp, objc, objv);
+  TclCleanupCommandMacro(cmdPtr);
+  iPtr->numLevels--;
+  iPtr->varFramePtr = framePtr;
+  if (status == TCL_ERROR) {
+    if ( ! (iPtr->flags & ERR_ALREADY_LOGGED)) {
+      listPtr = Tcl_NewListObj(objc, objv);
+      cmdString = Tcl_GetStringFromObj(listPtr, &cmdLen);
+      Tcl_LogCommandInfo(interp, cmdString, cmdString, cmdLen);
+      Tcl_DecrRefCount(listPtr);
+    }
+    iPtr->flags &= ~ERR_ALREADY_LOGGED;
+  }
+  return status;
+}
+#if USE_LIBFFI
+/*
+ * Make the argument object for a callback argument slot, writing over
+ * reuse, the slot's object from the last call, when nothing else holds
+ * it.
+ */
+#define CALLBACK_ARG(newobj, setobj, v)	\
+  if (reuse != NULL) {			\
+    setobj(reuse, v);			\
+    obj = reuse;			\
+  } else {				\
+    obj = newobj(v);			\
+  }
+
+/*
+ * Make the object for a callback argument of type at argp, over
+ * reuse when given.
+ * Returns NULL for a type callbacks do not take.
+ */
+static Tcl_Obj *callback_arg_obj(ffidl_type *type, void *argp, Tcl_Obj *reuse)
+{
+  Tcl_Obj *obj;
+
+  switch (type->typecode) {
+  case FFIDL_INT:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(int *)argp));
+    break;
+  case FFIDL_FLOAT:
+    CALLBACK_ARG(Tcl_NewDoubleObj, Tcl_SetDoubleObj, (double)(*(float *)argp));
+    break;
+  case FFIDL_DOUBLE:
+    CALLBACK_ARG(Tcl_NewDoubleObj, Tcl_SetDoubleObj, *(double *)argp);
+    break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:
+    CALLBACK_ARG(Tcl_NewDoubleObj, Tcl_SetDoubleObj, (double)(*(long double *)argp));
+    break;
+#endif
+  case FFIDL_UINT8:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(UINT8_T *)argp));
+    break;
+  case FFIDL_SINT8:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(SINT8_T *)argp));
+    break;
+  case FFIDL_UINT16:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(UINT16_T *)argp));
+    break;
+  case FFIDL_SINT16:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(SINT16_T *)argp));
+    break;
+  case FFIDL_UINT32:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(UINT32_T *)argp));
+    break;
+  case FFIDL_SINT32:
+    CALLBACK_ARG(Tcl_NewLongObj, Tcl_SetLongObj, (long)(*(SINT32_T *)argp));
+    break;
+#if HAVE_INT64
+  case FFIDL_UINT64:
+    CALLBACK_ARG(Ffidl_NewInt64Obj, Ffidl_SetInt64Obj, (Ffidl_Int64)(*(UINT64_T *)argp));
+    break;
+  case FFIDL_SINT64:
+    CALLBACK_ARG(Ffidl_NewInt64Obj, Ffidl_SetInt64Obj, (Ffidl_Int64)(*(SINT64_T *)argp));
+    break;
+#endif
+  case FFIDL_STRUCT:
+    if (reuse != NULL && reuse->typePtr == ffidl_bytearray_ObjType) {
+      memcpy(Tcl_SetByteArrayLength(reuse, type->size), argp, type->size);
+      obj = reuse;
+    } else {
+      obj = Tcl_NewByteArrayObj((unsigned char *)argp, type->size);
+    }
+    break;
+  case FFIDL_PTR:
+    CALLBACK_ARG(Ffidl_NewPointerObj, Ffidl_SetPointerObj, *(void **)argp);
+    break;
+  case FFIDL_PTR_OBJ:
+    obj = *(Tcl_Obj **)argp;
+    break;
+  case FFIDL_PTR_UTF8:
+    if (reuse != NULL) {
+      Tcl_SetStringObj(reuse, *(char **)argp, -1);
+      obj = reuse;
+    } else {
+      obj = Tcl_NewStringObj(*(char **)argp, -1);
+    }
+    break;
+  case FFIDL_PTR_UTF16:
+    obj = units_new_obj(*(void **)argp, 2);
+    break;
+  case FFIDL_PTR_UTF32:
+    obj = units_new_obj(*(void **)argp, 4);
+    break;
+  default:
+    return NULL;
+  }
+  return obj;
+}
+#if TCL_THREADS
+/*
+ * Queued callbacks.
+ */
+#if defined(_MSC_VER)
+static size_t queue_load(volatile size_t *p)
+{
+  size_t v = *p;
+  MemoryBarrier();
+  return v;
+}
+static void queue_store(volatile size_t *p, size_t v)
+{
+  MemoryBarrier();
+  *p = v;
+}
+static int queue_cas(volatile size_t *p, size_t *expected, size_t v)
+{
+  size_t old = (size_t)InterlockedCompareExchangePointer((PVOID volatile *)p, (PVOID)v, (PVOID)*expected);
+  if (old == *expected) {
+    return 1;
+  }
+  *expected = old;
+  return 0;
+}
+static size_t queue_exchange(volatile size_t *p, size_t v)
+{
+  return (size_t)InterlockedExchangePointer((PVOID volatile *)p, (PVOID)v);
+}
+#else
+static size_t queue_load(volatile size_t *p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+static void queue_store(volatile size_t *p, size_t v)
+{
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+static int queue_cas(volatile size_t *p, size_t *expected, size_t v)
+{
+  return __atomic_compare_exchange_n(p, expected, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+static size_t queue_exchange(volatile size_t *p, size_t v)
+{
+  return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+#endif
+
+#define QUEUE_SEQ(cell)	((volatile size_t *)(cell))
+
+static ffidl_queue *queue_new(ffidl_cif *cif, size_t size, int overflow)
+{
+  ffidl_queue *queue;
+  size_t offset = sizeof(size_t), align = sizeof(size_t), i;
+
+  queue = (ffidl_queue *)Tcl_Alloc(sizeof(ffidl_queue)+cif->argc*sizeof(size_t));
+  memset(queue, 0, sizeof(ffidl_queue));
+  queue->offsets = (size_t *)(queue+1);
+  for (i = 0; i < (size_t)cif->argc; i++) {
+    while ((offset % cif->atypes[i]->alignment) != 0) offset++;
+    queue->offsets[i] = offset;
+    offset += cif->atypes[i]->size;
+    if (align < cif->atypes[i]->alignment) {
+      align = cif->atypes[i]->alignment;
+    }
+  }
+  while ((offset % align) != 0) offset++;
+  queue->cellsize = offset;
+  queue->mask = size-1;
+  queue->overflow = overflow;
+  queue->cells = Tcl_Alloc(size*offset);
+  for (i = 0; i < size; i++) {
+    *QUEUE_SEQ(queue->cells+i*offset) = i;
+  }
+  return queue;
+}
+/* claim the oldest filled cell, or return NULL if there is none */
+static char *queue_pop(ffidl_queue *queue, size_t *posp)
+{
+  size_t pos = queue_load(&queue->tail), seq;
+  char *cell;
+  for (;;) {
+    cell = queue->cells+(pos & queue->mask)*queue->cellsize;
+    seq = queue_load(QUEUE_SEQ(cell));
+    if (seq == pos+1) {
+      if (queue_cas(&queue->tail, &pos, pos+1)) {
+	*posp = pos;
+	return cell;
+      }
+    } else if ((ptrdiff_t)(seq-(pos+1)) < 0) {
+      return NULL;
+    } else {
+      pos = queue_load(&queue->tail);
+    }
+  }
+}
+/* hand a drained cell back to the producers */
+static void queue_release(ffidl_queue *queue, char *cell, size_t pos)
+{
+  queue_store(QUEUE_SEQ(cell), pos+queue->mask+1);
+}
+
+static void callback_drain(ffidl_callback *callback);
+
+static int callback_drain_proc(Tcl_Event *evPtr, int flags)
+{
+  ffidl_callback *callback = ((ffidl_callback_event *)evPtr)->callback;
+  queue_exchange(&callback->queue->scheduled, 0);
+  callback_drain(callback);
+  return 1;
+}
+/* queue a drain to the callback's thread, unless one is pending or it is closed */
+static void callback_schedule(ffidl_callback *callback)
+{
+  ffidl_callback_event *event;
+  int queued = 0;
+  Tcl_MutexLock(&callback_event_mutex);
+  if ( ! callback->closed && queue_exchange(&callback->queue->scheduled, 1) == 0) {
+    event = (ffidl_callback_event *)Tcl_Alloc(sizeof(ffidl_callback_event));
+    event->header.proc = callback_drain_proc;
+    event->callback = callback;
+    event->ret = NULL;
+    event->donep = NULL;
+    callback_event_post(callback, event);
+    queued = 1;
+  }
+  Tcl_MutexUnlock(&callback_event_mutex);
+  if (queued) {
+    Tcl_ThreadAlert(callback->thread);
+  }
+}
+/*
+ * Pass up to a ring's worth of queued calls to the callback command
+ * as one list of argument lists.
+ */
+static void callback_drain(ffidl_callback *callback)
+{
+  ffidl_queue *queue = callback->queue;
+  ffidl_cif *cif = callback->cif;
+  Tcl_Obj **objv, *batch, *obj;
+  size_t n, pos;
+  char *cell;
+  int i;
+
+  objv = (Tcl_Obj **)Tcl_Alloc((callback->cmdc+1+cif->argc)*sizeof(Tcl_Obj *));
+  batch = Tcl_NewListObj(0, NULL);
+  Tcl_IncrRefCount(batch);
+  for (n = 0; n <= queue->mask && (cell = queue_pop(queue, &pos)) != NULL; n++) {
+    for (i = 0; i < cif->argc; i++) {
+      obj = callback_arg_obj(cif->atypes[i], cell+queue->offsets[i], NULL);
+      objv[callback->cmdc+1+i] = obj != NULL ? obj : Tcl_NewObj();
+    }
+    queue_release(queue, cell, pos);
+    Tcl_ListObjAppendElement(NULL, batch, Tcl_NewListObj(cif->argc, objv+callback->cmdc+1));
+  }
+  if (n > queue->mask) {
+    /* there may be more behind */
+    callback_schedule(callback);
+  }
+  if (n > 0 && queue->overflow == FFIDL_QUEUE_BLOCK) {
+    Tcl_MutexLock(&callback_event_mutex);
+    if (queue->waiters > 0) {
+      Tcl_ConditionNotify(&queue->room);
+    }
+    Tcl_MutexUnlock(&callback_event_mutex);
+  }
+  if (n > 0) {
+    memcpy(objv, callback->cmdv, callback->cmdc*sizeof(Tcl_Obj *));
+    objv[callback->cmdc] = batch;
+    if (callback_eval(callback, callback->cmdc+1, objv) == TCL_ERROR) {
+      Tcl_BackgroundError(callback->interp);
+    }
+  }
+  Tcl_DecrRefCount(batch);
+  Tcl_Free((char *)objv);
+}
+/* copy a call into the ring, from any thread */
+static void callback_enqueue(ffidl_callback *callback, void **args)
+{
+  ffidl_queue *queue = callback->queue;
+  ffidl_cif *cif = callback->cif;
+  size_t pos = queue_load(&queue->head), seq, drop;
+  char *cell;
+  int i;
+
+  for (;;) {
+    cell = queue->cells+(pos & queue->mask)*queue->cellsize;
+    seq = queue_load(QUEUE_SEQ(cell));
+    if (seq == pos) {
+      if (queue_cas(&queue->head, &pos, pos+1)) {
+	break;
+      }
+      continue;
+    }
+    if ((ptrdiff_t)(seq-pos) > 0) {
+      /* another producer got there first */
+      pos = queue_load(&queue->head);
+      continue;
+    }
+    /* full */
+    switch (queue->overflow) {
+    case FFIDL_QUEUE_COUNT_DROPS:
+      do {
+	drop = queue_load(&queue->drops);
+      } while ( ! queue_cas(&queue->drops, &drop, drop+1));
+      callback_schedule(callback);
+      return;
+    case FFIDL_QUEUE_DROP_OLDEST:
+      if ((cell = queue_pop(queue, &drop)) != NULL) {
+	queue_release(queue, cell, drop);
+	do {
+	  drop = queue_load(&queue->drops);
+	} while ( ! queue_cas(&queue->drops, &drop, drop+1));
+      }
+      break;
+    case FFIDL_QUEUE_BLOCK:
+      if (callback->thread == Tcl_GetCurrentThread()) {
+	/* nobody else will make room */
+	callback_drain(callback);
+	break;
+      }
+      /* wait for a drain, checking again under the lock it notifies with */
+      callback_schedule(callback);
+      Tcl_MutexLock(&callback_event_mutex);
+      queue->waiters++;
+      for (;;) {
+	pos = queue_load(&queue->head);
+	cell = queue->cells+(pos & queue->mask)*queue->cellsize;
+	if (callback->closed || (ptrdiff_t)(queue_load(QUEUE_SEQ(cell))-pos) >= 0) {
+	  break;
+	}
+	Tcl_ConditionWait(&queue->room, &callback_event_mutex, NULL);
+      }
+      queue->waiters--;
+      Tcl_MutexUnlock(&callback_event_mutex);
+      if (callback->closed) {
+	/* the call goes with the callback */
+	return;
+      }
+      break;
+    }
+    pos = queue_load(&queue->head);
+  }
+  for (i = 0; i < cif->argc; i++) {
+    memcpy(cell+queue->offsets[i], args[i], cif->atypes[i]->size);
+  }
+  queue_store(QUEUE_SEQ(cell), pos+1);
+  callback_schedule(callback);
+}
+#endif
+/* call a tcl proc from a libffi closure */
+static void callback_callback(ffi_cif *fficif, void *ret, void **args, void *user_data)
+{
+  ffidl_callback *callback = (ffidl_callback *)user_data;
+  Tcl_Interp *interp = callback->interp;
+  ffidl_cif *cif = callback->cif;
+  Tcl_Obj **cmdv, **objv, *obj, *reuse;
+  char buff[128];
+  int i, status;
+  long ltmp;
   double dtmp;
 #if HAVE_INT64
   Ffidl_Int64 wtmp;
@@ -2315,631 +3989,2931 @@ static void callback_callback(void *user_data, va_alist alist)
   if (interp == NULL) {
     Tcl_Panic("callback called out of scope!\n");
   }
-  /* initialize argument list */
-  objv = callback->cmdv+callback->cmdc;
-  /* start */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	va_start_void(alist); break;
-  case FFIDL_INT:	va_start_int(alist); break;
-  case FFIDL_FLOAT:	va_start_float(alist); break;
-  case FFIDL_DOUBLE:	va_start_double(alist); break;
-  case FFIDL_UINT8:	va_start_uint8(alist); break;
-  case FFIDL_SINT8:	va_start_sint8(alist); break;
-  case FFIDL_UINT16:	va_start_uint16(alist); break;
-  case FFIDL_SINT16:	va_start_sint16(alist); break;
-  case FFIDL_UINT32:	va_start_uint32(alist); break;
-  case FFIDL_SINT32:	va_start_sint32(alist); break;
-#if HAVE_INT64
-  case FFIDL_UINT64:	va_start_uint64(alist); break;
-  case FFIDL_SINT64:	va_start_sint64(alist); break;
+#if TCL_THREADS
+  if (callback->queue != NULL) {
+    /* other threads fill the ring as users, kept out once it is closed */
+    if (callback->thread == Tcl_GetCurrentThread()) {
+      callback_enqueue(callback, args);
+    } else if (callback_enter(callback)) {
+      callback_enqueue(callback, args);
+      callback_leave(callback);
+    }
+    return;
+  }
+  if (callback->thread != Tcl_GetCurrentThread()) {
+    callback_marshal(callback, fficif, ret, args);
+    return;
+  }
+#endif
+  /* initialize argument list, a nested call must not touch the slots in use */
+  cmdv = callback->cmdv;
+  if (callback->depth > 0) {
+    cmdv = (Tcl_Obj **)Tcl_Alloc((callback->cmdc+cif->argc)*sizeof(Tcl_Obj *));
+    memcpy(cmdv, callback->cmdv, callback->cmdc*sizeof(Tcl_Obj *));
+    memset(cmdv+callback->cmdc, 0, cif->argc*sizeof(Tcl_Obj *));
+  }
+  objv = cmdv+callback->cmdc;
+  /* fetch and convert argument values */
+  status = TCL_OK;
+  for (i = 0; i < cif->argc && status == TCL_OK; i += 1) {
+    void *argp;
+#if USE_LIBFFI_RAW_API
+    if (callback->use_raw_api) {
+      argp = (void *)(((char *)args)+callback->offsets[i]);
+    } else {
+      argp = args[i];
+    }
+#else
+    argp = args[i];
+#endif
+    reuse = objv[i] != NULL && ! Tcl_IsShared(objv[i]) ? objv[i] : NULL;
+    obj = callback_arg_obj(cif->atypes[i], argp, reuse);
+    if (obj == NULL) {
+      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
+      Tcl_AppendResult(interp, buff, NULL);
+      status = TCL_ERROR;
+      continue;
+    }
+    if (obj != objv[i]) {
+      Tcl_IncrRefCount(obj);
+      if (objv[i] != NULL) {
+	Tcl_DecrRefCount(objv[i]);
+      }
+      objv[i] = obj;
+    }
+  }
+  /* call */
+  if (status == TCL_OK) {
+    callback->depth += 1;
+    status = callback_eval(callback, callback->cmdc+cif->argc, cmdv);
+    callback->depth -= 1;
+  }
+  /* keep the argument objects for the next call, except those of a nested call and foreign objects */
+  for (i = 0; i < cif->argc; i++) {
+    if (objv[i] != NULL && (cmdv != callback->cmdv || cif->atypes[i]->typecode == FFIDL_PTR_OBJ)) {
+      Tcl_DecrRefCount(objv[i]);
+      objv[i] = NULL;
+    }
+  }
+  if (cmdv != callback->cmdv) {
+    Tcl_Free((char *)cmdv);
+  }
+  if (status == TCL_ERROR) {
+    goto escape;
+  }
+  /* fetch return value */
+  obj = Tcl_GetObjResult(interp);
+  if (cif->rtype->typecode == FFIDL_PTR && obj->typePtr == &ffidl_pointer_ObjType) {
+#if FFIDL_POINTER_IS_LONG
+    ltmp = (long)FFIDL_POINTER_ADDR(obj);
+#else
+    wtmp = (Ffidl_Int64)FFIDL_POINTER_ADDR(obj);
+#endif
+  } else if (cif->rtype->class & FFIDL_GETINT) {
+    if (obj->typePtr == ffidl_double_ObjType) {
+      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      ltmp = (long)dtmp;
+      if (dtmp != ltmp) {
+	if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+    } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+      Tcl_AppendResult(interp, ", converting callback return value", NULL);
+      goto escape;
+    }
+#if HAVE_INT64
+  } else if (cif->rtype->class & FFIDL_GETWIDEINT) {
+    if (obj->typePtr == ffidl_double_ObjType) {
+      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      wtmp = (Ffidl_Int64)dtmp;
+      if (dtmp != wtmp) {
+	if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+    } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
+      Tcl_AppendResult(interp, ", converting callback return value", NULL);
+      goto escape;
+    }
+#endif
+  } else if (cif->rtype->class & FFIDL_GETDOUBLE) {
+    if (obj->typePtr == ffidl_int_ObjType) {
+      if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      dtmp = (double)ltmp;
+      if (dtmp != ltmp) {
+	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+#if HAVE_WIDE_INT
+    } else if (obj->typePtr == ffidl_wideInt_ObjType) {
+      if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      dtmp = (double)wtmp;
+      if (dtmp != wtmp) {
+	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+#endif
+    } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+      Tcl_AppendResult(interp, ", converting callback return value", NULL);
+      goto escape;
+    }
+  }
+  
+  /* convert return value */
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	break;
+  case FFIDL_INT:	FFIDL_RVALUE_POKE_WIDENED(INT, ret, ltmp); break;
+  case FFIDL_FLOAT:	FFIDL_RVALUE_POKE_WIDENED(FLOAT, ret, dtmp); break;
+  case FFIDL_DOUBLE:	FFIDL_RVALUE_POKE_WIDENED(DOUBLE, ret, dtmp); break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_UINT8:	FFIDL_RVALUE_POKE_WIDENED(LONGDOUBLE, ret, ltmp); break;
+#endif
+  case FFIDL_UINT8:	FFIDL_RVALUE_POKE_WIDENED(UINT8, ret, ltmp); break;
+  case FFIDL_SINT8:	FFIDL_RVALUE_POKE_WIDENED(SINT8, ret, ltmp); break;
+  case FFIDL_UINT16:	FFIDL_RVALUE_POKE_WIDENED(UINT16, ret, ltmp); break;
+  case FFIDL_SINT16:	FFIDL_RVALUE_POKE_WIDENED(SINT16, ret, ltmp); break;
+  case FFIDL_UINT32:	FFIDL_RVALUE_POKE_WIDENED(UINT32, ret, ltmp); break;
+  case FFIDL_SINT32:	FFIDL_RVALUE_POKE_WIDENED(SINT32, ret, ltmp); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	FFIDL_RVALUE_POKE_WIDENED(UINT64, ret, wtmp); break;
+  case FFIDL_SINT64:	FFIDL_RVALUE_POKE_WIDENED(SINT64, ret, wtmp); break;
+#endif
+  case FFIDL_STRUCT:
+    {
+      int len;
+      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
+      if (len != cif->rtype->size) {
+	Tcl_ResetResult(interp);
+	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
+	Tcl_AppendResult(interp, buff, NULL);
+	goto escape;
+      }
+      memcpy(ret, bytes, cif->rtype->size);
+      break;
+    }
+#if FFIDL_POINTER_IS_LONG
+  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, ltmp); break;
+#else
+  case FFIDL_PTR:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, wtmp); break;
+#endif
+  case FFIDL_PTR_OBJ:	FFIDL_RVALUE_POKE_WIDENED(PTR, ret, obj); break;
+  default:
+    Tcl_ResetResult(interp);
+    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    goto escape;
+  }
+  /* done */
+  return;
+escape:
+  Tcl_BackgroundError(interp);
+  memset(ret, 0, cif->rtype->size);
+}
+#elif USE_LIBFFCALL
+static void callback_callback(void *user_data, va_alist alist)
+{
+  ffidl_callback *callback = (ffidl_callback *)user_data;
+  Tcl_Interp *interp = callback->interp;
+  ffidl_cif *cif = callback->cif;
+  Tcl_Obj **objv, *obj;
+  char buff[128];
+  int i, status;
+  long ltmp;
+  double dtmp;
+#if HAVE_INT64
+  Ffidl_Int64 wtmp;
+#endif
+  /* test for valid scope */
+  if (interp == NULL) {
+    Tcl_Panic("callback called out of scope!\n");
+  }
+#if TCL_THREADS
+  if (callback->thread != Tcl_GetCurrentThread()) {
+    callback_marshal(callback, alist);
+    return;
+  }
+#endif
+  /* initialize argument list */
+  objv = callback->cmdv+callback->cmdc;
+  /* start */
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	va_start_void(alist); break;
+  case FFIDL_INT:	va_start_int(alist); break;
+  case FFIDL_FLOAT:	va_start_float(alist); break;
+  case FFIDL_DOUBLE:	va_start_double(alist); break;
+  case FFIDL_UINT8:	va_start_uint8(alist); break;
+  case FFIDL_SINT8:	va_start_sint8(alist); break;
+  case FFIDL_UINT16:	va_start_uint16(alist); break;
+  case FFIDL_SINT16:	va_start_sint16(alist); break;
+  case FFIDL_UINT32:	va_start_uint32(alist); break;
+  case FFIDL_SINT32:	va_start_sint32(alist); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	va_start_uint64(alist); break;
+  case FFIDL_SINT64:	va_start_sint64(alist); break;
+#endif
+  case FFIDL_STRUCT:	_va_start_struct(alist,cif->rtype->size,cif->rtype->alignment,cif->rtype->splittable); break;
+  case FFIDL_PTR:	va_start_ptr(alist,void *); break;
+  case FFIDL_PTR_OBJ:	va_start_ptr(alist,Tcl_Obj *); break;
+  default:
+    Tcl_ResetResult(interp);
+    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    goto escape;
+  }
+  /* fetch and convert argument values */
+  for (i = 0; i < cif->argc; i++) {
+    switch (cif->atypes[i]->typecode) {
+    case FFIDL_INT:
+      objv[i] = Tcl_NewLongObj((long)va_arg_int(alist));
+      break;
+    case FFIDL_FLOAT:
+      objv[i] = Tcl_NewDoubleObj((double)va_arg_float(alist));
+      break;
+    case FFIDL_DOUBLE:
+      objv[i] = Tcl_NewDoubleObj(va_arg_double(alist));
+      break;
+    case FFIDL_UINT8:
+      objv[i] = Tcl_NewLongObj((long)va_arg_uint8(alist));
+      break;
+    case FFIDL_SINT8:
+      objv[i] = Tcl_NewLongObj((long)va_arg_sint8(alist));
+      break;
+    case FFIDL_UINT16:
+      objv[i] = Tcl_NewLongObj((long)va_arg_uint16(alist));
+      break;
+    case FFIDL_SINT16:
+      objv[i] = Tcl_NewLongObj((long)va_arg_sint16(alist));
+      break;
+    case FFIDL_UINT32:
+      objv[i] = Tcl_NewLongObj((long)va_arg_uint32(alist));
+      break;
+    case FFIDL_SINT32:
+      objv[i] = Tcl_NewLongObj((long)va_arg_sint32(alist));
+      break;
+#if HAVE_INT64
+    case FFIDL_UINT64:
+      objv[i] = Ffidl_NewInt64Obj((long)va_arg_uint64(alist));
+      break;
+    case FFIDL_SINT64:
+      objv[i] = Ffidl_NewInt64Obj((long)va_arg_sint64(alist));
+      break;
+#endif
+    case FFIDL_STRUCT:
+      objv[i] = Tcl_NewByteArrayObj(_va_arg_struct(alist,
+						   cif->atypes[i]->size,
+						   cif->atypes[i]->alignment),
+				    cif->atypes[i]->size);
+      break;
+    case FFIDL_PTR:
+      objv[i] = Ffidl_NewPointerObj(va_arg_ptr(alist,void *));
+      break;
+    case FFIDL_PTR_OBJ:
+      objv[i] = va_arg_ptr(alist,Tcl_Obj *);
+      break;
+    case FFIDL_PTR_UTF8:
+      objv[i] = Tcl_NewStringObj(va_arg_ptr(alist,char *), -1);
+      break;
+    case FFIDL_PTR_UTF16:
+      objv[i] = units_new_obj(va_arg_ptr(alist,void *), 2);
+      break;
+    case FFIDL_PTR_UTF32:
+      objv[i] = units_new_obj(va_arg_ptr(alist,void *), 4);
+      break;
+    default:
+      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
+      Tcl_AppendResult(interp, buff, NULL);
+      while (i-- >= 0) {
+	Tcl_DecrRefCount(objv[i]);
+      }
+      goto escape;
+    }
+    Tcl_IncrRefCount(objv[i]);
+  }
+  /* call */
+  status = callback_eval(callback, callback->cmdc+cif->argc, callback->cmdv);
+  /* clean up arguments */
+  for (i = 0; i < cif->argc; i++) {
+    Tcl_DecrRefCount(objv[i]);
+  }
+  if (status == TCL_ERROR) {
+    goto escape;
+  }
+  /* fetch return value */
+  obj = Tcl_GetObjResult(interp);
+  if (cif->rtype->class & FFIDL_GETINT) {
+    if (obj->typePtr == ffidl_double_ObjType) {
+      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      ltmp = (long)dtmp;
+      if (dtmp != ltmp)
+	if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+    } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+      Tcl_AppendResult(interp, ", converting callback return value", NULL);
+      goto escape;
+    }
+#if HAVE_INT64
+  } else if (cif->rtype->class & FFIDL_GETWIDEINT) {
+    if (obj->typePtr == ffidl_double_ObjType) {
+      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      wtmp = (Ffidl_Int64)dtmp;
+      if (dtmp != wtmp) {
+	if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+    } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
+      Tcl_AppendResult(interp, ", converting callback return value", NULL);
+      goto escape;
+    }
+#endif
+  } else if (cif->rtype->class & FFIDL_GETDOUBLE) {
+    if (obj->typePtr == ffidl_int_ObjType) {
+      if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      dtmp = (double)ltmp;
+      if (dtmp != ltmp) {
+	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+#if HAVE_WIDE_INT
+    } else if (obj->typePtr == ffidl_wideInt_ObjType) {
+      if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR) {
+	Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	goto escape;
+      }
+      dtmp = (double)wtmp;
+      if (dtmp != wtmp) {
+	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
+	  goto escape;
+	}
+      }
+#endif
+    } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
+      Tcl_AppendResult(interp, ", converting callback return value", NULL);
+      goto escape;
+    }
+  }
+  
+  /* convert return value */
+  switch (cif->rtype->typecode) {
+  case FFIDL_VOID:	va_return_void(alist); break;
+  case FFIDL_INT:	va_return_int(alist, ltmp); break;
+  case FFIDL_FLOAT:	va_return_float(alist, dtmp); break;
+  case FFIDL_DOUBLE:	va_return_double(alist, dtmp); break;
+  case FFIDL_UINT8:	va_return_uint8(alist, ltmp); break;
+  case FFIDL_SINT8:	va_return_sint8(alist, ltmp); break;
+  case FFIDL_UINT16:	va_return_uint16(alist, ltmp); break;
+  case FFIDL_SINT16:	va_return_sint16(alist, ltmp); break;
+  case FFIDL_UINT32:	va_return_uint32(alist, ltmp); break;
+  case FFIDL_SINT32:	va_return_sint32(alist, ltmp); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	va_return_uint64(alist, wtmp); break;
+  case FFIDL_SINT64:	va_return_sint64(alist, wtmp); break;
+#endif
+  case FFIDL_STRUCT:	
+    {
+      int len;
+      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
+      if (len != cif->rtype->size) {
+	Tcl_ResetResult(interp);
+	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
+	Tcl_AppendResult(interp, buff, NULL);
+	goto escape;
+      }
+      _va_return_struct(alist, cif->rtype->size, cif->rtype->alignment, bytes);
+      break;
+    }
+  case FFIDL_PTR:	va_return_ptr(alist, void *, ltmp); break;
+  case FFIDL_PTR_OBJ:	va_return_ptr(alist, Tcl_Obj *, obj); break;
+  default:
+    Tcl_ResetResult(interp);
+    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
+    Tcl_AppendResult(interp, buff, NULL);
+    goto escape;
+  }
+  /* done */
+  return;
+escape:
+  Tcl_BackgroundError(interp);
+}
+#endif
+
+/* compare two elements for a native comparison callback */
+#define COMPARE_KEYS(ctype)			\
+  {						\
+    ctype x, y;					\
+    memcpy(&x, a, sizeof(ctype));		\
+    memcpy(&y, b, sizeof(ctype));		\
+    r = (x > y) - (x < y);			\
+    break;					\
+  }
+static int compare_elements(ffidl_compare *compare, const char *a, const char *b)
+{
+  int r;
+  a += compare->offset;
+  b += compare->offset;
+  switch (compare->typecode) {
+  case FFIDL_INT:	COMPARE_KEYS(int)
+  case FFIDL_FLOAT:	COMPARE_KEYS(float)
+  case FFIDL_DOUBLE:	COMPARE_KEYS(double)
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:	COMPARE_KEYS(long double)
+#endif
+  case FFIDL_UINT8:	COMPARE_KEYS(UINT8_T)
+  case FFIDL_SINT8:	COMPARE_KEYS(SINT8_T)
+  case FFIDL_UINT16:	COMPARE_KEYS(UINT16_T)
+  case FFIDL_SINT16:	COMPARE_KEYS(SINT16_T)
+  case FFIDL_UINT32:	COMPARE_KEYS(UINT32_T)
+  case FFIDL_SINT32:	COMPARE_KEYS(SINT32_T)
+#if HAVE_INT64
+  case FFIDL_UINT64:	COMPARE_KEYS(UINT64_T)
+  case FFIDL_SINT64:	COMPARE_KEYS(SINT64_T)
+#endif
+  case FFIDL_PTR_BYTE:
+    r = memcmp(a, b, compare->length);
+    r = (r > 0) - (r < 0);
+    break;
+  case FFIDL_PTR_UTF8:
+    r = strcmp(*(const char **)a, *(const char **)b);
+    r = (r > 0) - (r < 0);
+    break;
+  default:
+    r = 0;
+    break;
+  }
+  return compare->sign*r;
+}
+#if USE_LIBFFI
+/*
+ * Comparisons of keys at the start of the elements, in the common
+ * types, are plain functions which need no closure.
+ */
+#define COMPARE_FUNCTION(name, ctype)					\
+  static int compare_##name(const void *a, const void *b)		\
+  {									\
+    ctype x, y;								\
+    memcpy(&x, a, sizeof(ctype));					\
+    memcpy(&y, b, sizeof(ctype));					\
+    return (x > y) - (x < y);						\
+  }									\
+  static int compare_##name##_desc(const void *a, const void *b)	\
+  {									\
+    return compare_##name(b, a);					\
+  }
+COMPARE_FUNCTION(int, int)
+COMPARE_FUNCTION(uint32, UINT32_T)
+COMPARE_FUNCTION(sint32, SINT32_T)
+#if HAVE_INT64
+COMPARE_FUNCTION(uint64, UINT64_T)
+COMPARE_FUNCTION(sint64, SINT64_T)
+#endif
+COMPARE_FUNCTION(float, float)
+COMPARE_FUNCTION(double, double)
+static int compare_strcmp(const void *a, const void *b)
+{
+  int r = strcmp(*(const char **)a, *(const char **)b);
+  return (r > 0) - (r < 0);
+}
+static int compare_strcmp_desc(const void *a, const void *b)
+{
+  return compare_strcmp(b, a);
+}
+/* the plain function for compare, or NULL if it needs a closure */
+static void *compare_function(ffidl_compare *compare)
+{
+  if (compare->offset != 0) {
+    return NULL;
+  }
+  switch (compare->typecode) {
+  case FFIDL_INT:	return compare->sign > 0 ? (void *)compare_int : (void *)compare_int_desc;
+  case FFIDL_UINT32:	return compare->sign > 0 ? (void *)compare_uint32 : (void *)compare_uint32_desc;
+  case FFIDL_SINT32:	return compare->sign > 0 ? (void *)compare_sint32 : (void *)compare_sint32_desc;
+#if HAVE_INT64
+  case FFIDL_UINT64:	return compare->sign > 0 ? (void *)compare_uint64 : (void *)compare_uint64_desc;
+  case FFIDL_SINT64:	return compare->sign > 0 ? (void *)compare_sint64 : (void *)compare_sint64_desc;
+#endif
+  case FFIDL_FLOAT:	return compare->sign > 0 ? (void *)compare_float : (void *)compare_float_desc;
+  case FFIDL_DOUBLE:	return compare->sign > 0 ? (void *)compare_double : (void *)compare_double_desc;
+  case FFIDL_PTR_UTF8:	return compare->sign > 0 ? (void *)compare_strcmp : (void *)compare_strcmp_desc;
+  default:		return NULL;
+  }
+}
+/* a native comparison called through a libffi closure */
+static void compare_callback(ffi_cif *fficif, void *ret, void **args, void *user_data)
+{
+  ffidl_callback *callback = (ffidl_callback *)user_data;
+  long r = compare_elements(&callback->compare, *(const char **)args[0], *(const char **)args[1]);
+  FFIDL_RVALUE_POKE_WIDENED(INT, ret, r);
+}
+#elif USE_LIBFFCALL
+static void compare_callback(void *user_data, va_alist alist)
+{
+  ffidl_callback *callback = (ffidl_callback *)user_data;
+  const char *a, *b;
+  va_start_int(alist);
+  a = va_arg_ptr(alist, const char *);
+  b = va_arg_ptr(alist, const char *);
+  va_return_int(alist, compare_elements(&callback->compare, a, b));
+}
+#endif
+#endif
+/*
+ * Callout argument and return value marshalling.
+ *
+ * tcl_ffidl_callout selects one marshaller per argument and one for
+ * the return value according to their types, so that tcl_ffidl_call
+ * converts values without testing classes or typecodes.
+ */
+/* fetch an integer value, accepting integral doubles */
+static int marshal_get_long(Tcl_Interp *interp, Tcl_Obj *obj, long *lp)
+{
+  double dtmp;
+  if (obj->typePtr == ffidl_double_ObjType) {
+    if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
+      return TCL_ERROR;
+    *lp = (long)dtmp;
+    if (dtmp == *lp)
+      return TCL_OK;
+  }
+  return Tcl_GetLongFromObj(interp, obj, lp);
+}
+#if HAVE_INT64
+/* fetch a 64 bit integer value, accepting integral doubles */
+static int marshal_get_int64(Tcl_Interp *interp, Tcl_Obj *obj, Ffidl_Int64 *wp)
+{
+  double dtmp;
+  if (obj->typePtr == ffidl_double_ObjType) {
+    if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
+      return TCL_ERROR;
+    *wp = (Ffidl_Int64)dtmp;
+    if (dtmp == *wp)
+      return TCL_OK;
+  }
+  return Ffidl_GetInt64FromObj(interp, obj, wp);
+}
+#endif
+/* fetch a double value, avoiding shimmering of exact integers */
+static int marshal_get_double(Tcl_Interp *interp, Tcl_Obj *obj, double *dp)
+{
+  long ltmp;
+#if HAVE_WIDE_INT
+  Tcl_WideInt wtmp;
+#endif
+  if (obj->typePtr == ffidl_int_ObjType) {
+    if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR)
+      return TCL_ERROR;
+    *dp = (double)ltmp;
+    if (*dp == ltmp)
+      return TCL_OK;
+#if HAVE_WIDE_INT
+  } else if (obj->typePtr == ffidl_wideInt_ObjType) {
+    if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR)
+      return TCL_ERROR;
+    *dp = (double)wtmp;
+    if (*dp == wtmp)
+      return TCL_OK;
+#endif
+  }
+  return Tcl_GetDoubleFromObj(interp, obj, dp);
+}
+
+#define MARSHAL_LONG(name, ctype)					\
+  static int marshal_##name(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp) \
+  {									\
+    long ltmp;								\
+    if (marshal_get_long(interp, obj, &ltmp) == TCL_ERROR)		\
+      return TCL_ERROR;							\
+    *(ctype *)*argp = (ctype)ltmp;					\
+    return TCL_OK;							\
+  }
+#define MARSHAL_INT64(name, ctype)					\
+  static int marshal_##name(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp) \
+  {									\
+    Ffidl_Int64 wtmp;							\
+    if (marshal_get_int64(interp, obj, &wtmp) == TCL_ERROR)		\
+      return TCL_ERROR;							\
+    *(ctype *)*argp = (ctype)wtmp;					\
+    return TCL_OK;							\
+  }
+#define MARSHAL_DOUBLE(name, ctype)					\
+  static int marshal_##name(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp) \
+  {									\
+    double dtmp;							\
+    if (marshal_get_double(interp, obj, &dtmp) == TCL_ERROR)		\
+      return TCL_ERROR;							\
+    *(ctype *)*argp = (ctype)dtmp;					\
+    return TCL_OK;							\
+  }
+
+MARSHAL_LONG(int, int)
+MARSHAL_LONG(uint8, UINT8_T)
+MARSHAL_LONG(sint8, SINT8_T)
+MARSHAL_LONG(uint16, UINT16_T)
+MARSHAL_LONG(sint16, SINT16_T)
+#if USE_LIBFFI_RAW_API
+/* raw argument slots are passed as is, so small integers fill an int */
+#define MARSHAL_LONG_WIDENED(name, ctype)				\
+  static int marshal_##name(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp) \
+  {									\
+    long ltmp;								\
+    if (marshal_get_long(interp, obj, &ltmp) == TCL_ERROR)		\
+      return TCL_ERROR;							\
+    *(int *)*argp = (int)(ctype)ltmp;					\
+    return TCL_OK;							\
+  }
+MARSHAL_LONG_WIDENED(raw_uint8, UINT8_T)
+MARSHAL_LONG_WIDENED(raw_sint8, SINT8_T)
+MARSHAL_LONG_WIDENED(raw_uint16, UINT16_T)
+MARSHAL_LONG_WIDENED(raw_sint16, SINT16_T)
+#endif
+MARSHAL_LONG(uint32, UINT32_T)
+MARSHAL_LONG(sint32, SINT32_T)
+#if HAVE_INT64
+MARSHAL_INT64(uint64, UINT64_T)
+MARSHAL_INT64(sint64, SINT64_T)
+#endif
+MARSHAL_DOUBLE(float, float)
+MARSHAL_DOUBLE(double, double)
+#if HAVE_LONG_DOUBLE
+MARSHAL_DOUBLE(longdouble, long double)
+#endif
+/* pointers made by ffidl are read back as they are */
+static int marshal_pointer(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+#if FFIDL_POINTER_IS_LONG
+  long ptmp;
+#else
+  Ffidl_Int64 ptmp;
+#endif
+  if (obj->typePtr == &ffidl_pointer_ObjType) {
+    *(void **)*argp = FFIDL_POINTER_ADDR(obj);
+    return TCL_OK;
+  }
+  if (buffer_from_obj(obj) != NULL) {
+    *(void **)*argp = FFIDL_BUFFER(obj)->bytes;
+    return TCL_OK;
+  }
+#if FFIDL_POINTER_IS_LONG
+  if (marshal_get_long(interp, obj, &ptmp) == TCL_ERROR)
+#else
+  if (marshal_get_int64(interp, obj, &ptmp) == TCL_ERROR)
+#endif
+    return TCL_ERROR;
+  *(void **)*argp = (void *)ptmp;
+  return TCL_OK;
+}
+
+static int marshal_struct(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  char buff[128];
+  int itmp;
+  if (obj->typePtr != ffidl_bytearray_ObjType) {
+    sprintf(buff, "parameter %d must be a binary string", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  *argp = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
+  if (itmp != callout->cif->atypes[i]->size) {
+    sprintf(buff, "parameter %d is the wrong size, %u bytes instead of %lu.", i, itmp, (long)(callout->cif->atypes[i]->size));
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+static int marshal_pointer_obj(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  *(void **)*argp = (void *)obj;
+  return TCL_OK;
+}
+static int marshal_pointer_utf8(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  *(void **)*argp = (void *)Tcl_GetString(obj);
+  return TCL_OK;
+}
+/*
+ * Pass obj's external string, held in the frame slot that follows the
+ * argument pointers, so that converting obj again for a later argument
+ * cannot free it before the call.
+ */
+static void marshal_extstring(ffidl_callout *callout, Tcl_Obj *obj, void **argp)
+{
+  ffidl_extstring *ext = FFIDL_EXTSTRING(obj);
+  ext->refCount++;
+  argp[callout->cif->argc] = ext;
+  *(void **)*argp = (void *)ext->bytes;
+}
+static int marshal_pointer_units(ffidl_callout *callout, Tcl_Obj *obj, int unit, void **argp)
+{
+  if (obj->typePtr != &ffidl_extstring_ObjType || FFIDL_EXTSTRING(obj)->encoding != NULL ||
+      FFIDL_EXTSTRING(obj)->unit != unit) {
+    extstring_convert_units(obj, unit);
+  }
+  marshal_extstring(callout, obj, argp);
+  return TCL_OK;
+}
+static int marshal_pointer_utf16(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  return marshal_pointer_units(callout, obj, 2, argp);
+}
+static int marshal_pointer_utf32(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  return marshal_pointer_units(callout, obj, 4, argp);
+}
+static int marshal_pointer_string(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  Tcl_Encoding encoding = callout->cif->atypes[i]->encoding;
+  if (obj->typePtr != &ffidl_extstring_ObjType || FFIDL_EXTSTRING(obj)->encoding != encoding) {
+    extstring_convert(obj, encoding);
+  }
+  marshal_extstring(callout, obj, argp);
+  return TCL_OK;
+}
+static int marshal_pointer_byte(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  char buff[128];
+  int itmp;
+  if (buffer_from_obj(obj) != NULL) {
+    *(void **)*argp = FFIDL_BUFFER(obj)->bytes;
+    return TCL_OK;
+  }
+  if (obj->typePtr != ffidl_bytearray_ObjType) {
+    sprintf(buff, "parameter %d must be a binary string", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  *(void **)*argp = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
+  return TCL_OK;
+}
+static int marshal_pointer_var(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  char buff[128];
+  int itmp;
+  Tcl_Obj *varName = obj;
+  obj = Tcl_ObjGetVar2(interp, varName, NULL, TCL_LEAVE_ERR_MSG);
+  if (obj == NULL)
+    return TCL_ERROR;
+  if (buffer_from_obj(obj) != NULL) {
+    /* the buffer's storage is shared by all its holders */
+    *(void **)*argp = FFIDL_BUFFER(obj)->bytes;
+    return TCL_OK;
+  }
+  if (obj->typePtr != ffidl_bytearray_ObjType) {
+    sprintf(buff, "parameter %d must be a binary string", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  if (Tcl_IsShared(obj)) {
+    obj = Tcl_ObjSetVar2(interp, varName, NULL, Tcl_DuplicateObj(obj), TCL_LEAVE_ERR_MSG);
+    if (obj == NULL)
+      return TCL_ERROR;
+  }
+  *(void **)*argp = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
+  Tcl_InvalidateStringRep(obj);
+  return TCL_OK;
+}
+#if USE_CALLBACKS
+static int marshal_pointer_proc(Tcl_Interp *interp, ffidl_callout *callout, int i, Tcl_Obj *obj, void **argp)
+{
+  ffidl_callback *callback;
+  ffidl_closure *closure;
+  callback = callback_from_obj(interp, callout->client, obj);
+  if (callback == NULL) {
+    return TCL_ERROR;
+  }
+  closure = &(callback->closure);
+#if USE_LIBFFI
+  *(void **)*argp = (void *)closure->executable;
+#elif USE_LIBFFCALL
+  *(void **)*argp = (void *)closure->lib_closure;
+#endif
+  return TCL_OK;
+}
+#endif
+
+/* select the argument marshaller for a type, raw for libffi's raw API */
+static ffidl_marshal_proc *marshal_for_type(ffidl_type *type, int raw)
+{
+#if USE_LIBFFI_RAW_API
+  if (raw) {
+    switch (type->typecode) {
+    case FFIDL_UINT8:	return marshal_raw_uint8;
+    case FFIDL_SINT8:	return marshal_raw_sint8;
+    case FFIDL_UINT16:	return marshal_raw_uint16;
+    case FFIDL_SINT16:	return marshal_raw_sint16;
+    default:		break;
+    }
+  }
+#endif
+  switch (type->typecode) {
+  case FFIDL_INT:	return marshal_int;
+  case FFIDL_FLOAT:	return marshal_float;
+  case FFIDL_DOUBLE:	return marshal_double;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:	return marshal_longdouble;
+#endif
+  case FFIDL_UINT8:	return marshal_uint8;
+  case FFIDL_SINT8:	return marshal_sint8;
+  case FFIDL_UINT16:	return marshal_uint16;
+  case FFIDL_SINT16:	return marshal_sint16;
+  case FFIDL_UINT32:	return marshal_uint32;
+  case FFIDL_SINT32:	return marshal_sint32;
+#if HAVE_INT64
+  case FFIDL_UINT64:	return marshal_uint64;
+  case FFIDL_SINT64:	return marshal_sint64;
+#endif
+  case FFIDL_STRUCT:	return marshal_struct;
+  case FFIDL_PTR:	return marshal_pointer;
+  case FFIDL_PTR_OBJ:	return marshal_pointer_obj;
+  case FFIDL_PTR_UTF8:	return marshal_pointer_utf8;
+  case FFIDL_PTR_UTF16:	return marshal_pointer_utf16;
+  case FFIDL_PTR_UTF32:	return marshal_pointer_utf32;
+  case FFIDL_PTR_STRING:	return marshal_pointer_string;
+  case FFIDL_PTR_BYTE:	return marshal_pointer_byte;
+  case FFIDL_PTR_VAR:	return marshal_pointer_var;
+#if USE_CALLBACKS
+  case FFIDL_PTR_PROC:	return marshal_pointer_proc;
+#endif
+  default:		return NULL;
+  }
+}
+
+/*
+ * Return value unmarshallers.  Scalar ones write into reuse, an
+ * unshared object, when they are given one.
+ */
+#define UNMARSHAL_SCALAR(name, TYPE, ctype, newobj, setobj)		\
+  static Tcl_Obj *unmarshal_##name(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) \
+  {									\
+    ctype v = (ctype)FFIDL_RVALUE_PEEK_UNWIDEN(TYPE, rvalue);		\
+    if (reuse == NULL) return newobj(v);				\
+    setobj(reuse, v);							\
+    return reuse;							\
+  }
+
+static Tcl_Obj *unmarshal_void(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) { return NULL; }
+UNMARSHAL_SCALAR(int, INT, long, Tcl_NewLongObj, Tcl_SetLongObj)
+UNMARSHAL_SCALAR(float, FLOAT, double, Tcl_NewDoubleObj, Tcl_SetDoubleObj)
+UNMARSHAL_SCALAR(double, DOUBLE, double, Tcl_NewDoubleObj, Tcl_SetDoubleObj)
+#if HAVE_LONG_DOUBLE
+UNMARSHAL_SCALAR(longdouble, LONGDOUBLE, double, Tcl_NewDoubleObj, Tcl_SetDoubleObj)
+#endif
+UNMARSHAL_SCALAR(uint8, UINT8, long, Tcl_NewLongObj, Tcl_SetLongObj)
+UNMARSHAL_SCALAR(sint8, SINT8, long, Tcl_NewLongObj, Tcl_SetLongObj)
+UNMARSHAL_SCALAR(uint16, UINT16, long, Tcl_NewLongObj, Tcl_SetLongObj)
+UNMARSHAL_SCALAR(sint16, SINT16, long, Tcl_NewLongObj, Tcl_SetLongObj)
+UNMARSHAL_SCALAR(uint32, UINT32, long, Tcl_NewLongObj, Tcl_SetLongObj)
+UNMARSHAL_SCALAR(sint32, SINT32, long, Tcl_NewLongObj, Tcl_SetLongObj)
+#if HAVE_INT64
+UNMARSHAL_SCALAR(uint64, UINT64, Ffidl_Int64, Ffidl_NewInt64Obj, Ffidl_SetInt64Obj)
+UNMARSHAL_SCALAR(sint64, SINT64, Ffidl_Int64, Ffidl_NewInt64Obj, Ffidl_SetInt64Obj)
+#endif
+UNMARSHAL_SCALAR(pointer, PTR, void *, Ffidl_NewPointerObj, Ffidl_SetPointerObj)
+static Tcl_Obj *unmarshal_struct(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) { return Tcl_NewByteArrayObj(rvalue, callout->cif->rtype->size); }
+static Tcl_Obj *unmarshal_pointer_obj(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) { return (Tcl_Obj *)FFIDL_RVALUE_PEEK_UNWIDEN(PTR, rvalue); }
+static Tcl_Obj *unmarshal_pointer_utf8(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) { return Tcl_NewStringObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, rvalue), -1); }
+static Tcl_Obj *unmarshal_pointer_utf16(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) { return units_new_obj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, rvalue), 2); }
+static Tcl_Obj *unmarshal_pointer_utf32(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse) { return units_new_obj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, rvalue), 4); }
+static Tcl_Obj *unmarshal_pointer_string(ffidl_callout *callout, void *rvalue, Tcl_Obj *reuse)
+{
+  Tcl_DString ds;
+  Tcl_Obj *obj;
+  Tcl_ExternalToUtfDString(callout->cif->rtype->encoding, FFIDL_RVALUE_PEEK_UNWIDEN(PTR, rvalue), -1, &ds);
+  obj = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+  Tcl_DStringFree(&ds);
+  return obj;
+}
+
+/* select the return value marshaller for a type */
+static ffidl_unmarshal_proc *unmarshal_for_type(ffidl_type *type)
+{
+  switch (type->typecode) {
+  case FFIDL_VOID:	return unmarshal_void;
+  case FFIDL_INT:	return unmarshal_int;
+  case FFIDL_FLOAT:	return unmarshal_float;
+  case FFIDL_DOUBLE:	return unmarshal_double;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:	return unmarshal_longdouble;
+#endif
+  case FFIDL_UINT8:	return unmarshal_uint8;
+  case FFIDL_SINT8:	return unmarshal_sint8;
+  case FFIDL_UINT16:	return unmarshal_uint16;
+  case FFIDL_SINT16:	return unmarshal_sint16;
+  case FFIDL_UINT32:	return unmarshal_uint32;
+  case FFIDL_SINT32:	return unmarshal_sint32;
+#if HAVE_INT64
+  case FFIDL_UINT64:	return unmarshal_uint64;
+  case FFIDL_SINT64:	return unmarshal_sint64;
+#endif
+  case FFIDL_STRUCT:	return unmarshal_struct;
+  case FFIDL_PTR:	return unmarshal_pointer;
+  case FFIDL_PTR_OBJ:	return unmarshal_pointer_obj;
+  case FFIDL_PTR_UTF8:	return unmarshal_pointer_utf8;
+  case FFIDL_PTR_UTF16:	return unmarshal_pointer_utf16;
+  case FFIDL_PTR_UTF32:	return unmarshal_pointer_utf32;
+  case FFIDL_PTR_STRING:	return unmarshal_pointer_string;
+  default:		return NULL;
+  }
+}
+/*
+ * Packed array application.
+ *
+ * ::ffidl::apply streams packed arrays of numbers through a callout
+ * whose arguments and return value are all numeric, without creating a
+ * Tcl_Obj per element.  The double(double) and double(double,double)
+ * signatures run in unrolled loops calling the function directly, the
+ * others call through libffi or ffcall with argument pointers into the
+ * arrays.
+ */
+#define FFIDL_APPLY_MAX_ARGS 2
+/* smallest number of elements worth a thread of its own */
+#define FFIDL_APPLY_THREAD_MIN 4096
+
+typedef struct ffidl_apply_job {
+  ffidl_callout *callout;
+  int n;			/* Number of elements. */
+  unsigned char *in[FFIDL_APPLY_MAX_ARGS]; /* Argument arrays. */
+  unsigned char *out;		/* Return value array. */
+  int *pending;			/* Count of unfinished workers. */
+} ffidl_apply_job;
+
+/* test whether a type can be applied over a packed array */
+static int apply_type_numeric(ffidl_type *type)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:
+  case FFIDL_FLOAT:
+  case FFIDL_DOUBLE:
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:
+#endif
+  case FFIDL_UINT8:
+  case FFIDL_SINT8:
+  case FFIDL_UINT16:
+  case FFIDL_SINT16:
+  case FFIDL_UINT32:
+  case FFIDL_SINT32:
+#if HAVE_INT64
+  case FFIDL_UINT64:
+  case FFIDL_SINT64:
+#endif
+    return 1;
+  default:
+    return 0;
+  }
+}
+/* store a return value into a packed array element */
+static void apply_store(ffidl_type *type, void *dst, void *ret)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:	*(int *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(INT, ret); break;
+  case FFIDL_FLOAT:	*(float *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(FLOAT, ret); break;
+  case FFIDL_DOUBLE:	*(double *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(DOUBLE, ret); break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:	*(long double *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(LONGDOUBLE, ret); break;
+#endif
+  case FFIDL_UINT8:	*(UINT8_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(UINT8, ret); break;
+  case FFIDL_SINT8:	*(SINT8_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(SINT8, ret); break;
+  case FFIDL_UINT16:	*(UINT16_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(UINT16, ret); break;
+  case FFIDL_SINT16:	*(SINT16_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(SINT16, ret); break;
+  case FFIDL_UINT32:	*(UINT32_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(UINT32, ret); break;
+  case FFIDL_SINT32:	*(SINT32_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(SINT32, ret); break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	*(UINT64_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(UINT64, ret); break;
+  case FFIDL_SINT64:	*(SINT64_T *)dst = FFIDL_RVALUE_PEEK_UNWIDEN(SINT64, ret); break;
+#endif
+  default:		break;
+  }
+}
+static void apply_double_double(void (*fn)(), int n, const double *a, double *r)
+{
+  double (*f)(double) = (double (*)(double))fn;
+  int i;
+  for (i = 0; i+4 <= n; i += 4) {
+    r[i] = f(a[i]);
+    r[i+1] = f(a[i+1]);
+    r[i+2] = f(a[i+2]);
+    r[i+3] = f(a[i+3]);
+  }
+  for ( ; i < n; i += 1) {
+    r[i] = f(a[i]);
+  }
+}
+static void apply_double_double_double(void (*fn)(), int n, const double *a, const double *b, double *r)
+{
+  double (*f)(double, double) = (double (*)(double, double))fn;
+  int i;
+  for (i = 0; i+4 <= n; i += 4) {
+    r[i] = f(a[i], b[i]);
+    r[i+1] = f(a[i+1], b[i+1]);
+    r[i+2] = f(a[i+2], b[i+2]);
+    r[i+3] = f(a[i+3], b[i+3]);
+  }
+  for ( ; i < n; i += 1) {
+    r[i] = f(a[i], b[i]);
+  }
+}
+/* test whether an array can be accessed as doubles */
+#define APPLY_DOUBLE_ALIGNED(p) ((p) == NULL || ((size_t)(p) & (sizeof(double)-1)) == 0)
+/* run a job */
+static void apply_run(ffidl_apply_job *job)
+{
+  ffidl_callout *callout = job->callout;
+  ffidl_cif *cif = callout->cif;
+  size_t rsize = cif->rtype->size;
+  ffidl_value ret;
+  void *args[FFIDL_APPLY_MAX_ARGS];
+  int i, j;
+
+  if (APPLY_DOUBLE_ALIGNED(job->in[0]) && APPLY_DOUBLE_ALIGNED(job->in[1]) && APPLY_DOUBLE_ALIGNED(job->out)) {
+    if (callout->stub == stub_double_double) {
+      apply_double_double(callout->fn, job->n, (double *)job->in[0], (double *)job->out);
+      return;
+    }
+    if (callout->stub == stub_double_double_double) {
+      apply_double_double_double(callout->fn, job->n, (double *)job->in[0], (double *)job->in[1], (double *)job->out);
+      return;
+    }
+  }
+  /* point the arguments straight into the arrays */
+  for (i = 0; i < job->n; i += 1) {
+    for (j = 0; j < cif->argc; j += 1) {
+      args[j] = (void *)(job->in[j]+i*cif->atypes[j]->size);
+    }
+#if USE_LIBFFI
+    ffi_call(&cif->lib_cif, callout->fn, (void *)&ret, args);
+#elif USE_LIBFFCALL
+    callout_call(callout, (void *)&ret, args);
+#endif
+    apply_store(cif->rtype, (void *)(job->out+i*rsize), (void *)&ret);
+  }
+}
+#if TCL_THREADS
+/* run a worker's job */
+static void apply_work(ffidl_apply_job *job)
+{
+  apply_run(job);
+#if USE_CALLBACKS
+  callback_service_done(job->pending);
+#endif
+}
+static Tcl_ThreadCreateType apply_thread(ClientData clientData)
+{
+  apply_work((ffidl_apply_job *)clientData);
+  TCL_THREAD_CREATE_RETURN;
+}
+#endif
+/*
+ * Client management.
+ */
+/* client interp deletion callback for cleanup */
+static void client_delete(ClientData clientData, Tcl_Interp *interp)
+{
+  ffidl_client *client = (ffidl_client *)clientData;
+  Tcl_HashSearch search;
+  Tcl_HashEntry *entry;
+  size_t i;
+
+  /* there should be no callouts left */
+  for (entry = Tcl_FirstHashEntry(&client->callouts, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    char *name = Tcl_GetHashKey(&client->callouts, entry);
+    /* Couldn't do this while traversing the hash table anyway */
+    /* Tcl_DeleteCommand(interp, name); */
+    fprintf(stderr, "error - dangling callout in client_delete: %s\n", name);
+  }
+
+#if USE_CALLBACKS
+  /* free all callbacks */
+  callback_epoch_bump();
+  for (entry = Tcl_FirstHashEntry(&client->callbacks, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_callback *callback = Tcl_GetHashValue(entry);
+    callback_free(callback);
+  }
+#endif
+
+  /* cifs still cached in argument lists outlive the client */
+  for (entry = Tcl_FirstHashEntry(&client->cifs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_cif *cif = Tcl_GetHashValue(entry);
+    cif->client = NULL;
+  }
+
+  /* free all allocated typedefs */
+  for (entry = Tcl_FirstHashEntry(&client->types, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    ffidl_type *type = Tcl_GetHashValue(entry);
+    if ((type->class & FFIDL_STATIC_TYPE) == 0) {
+      type_dec_ref(type);
+    }
+  }
+
+  /* free all libs */
+  for (entry = Tcl_FirstHashEntry(&client->libs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    char *libraryName = Tcl_GetHashKey(&client->libs, entry);
+    ffidl_lib *libentry = Tcl_GetHashValue(entry);
+    ffidlclose(interp, libraryName, libentry->loadHandle, libentry->unloadProc);
+    Tcl_Free((void *)libentry);
+  }
+
+  /* free hashtables */
+  Tcl_DeleteHashTable(&client->callouts);
+#if USE_CALLBACKS
+  Tcl_DeleteHashTable(&client->callbacks);
+#endif
+  Tcl_DeleteHashTable(&client->cifs);
+  Tcl_DeleteHashTable(&client->types);
+  Tcl_DeleteHashTable(&client->libs);
+
+  /* free the frame stack */
+  while (client->frames != NULL) {
+    ffidl_framechunk *chunk = client->frames;
+    client->frames = chunk->prev;
+    Tcl_Free((void *)chunk);
+  }
+
+  /* release the recycled results */
+  for (i = 0; i < FFIDL_RESULT_CACHE; i += 1) {
+    if (client->results[i] != NULL) {
+      Tcl_DecrRefCount(client->results[i]);
+    }
+  }
+
+  /* free client structure */
+  Tcl_Free((void *)client);
+}
+/* client allocation and initialization */
+static ffidl_client *client_alloc(Tcl_Interp *interp)
+{
+  ffidl_client *client;
+
+  /* allocate client data structure */
+  client = (ffidl_client *)Tcl_Alloc(sizeof(ffidl_client));
+
+  /* allocate hashtables for this load */
+  Tcl_InitHashTable(&client->types, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->callouts, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->cifs, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&client->libs, TCL_STRING_KEYS);
+#if USE_CALLBACKS
+  Tcl_InitHashTable(&client->callbacks, TCL_STRING_KEYS);
+#endif
+  client->frames = NULL;
+  memset(client->results, 0, sizeof(client->results));
+  client->nextresult = 0;
+  Tcl_MutexLock(&type_generation_mutex);
+  client->generation = ++type_generation;
+  Tcl_MutexUnlock(&type_generation_mutex);
+
+  /* initialize types */
+  type_define(client, "void", &ffidl_type_void);
+  type_define(client, "char", &ffidl_type_char);
+  type_define(client, "signed char", &ffidl_type_schar);
+  type_define(client, "unsigned char", &ffidl_type_uchar);
+  type_define(client, "short", &ffidl_type_sshort);
+  type_define(client, "unsigned short", &ffidl_type_ushort);
+  type_define(client, "int", &ffidl_type_sint);
+  type_define(client, "unsigned", &ffidl_type_uint);
+  type_define(client, "long", &ffidl_type_slong);
+  type_define(client, "unsigned long", &ffidl_type_ulong);
+#if HAVE_LONG_LONG
+  type_define(client, "long long", &ffidl_type_slonglong);
+  type_define(client, "unsigned long long", &ffidl_type_ulonglong);
+#endif
+  type_define(client, "float", &ffidl_type_float);
+  type_define(client, "double", &ffidl_type_double);
+#if HAVE_LONG_DOUBLE
+  type_define(client, "long double", &ffidl_type_longdouble);
+#endif
+  type_define(client, "sint8", &ffidl_type_sint8);
+  type_define(client, "uint8", &ffidl_type_uint8);
+  type_define(client, "sint16", &ffidl_type_sint16);
+  type_define(client, "uint16", &ffidl_type_uint16);
+  type_define(client, "sint32", &ffidl_type_sint32);
+  type_define(client, "uint32", &ffidl_type_uint32);
+#if HAVE_INT64
+  type_define(client, "sint64", &ffidl_type_sint64);
+  type_define(client, "uint64", &ffidl_type_uint64);
+#endif
+  type_define(client, "pointer", &ffidl_type_pointer);
+  type_define(client, "pointer-obj", &ffidl_type_pointer_obj);
+  type_define(client, "pointer-utf8", &ffidl_type_pointer_utf8);
+  type_define(client, "pointer-utf16", &ffidl_type_pointer_utf16);
+  type_define(client, "pointer-utf32", &ffidl_type_pointer_utf32);
+  type_define(client, "pointer-byte", &ffidl_type_pointer_byte);
+  type_define(client, "pointer-var", &ffidl_type_pointer_var);
+#if USE_CALLBACKS
+  type_define(client, "pointer-proc", &ffidl_type_pointer_proc);
+#endif
+
+  /* arrange for cleanup on interpreter deletion */
+  Tcl_CallWhenDeleted(interp, client_delete, (ClientData)client);
+
+  /* finis */
+  return client;
+}
+/*****************************************
+ *
+ * Functions exported as tcl commands.
+ */
+
+/* usage: ::ffidl::info option ?...? */
+static int tcl_ffidl_info(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    option_ix,
+    minargs
+  };
+
+  int i;
+  Tcl_HashTable *table;
+  Tcl_HashSearch search;
+  Tcl_HashEntry *entry;
+  ffidl_type *type;
+  ffidl_client *client = (ffidl_client *)clientData;
+  static const char *options[] = {
+#define INFO_ALIGNOF 0
+    "alignof",
+#define INFO_CALLBACKS 1
+    "callbacks",
+#define INFO_CALLOUTS 2
+    "callouts",
+#define INFO_CALLPATH 3
+    "callpath",
+#define INFO_CANONICAL_HOST 4
+    "canonical-host",
+#define INFO_DROPS 5
+    "drops",
+#define INFO_FORMAT 6
+    "format",
+#define INFO_HAVE_INT64 7
+    "have-int64",
+#define INFO_HAVE_LONG_DOUBLE 8
+    "have-long-double",
+#define INFO_HAVE_LONG_LONG 9
+    "have-long-long",
+#define INFO_INTERP 10
+    "interp",
+#define INFO_LIBRARIES 11
+    "libraries",
+#define INFO_SIGNATURES 12
+    "signatures",
+#define INFO_SIZEOF 13
+    "sizeof",
+#define INFO_TYPEDEFS 14
+    "typedefs",
+#define INFO_USE_CALLBACKS 15
+    "use-callbacks",
+#define INFO_USE_FFCALL 16
+    "use-ffcall",
+#define INFO_USE_LIBFFCALL 17
+    "use-libffcall",
+#define INFO_USE_LIBFFI 18
+    "use-libffi",
+#define INFO_USE_LIBFFI_RAW 19
+    "use-libffi-raw",
+#define INFO_NULL 20
+    "NULL",
+    NULL
+  };
+
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+    return TCL_ERROR;
+  }
+
+  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", TCL_EXACT, &i) == TCL_ERROR)
+    return TCL_ERROR;
+
+  switch (i) {
+  case INFO_CALLOUTS:		/* return list of callout names */
+    table = &client->callouts;
+  list_table_keys:		/* list the keys in a hash table */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+    for (entry = Tcl_FirstHashEntry(table, &search); entry != NULL; entry = Tcl_NextHashEntry(&search))
+      Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj(Tcl_GetHashKey(table,entry),-1));
+    return TCL_OK;
+  case INFO_TYPEDEFS:		/* return list of typedef names */
+    table = &client->types;
+    goto list_table_keys;
+  case INFO_SIGNATURES:		/* return list of ffi signatures */
+    table = &client->cifs;
+    goto list_table_keys;
+  case INFO_LIBRARIES:		/* return list of lib names */
+    table = &client->libs;
+    goto list_table_keys;
+  case INFO_CALLBACKS:		/* return list of callback names */
+#if USE_CALLBACKS
+    table = &client->callbacks;
+    goto list_table_keys;
+#else
+    Tcl_AppendResult(interp, "callbacks are not supported in this configuration", NULL);
+    return TCL_ERROR;
+#endif
+
+  case INFO_CALLPATH:		/* return the way a callout calls */
+    {
+      ffidl_callout *callout;
+      if (objc != 3) {
+	Tcl_WrongNumArgs(interp,2,objv,"callout");
+	return TCL_ERROR;
+      }
+      callout = callout_command(interp, objv[2]);
+      if (callout == NULL) {
+	return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(callout_path(callout), -1));
+      return TCL_OK;
+    }
+
+  case INFO_DROPS:		/* return the calls a queued callback dropped */
+#if USE_CALLBACKS && TCL_THREADS
+    {
+      ffidl_callback *callback;
+      if (objc != 3) {
+	Tcl_WrongNumArgs(interp,2,objv,"callback");
+	return TCL_ERROR;
+      }
+      callback = callback_from_obj(interp, client, objv[2]);
+      if (callback == NULL) {
+	return TCL_ERROR;
+      }
+      if (callback->queue == NULL) {
+	Tcl_AppendResult(interp, "callback \"", Tcl_GetString(objv[2]), "\" is not queued", NULL);
+	return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)callback->queue->drops));
+      return TCL_OK;
+    }
+#else
+    Tcl_AppendResult(interp, "queued callbacks are not supported in this configuration", NULL);
+    return TCL_ERROR;
+#endif
+
+  case INFO_SIZEOF:		/* return sizeof type */
+  case INFO_ALIGNOF:		/* return alignof type */
+  case INFO_FORMAT:		/* return binary format of type */
+    if (objc != 3) {
+      Tcl_WrongNumArgs(interp,2,objv,"type");
+      return TCL_ERROR;
+    }
+    type = type_lookup_obj(client, objv[2]);
+    if (type == NULL) {
+      Tcl_AppendResult(interp, "undefined type: ", Tcl_GetString(objv[2]), NULL);
+      return TCL_ERROR;
+    }
+    if (i == INFO_SIZEOF) {
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->size));
+      return TCL_OK;
+    }
+    if (i == INFO_ALIGNOF) {
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->alignment));
+      return TCL_OK;
+    }
+    if (i == INFO_FORMAT) {
+      i = 0;
+      return type_format(interp, type, &i);
+    }
+    Tcl_AppendResult(interp, "lost in ::ffidl::info?", NULL);
+    return TCL_ERROR;
+  case INFO_INTERP:
+    /* return the interp as integer */
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp,2,objv,"");
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(interp));
+    return TCL_OK;
+  case INFO_USE_FFCALL:
+  case INFO_USE_LIBFFCALL:
+#if USE_LIBFFCALL
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_LIBFFI:
+#if USE_LIBFFI
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_CALLBACKS:
+#if USE_CALLBACKS
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_HAVE_LONG_LONG:
+#if HAVE_LONG_LONG
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_HAVE_LONG_DOUBLE:
+#if HAVE_LONG_DOUBLE
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_USE_LIBFFI_RAW:
+#if USE_LIBFFI_RAW_API
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_HAVE_INT64:
+#if HAVE_INT64
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+#else
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+#endif
+    return TCL_OK;
+  case INFO_CANONICAL_HOST:
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(CANONICAL_HOST,-1));
+    return TCL_OK;
+  case INFO_NULL:
+    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(NULL));
+    return TCL_OK;
+  }
+  
+  /* return an error */
+  Tcl_AppendResult(interp, "missing option implementation: ", Tcl_GetString(objv[option_ix]), NULL);
+  return TCL_ERROR;
+}
+
+/* usage: ::ffidl::pointer new address ?tag? | tag pointer */
+static int tcl_ffidl_pointer(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    option_ix,
+    pointer_ix,
+    tag_ix,
+    minargs = pointer_ix + 1,
+    maxargs = tag_ix + 1,
+  };
+
+  static const char *options[] = {
+    "new",
+    "tag",
+    NULL
+  };
+
+  enum {
+    option_new,
+    option_tag,
+  };
+
+  int option;
+  void *ptr;
+  Tcl_Obj *obj;
+
+  if (objc < minargs || objc > maxargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "option pointer ?tag?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", 0, &option) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  switch (option) {
+  case option_new:
+    if (Ffidl_GetPointerFromObj(interp, objv[pointer_ix], &ptr) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    obj = Tcl_NewObj();
+    Ffidl_SetTaggedPointerObj(obj, ptr, objc == maxargs ? objv[tag_ix] : NULL);
+    Tcl_SetObjResult(interp, obj);
+    return TCL_OK;
+  case option_tag:
+    if (objc != minargs) {
+      Tcl_WrongNumArgs(interp, 2, objv, "pointer");
+      return TCL_ERROR;
+    }
+    obj = objv[pointer_ix];
+    if (obj->typePtr == &ffidl_pointer_ObjType && FFIDL_POINTER_TAG(obj) != NULL) {
+      Tcl_SetObjResult(interp, FFIDL_POINTER_TAG(obj));
+    } else if (Ffidl_GetPointerFromObj(interp, obj, &ptr) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    return TCL_OK;
+  }
+  return TCL_ERROR;
+}
+
+/* fetch the buffer in obj */
+static ffidl_buffer *buffer_get(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+  ffidl_buffer *buffer = buffer_from_obj(obj);
+  if (buffer == NULL) {
+    Tcl_AppendResult(interp, "expected ffidl buffer but got \"", Tcl_GetString(obj), "\"", NULL);
+  }
+  return buffer;
+}
+/* fail unless scripts may write into the memory of obj */
+static int buffer_writable(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+  if (buffer_from_obj(obj) != NULL && FFIDL_BUFFER(obj)->readonly) {
+    Tcl_AppendResult(interp, "buffer is read-only", NULL);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+/* fetch an offset and length within buffer from objv, length defaults to the rest */
+static int buffer_range(Tcl_Interp *interp, ffidl_buffer *buffer, int objc, Tcl_Obj *CONST objv[],
+			Tcl_WideInt *offsetp, Tcl_WideInt *lengthp)
+{
+  *offsetp = 0;
+  if (objc > 0 && Tcl_GetWideIntFromObj(interp, objv[0], offsetp) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  *lengthp = buffer->size - *offsetp;
+  if (objc > 1 && Tcl_GetWideIntFromObj(interp, objv[1], lengthp) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  if (*offsetp < 0 || *lengthp < 0 || *offsetp > buffer->size || *lengthp > buffer->size - *offsetp) {
+    Tcl_AppendResult(interp, "range out of bounds", NULL);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+/* usage: ::ffidl::buffer option ?arg ...? */
+static int tcl_ffidl_buffer(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    option_ix,
+    buffer_ix,
+    minargs = buffer_ix + 1
+  };
+
+  static const char *options[] = {
+    "address",
+    "bytes",
+    "create",
+    "set",
+    "size",
+    "slice",
+    NULL
+  };
+
+  enum {
+    option_address,
+    option_bytes,
+    option_create,
+    option_set,
+    option_size,
+    option_slice,
+  };
+
+  int option, length;
+  Tcl_WideInt offset, wlength;
+  unsigned char *bytes;
+  ffidl_buffer *buffer, *view;
+
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "option arg ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", 0, &option) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  if (option == option_create) {
+    if (objc != 3) {
+      Tcl_WrongNumArgs(interp, 2, objv, "size");
+      return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[buffer_ix], &length) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (length < 0) {
+      Tcl_AppendResult(interp, "buffer size must not be negative", NULL);
+      return TCL_ERROR;
+    }
+    bytes = (unsigned char *)Tcl_AttemptAlloc(length > 0 ? length : 1);
+    if (bytes == NULL) {
+      Tcl_AppendResult(interp, "couldn't allocate buffer of ", Tcl_GetString(objv[buffer_ix]), " bytes", NULL);
+      return TCL_ERROR;
+    }
+    memset(bytes, 0, length);
+    buffer = (ffidl_buffer *)Tcl_Alloc(sizeof(ffidl_buffer));
+    buffer->refs = 0;
+    buffer->base = NULL;
+    buffer->bytes = bytes;
+    buffer->size = length;
+    buffer->map = NULL;
+    buffer->maplen = 0;
+    buffer->readonly = 0;
+    Tcl_SetObjResult(interp, buffer_new_obj(buffer));
+    return TCL_OK;
+  }
+  buffer = buffer_get(interp, objv[buffer_ix]);
+  if (buffer == NULL) {
+    return TCL_ERROR;
+  }
+  switch (option) {
+  case option_address:
+  case option_size:
+    if (objc != 3) {
+      Tcl_WrongNumArgs(interp, 2, objv, "buffer");
+      return TCL_ERROR;
+    }
+    if (option == option_size) {
+      Tcl_SetObjResult(interp, Tcl_NewWideIntObj(buffer->size));
+    } else {
+      Tcl_SetObjResult(interp, Ffidl_NewPointerObj(buffer->bytes));
+    }
+    return TCL_OK;
+  case option_bytes:
+  case option_slice:
+    if (objc > 5) {
+      Tcl_WrongNumArgs(interp, 2, objv, "buffer ?offset? ?length?");
+      return TCL_ERROR;
+    }
+    if (buffer_range(interp, buffer, objc-3, objv+3, &offset, &wlength) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (option == option_bytes) {
+      if (wlength > INT_MAX) {
+	Tcl_AppendResult(interp, "range is too long for a binary string", NULL);
+	return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(buffer->bytes+offset, (int)wlength));
+      return TCL_OK;
+    }
+    /* a view holds on to the buffer that owns the storage */
+    view = (ffidl_buffer *)Tcl_Alloc(sizeof(ffidl_buffer));
+    view->refs = 0;
+    view->base = buffer->base != NULL ? buffer->base : buffer;
+    view->base->refs += 1;
+    view->bytes = buffer->bytes+offset;
+    view->size = wlength;
+    view->map = NULL;
+    view->maplen = 0;
+    view->readonly = buffer->readonly;
+    Tcl_SetObjResult(interp, buffer_new_obj(view));
+    return TCL_OK;
+  case option_set:
+    if (objc != 5) {
+      Tcl_WrongNumArgs(interp, 2, objv, "buffer offset bytes");
+      return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj(interp, objv[3], &offset) == TCL_ERROR ||
+	buffer_writable(interp, objv[buffer_ix]) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    bytes = Tcl_GetByteArrayFromObj(objv[4], &length);
+    if (offset < 0 || offset > buffer->size || length > buffer->size - offset) {
+      Tcl_AppendResult(interp, "range out of bounds", NULL);
+      return TCL_ERROR;
+    }
+    memcpy(buffer->bytes+offset, bytes, length);
+    return TCL_OK;
+  }
+  return TCL_ERROR;
+}
+
+/* usage: ::ffidl::mmap path ?-offset bytes? ?-length bytes? ?-mode ro|rw? */
+static int tcl_ffidl_mmap(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    path_ix,
+    minargs
+  };
+
+  static const char *options[] = {
+    "-length",
+    "-mode",
+    "-offset",
+    NULL
+  };
+
+  enum {
+    option_length,
+    option_mode,
+    option_offset,
+  };
+
+  static const char *modes[] = {
+    "ro",
+    "rw",
+    NULL
+  };
+
+  enum {
+    mode_ro,
+    mode_rw,
+  };
+
+  char *path;
+  const void *native;
+  Tcl_WideInt offset = 0, length = -1, filesize, start, granularity;
+  int i, option, mode = mode_ro;
+  size_t maplen;
+  void *map;
+  ffidl_buffer *buffer;
+#if defined(__WIN32__)
+  HANDLE file, mapping;
+  LARGE_INTEGER large;
+  SYSTEM_INFO info;
+  char buff[64];
+#else
+  int fd;
+  struct stat st;
 #endif
-  case FFIDL_STRUCT:	_va_start_struct(alist,cif->rtype->size,cif->rtype->alignment,cif->rtype->splittable); break;
-  case FFIDL_PTR:	va_start_ptr(alist,void *); break;
-  case FFIDL_PTR_OBJ:	va_start_ptr(alist,Tcl_Obj *); break;
-  default:
-    Tcl_ResetResult(interp);
-    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto escape;
+
+  if (objc < minargs || (objc-minargs) % 2 != 0) {
+    Tcl_WrongNumArgs(interp, 1, objv, "path ?-offset bytes? ?-length bytes? ?-mode ro|rw?");
+    return TCL_ERROR;
   }
-  /* fetch and convert argument values */
-  for (i = 0; i < cif->argc; i++) {
-    switch (cif->atypes[i]->typecode) {
-    case FFIDL_INT:
-      objv[i] = Tcl_NewLongObj((long)va_arg_int(alist));
-      break;
-    case FFIDL_FLOAT:
-      objv[i] = Tcl_NewDoubleObj((double)va_arg_float(alist));
-      break;
-    case FFIDL_DOUBLE:
-      objv[i] = Tcl_NewDoubleObj(va_arg_double(alist));
-      break;
-    case FFIDL_UINT8:
-      objv[i] = Tcl_NewLongObj((long)va_arg_uint8(alist));
-      break;
-    case FFIDL_SINT8:
-      objv[i] = Tcl_NewLongObj((long)va_arg_sint8(alist));
-      break;
-    case FFIDL_UINT16:
-      objv[i] = Tcl_NewLongObj((long)va_arg_uint16(alist));
-      break;
-    case FFIDL_SINT16:
-      objv[i] = Tcl_NewLongObj((long)va_arg_sint16(alist));
-      break;
-    case FFIDL_UINT32:
-      objv[i] = Tcl_NewLongObj((long)va_arg_uint32(alist));
-      break;
-    case FFIDL_SINT32:
-      objv[i] = Tcl_NewLongObj((long)va_arg_sint32(alist));
+  for (i = minargs; i < objc; i += 2) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &option) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    switch (option) {
+    case option_length:
+      if (Tcl_GetWideIntFromObj(interp, objv[i+1], &length) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (length < 0) {
+	Tcl_AppendResult(interp, "range out of bounds", NULL);
+	return TCL_ERROR;
+      }
       break;
-#if HAVE_INT64
-    case FFIDL_UINT64:
-      objv[i] = Ffidl_NewInt64Obj((long)va_arg_uint64(alist));
+    case option_mode:
+      if (Tcl_GetIndexFromObj(interp, objv[i+1], modes, "mode", 0, &mode) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
       break;
-    case FFIDL_SINT64:
-      objv[i] = Ffidl_NewInt64Obj((long)va_arg_sint64(alist));
+    case option_offset:
+      if (Tcl_GetWideIntFromObj(interp, objv[i+1], &offset) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (offset < 0) {
+	Tcl_AppendResult(interp, "range out of bounds", NULL);
+	return TCL_ERROR;
+      }
       break;
+    }
+  }
+  path = Tcl_GetString(objv[path_ix]);
+  native = Tcl_FSGetNativePath(objv[path_ix]);
+  if (native == NULL) {
+    Tcl_AppendResult(interp, "couldn't map \"", path, "\": not a native file", NULL);
+    return TCL_ERROR;
+  }
+
+  /* open the file and check the range against its size */
+#if defined(__WIN32__)
+  file = CreateFileW((const WCHAR *)native, mode == mode_rw ? GENERIC_READ|GENERIC_WRITE : GENERIC_READ,
+		     FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    sprintf(buff, "error %lu", (unsigned long)GetLastError());
+    Tcl_AppendResult(interp, "couldn't open \"", path, "\": ", buff, NULL);
+    return TCL_ERROR;
+  }
+  if ( ! GetFileSizeEx(file, &large)) {
+    sprintf(buff, "error %lu", (unsigned long)GetLastError());
+    Tcl_AppendResult(interp, "couldn't map \"", path, "\": ", buff, NULL);
+    CloseHandle(file);
+    return TCL_ERROR;
+  }
+  filesize = large.QuadPart;
+  GetSystemInfo(&info);
+  granularity = info.dwAllocationGranularity;
+#else
+  fd = open((const char *)native, mode == mode_rw ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    Tcl_AppendResult(interp, "couldn't open \"", path, "\": ", Tcl_PosixError(interp), NULL);
+    return TCL_ERROR;
+  }
+  if (fstat(fd, &st) < 0) {
+    Tcl_AppendResult(interp, "couldn't map \"", path, "\": ", Tcl_PosixError(interp), NULL);
+    close(fd);
+    return TCL_ERROR;
+  }
+  filesize = st.st_size;
+  granularity = sysconf(_SC_PAGESIZE);
 #endif
-    case FFIDL_STRUCT:
-      objv[i] = Tcl_NewByteArrayObj(_va_arg_struct(alist,
-						   cif->atypes[i]->size,
-						   cif->atypes[i]->alignment),
-				    cif->atypes[i]->size);
-      break;
-    case FFIDL_PTR:
-      objv[i] = Ffidl_NewPointerObj(va_arg_ptr(alist,void *));
-      break;
-    case FFIDL_PTR_OBJ:
-      objv[i] = va_arg_ptr(alist,Tcl_Obj *);
-      break;
-    case FFIDL_PTR_UTF8:
-      objv[i] = Tcl_NewStringObj(va_arg_ptr(alist,char *), -1);
-      break;
-    case FFIDL_PTR_UTF16:
-      objv[i] = Tcl_NewUnicodeObj(va_arg_ptr(alist,Tcl_UniChar *), -1);
-      break;
-    default:
-      sprintf(buff, "unimplemented type for callback argument: %d", cif->atypes[i]->typecode);
-      Tcl_AppendResult(interp, buff, NULL);
-      while (i-- >= 0) {
-	Tcl_DecrRefCount(objv[i]);
-      }
-      goto escape;
+  if (length < 0) {
+    length = offset < filesize ? filesize - offset : 0;
+  }
+  map = NULL;
+  start = offset - offset % granularity;
+  maplen = (size_t)(offset - start + length);
+  if (offset > filesize || length > filesize - offset ||
+      (Tcl_WideUInt)(offset - start + length) != (Tcl_WideUInt)maplen) {
+    Tcl_AppendResult(interp, "range out of bounds", NULL);
+    goto close;
+  }
+
+  /* map from the boundary at or below offset, an empty range maps nothing */
+  if (length == 0) {
+    goto close;
+  }
+#if defined(__WIN32__)
+  mapping = CreateFileMappingW(file, NULL, mode == mode_rw ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+  map = mapping == NULL ? NULL :
+    MapViewOfFile(mapping, mode == mode_rw ? FILE_MAP_WRITE : FILE_MAP_READ,
+		  (DWORD)(start >> 32), (DWORD)start, maplen);
+  if (map == NULL) {
+    sprintf(buff, "error %lu", (unsigned long)GetLastError());
+    Tcl_AppendResult(interp, "couldn't map \"", path, "\": ", buff, NULL);
+  }
+  if (mapping != NULL) {
+    CloseHandle(mapping);
+  }
+#else
+  map = mmap(NULL, maplen, mode == mode_rw ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, (off_t)start);
+  if (map == MAP_FAILED) {
+    Tcl_AppendResult(interp, "couldn't map \"", path, "\": ", Tcl_PosixError(interp), NULL);
+    map = NULL;
+  }
+#endif
+
+ close:
+  /* the mapping outlives the file handle */
+#if defined(__WIN32__)
+  CloseHandle(file);
+#else
+  close(fd);
+#endif
+  if (map == NULL && (length != 0 || offset > filesize)) {
+    return TCL_ERROR;
+  }
+  buffer = (ffidl_buffer *)Tcl_Alloc(sizeof(ffidl_buffer));
+  buffer->refs = 0;
+  buffer->base = NULL;
+  if (map != NULL) {
+    buffer->bytes = (unsigned char *)map + (offset - start);
+    buffer->map = map;
+    buffer->maplen = maplen;
+  } else {
+    buffer->bytes = (unsigned char *)Tcl_Alloc(1);
+    buffer->map = NULL;
+    buffer->maplen = 0;
+  }
+  buffer->size = length;
+  buffer->readonly = mode == mode_ro;
+  Tcl_SetObjResult(interp, buffer_new_obj(buffer));
+  return TCL_OK;
+}
+
+/*
+ * Memory channels.
+ *
+ * An ffidl-memory channel reads, writes and seeks directly in a region
+ * of native memory, a buffer or a pointer with a length, which it never
+ * grows.  A channel on a buffer holds a reference to it until closed.
+ * The region is always ready, so file events fire whenever asked for.
+ */
+typedef struct ffidl_memchan ffidl_memchan;
+struct ffidl_memchan {
+  Tcl_Channel channel;
+  Tcl_Obj *owner;		/* Buffer holding the memory, or NULL. */
+  unsigned char *bytes;
+  Tcl_WideInt size;
+  Tcl_WideInt pos;
+  int interest;			/* Events asked for by the generic layer. */
+  Tcl_TimerToken timer;
+};
+
+static int memchan_close(ClientData instanceData, Tcl_Interp *interp)
+{
+  ffidl_memchan *memchan = (ffidl_memchan *)instanceData;
+  if (memchan->timer != NULL) {
+    Tcl_DeleteTimerHandler(memchan->timer);
+  }
+  if (memchan->owner != NULL) {
+    Tcl_DecrRefCount(memchan->owner);
+  }
+  Tcl_Free((char *)memchan);
+  return 0;
+}
+static int memchan_input(ClientData instanceData, char *buf, int toRead, int *errorCodePtr)
+{
+  ffidl_memchan *memchan = (ffidl_memchan *)instanceData;
+  if (toRead > memchan->size - memchan->pos) {
+    toRead = (int)(memchan->size - memchan->pos);
+  }
+  memcpy(buf, memchan->bytes+memchan->pos, toRead);
+  memchan->pos += toRead;
+  return toRead;
+}
+static int memchan_output(ClientData instanceData, CONST char *buf, int toWrite, int *errorCodePtr)
+{
+  ffidl_memchan *memchan = (ffidl_memchan *)instanceData;
+  if (toWrite > memchan->size - memchan->pos) {
+    toWrite = (int)(memchan->size - memchan->pos);
+    if (toWrite == 0) {
+      *errorCodePtr = ENOSPC;
+      return -1;
     }
-    Tcl_IncrRefCount(objv[i]);
   }
-  /* call */
-  status = Tcl_EvalObjv(interp, callback->cmdc+cif->argc, callback->cmdv, TCL_EVAL_GLOBAL);
-  /* clean up arguments */
-  for (i = 0; i < cif->argc; i++) {
-    Tcl_DecrRefCount(objv[i]);
+  memcpy(memchan->bytes+memchan->pos, buf, toWrite);
+  memchan->pos += toWrite;
+  return toWrite;
+}
+static Tcl_WideInt memchan_wide_seek(ClientData instanceData, Tcl_WideInt offset, int seekMode, int *errorCodePtr)
+{
+  ffidl_memchan *memchan = (ffidl_memchan *)instanceData;
+  if (seekMode == SEEK_CUR) {
+    offset += memchan->pos;
+  } else if (seekMode == SEEK_END) {
+    offset += memchan->size;
   }
-  if (status == TCL_ERROR) {
-    goto escape;
+  if (offset < 0 || offset > memchan->size) {
+    *errorCodePtr = EINVAL;
+    return -1;
   }
-  /* fetch return value */
-  obj = Tcl_GetObjResult(interp);
-  if (cif->rtype->class & FFIDL_GETINT) {
-    if (obj->typePtr == ffidl_double_ObjType) {
-      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
+  return memchan->pos = offset;
+}
+static int memchan_seek(ClientData instanceData, long offset, int seekMode, int *errorCodePtr)
+{
+  Tcl_WideInt pos = memchan_wide_seek(instanceData, offset, seekMode, errorCodePtr);
+  if (pos > INT_MAX) {
+    *errorCodePtr = EOVERFLOW;
+    return -1;
+  }
+  return (int)pos;
+}
+static void memchan_ready(ClientData clientData)
+{
+  ffidl_memchan *memchan = (ffidl_memchan *)clientData;
+  memchan->timer = NULL;
+  Tcl_NotifyChannel(memchan->channel, memchan->interest);
+}
+static void memchan_watch(ClientData instanceData, int mask)
+{
+  ffidl_memchan *memchan = (ffidl_memchan *)instanceData;
+  memchan->interest = mask;
+  if (mask != 0 && memchan->timer == NULL) {
+    memchan->timer = Tcl_CreateTimerHandler(0, memchan_ready, memchan);
+  } else if (mask == 0 && memchan->timer != NULL) {
+    Tcl_DeleteTimerHandler(memchan->timer);
+    memchan->timer = NULL;
+  }
+}
+static int memchan_get_handle(ClientData instanceData, int direction, ClientData *handlePtr)
+{
+  return TCL_ERROR;
+}
+static int memchan_block_mode(ClientData instanceData, int mode)
+{
+  return 0;
+}
+
+static Tcl_ChannelType ffidl_memchan_ChannelType = {
+  "ffidl-memory",
+  TCL_CHANNEL_VERSION_5,
+  memchan_close,
+  memchan_input,
+  memchan_output,
+  memchan_seek,
+  NULL,				/* setOptionProc */
+  NULL,				/* getOptionProc */
+  memchan_watch,
+  memchan_get_handle,
+  NULL,				/* close2Proc */
+  memchan_block_mode,
+  NULL,				/* flushProc */
+  NULL,				/* handlerProc */
+  memchan_wide_seek,
+  NULL,				/* threadActionProc */
+  NULL				/* truncateProc */
+};
+
+/* usage: ::ffidl::channel memory ?length? ?-mode r|r+|w? */
+static int tcl_ffidl_channel(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    memory_ix,
+    minargs
+  };
+
+  static const char *modes[] = {
+    "r",
+    "r+",
+    "w",
+    NULL
+  };
+
+  static const int masks[] = {
+    TCL_READABLE,
+    TCL_READABLE|TCL_WRITABLE,
+    TCL_WRITABLE
+  };
+
+  char name[64];
+  void *ptr;
+  int mode = 0;
+  Tcl_WideInt length = -1;
+  Tcl_Obj *memory;
+  ffidl_buffer *buffer;
+  ffidl_memchan *memchan;
+
+  if (objc > minargs+1 && strcmp(Tcl_GetString(objv[objc-2]), "-mode") == 0) {
+    if (Tcl_GetIndexFromObj(interp, objv[objc-1], modes, "mode", 0, &mode) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    objc -= 2;
+  }
+  if (objc < minargs || objc > minargs+1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "memory ?length? ?-mode r|r+|w?");
+    return TCL_ERROR;
+  }
+  if (objc > minargs && Tcl_GetWideIntFromObj(interp, objv[minargs], &length) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  memory = objv[memory_ix];
+  buffer = buffer_from_obj(memory);
+  if (buffer != NULL) {
+    if (length < 0) {
+      length = buffer->size;
+    }
+    if (length > buffer->size) {
+      Tcl_AppendResult(interp, "range out of bounds", NULL);
+      return TCL_ERROR;
+    }
+    if ((masks[mode] & TCL_WRITABLE) && buffer_writable(interp, memory) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    ptr = buffer->bytes;
+    /* the channel keeps the buffer, not this value, which may change type */
+    memory = buffer_new_obj(buffer);
+  } else {
+    if (Ffidl_GetPointerFromObj(interp, memory, &ptr) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (length < 0) {
+      Tcl_AppendResult(interp, "length is required for a channel on a pointer", NULL);
+      return TCL_ERROR;
+    }
+    memory = NULL;
+  }
+  memchan = (ffidl_memchan *)Tcl_Alloc(sizeof(ffidl_memchan));
+  memchan->owner = memory;
+  if (memory != NULL) {
+    Tcl_IncrRefCount(memory);
+  }
+  memchan->bytes = (unsigned char *)ptr;
+  memchan->size = length;
+  memchan->pos = 0;
+  memchan->interest = 0;
+  memchan->timer = NULL;
+  sprintf(name, "ffidlmem%lx", (unsigned long)(size_t)memchan);
+  memchan->channel = Tcl_CreateChannel(&ffidl_memchan_ChannelType, name, memchan, masks[mode]);
+  Tcl_SetChannelOption(NULL, memchan->channel, "-translation", "binary");
+  Tcl_RegisterChannel(interp, memchan->channel);
+  Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+  return TCL_OK;
+}
+
+/* usage: ffidl-typedef ?-fields names? name type1 ?type2 ...? */
+static int tcl_ffidl_typedef(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    name_ix,
+    type_ix,
+    minargs
+  };
+
+  char *tname1, *tname2;
+  ffidl_type *newtype, *ttype2;
+  int nelts, nfields = 0, i, j;
+  Tcl_Obj **fieldv = NULL;
+  ffidl_client *client = (ffidl_client *)clientData;
+
+  /* pick off the field names */
+  if (objc > 1 && strcmp(Tcl_GetString(objv[1]), "-fields") == 0) {
+    if (objc < 3 || Tcl_ListObjGetElements(interp, objv[2], &nfields, &fieldv) == TCL_ERROR) {
+      if (objc < 3) Tcl_WrongNumArgs(interp,1,objv,"?-fields names? name type ?...?");
+      return TCL_ERROR;
+    }
+    objc -= 2;
+    objv += 2;
+  }
+  /* check number of args */
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp,1,objv,"?-fields names? name type ?...?");
+    return TCL_ERROR;
+  }
+  /* fetch new type name, verify that it is new */
+  tname1 = Tcl_GetString(objv[name_ix]);
+  if (type_lookup(client, tname1) != NULL) {
+    Tcl_AppendResult(interp, "type is already defined: ", tname1, NULL);
+    return TCL_ERROR;
+  }
+  nelts = objc - 2;
+  if (fieldv != NULL && (nelts == 1 || nfields != nelts)) {
+    Tcl_AppendResult(interp, "-fields needs one name per element of a structure", NULL);
+    return TCL_ERROR;
+  }
+  for (i = 0; i < nfields; i += 1) {
+    for (j = 0; j < i; j += 1) {
+      if (strcmp(Tcl_GetString(fieldv[i]), Tcl_GetString(fieldv[j])) == 0) {
+	Tcl_AppendResult(interp, "duplicate field name: ", Tcl_GetString(fieldv[i]), NULL);
+	return TCL_ERROR;
       }
-      ltmp = (long)dtmp;
-      if (dtmp != ltmp)
-	if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
-    } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-      Tcl_AppendResult(interp, ", converting callback return value", NULL);
-      goto escape;
     }
-#if HAVE_INT64
-  } else if (cif->rtype->class & FFIDL_GETWIDEINT) {
-    if (obj->typePtr == ffidl_double_ObjType) {
-      if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
+  }
+  if (nelts == 1) {
+    /* define tname1 as an alias for tname2 */
+    tname2 = Tcl_GetString(objv[type_ix]);
+    ttype2 = type_lookup_obj(client, objv[type_ix]);
+    if (ttype2 == NULL) {
+      Tcl_AppendResult(interp, "undefined type: ", tname2, NULL);
+      return TCL_ERROR;
+    }
+    /* define alias */
+    type_define(client, tname1, ttype2);
+    type_inc_ref(ttype2);
+  } else {
+    /* allocate an aggregate type */
+    newtype = type_alloc(client, nelts);
+    if (newtype == NULL) {
+      Tcl_AppendResult(interp, "couldn't allocate the ffi_type", NULL);
+      return TCL_ERROR;
+    }
+    /* parse aggregate types */
+    newtype->size = 0;
+    newtype->alignment = 0;
+    for (i = 0; i < nelts; i += 1) {
+      tname2 = Tcl_GetString(objv[type_ix+i]);
+      ttype2 = type_lookup_obj(client, objv[type_ix+i]);
+      if (ttype2 == NULL) {
+	type_free(newtype);
+	Tcl_AppendResult(interp, "undefined element type: ", tname2, NULL);
+	return TCL_ERROR;
       }
-      wtmp = (Ffidl_Int64)dtmp;
-      if (dtmp != wtmp) {
-	if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
+      if ((ttype2->class & FFIDL_ELT) == 0) {
+	type_free(newtype);
+	Tcl_AppendResult(interp, "type ", tname2, " is not permitted in element context", NULL);
+	return TCL_ERROR;
       }
-    } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-      Tcl_AppendResult(interp, ", converting callback return value", NULL);
-      goto escape;
-    }
-#endif
-  } else if (cif->rtype->class & FFIDL_GETDOUBLE) {
-    if (obj->typePtr == ffidl_int_ObjType) {
-      if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
+      newtype->elements[i] = ttype2;
+      /* accumulate the aggregate size and alignment */
+      /* align current size to element's alignment */
+      if ((ttype2->alignment-1) & newtype->size) {
+	newtype->size = ((newtype->size-1) | (ttype2->alignment-1)) + 1;
       }
-      dtmp = (double)ltmp;
-      if (dtmp != ltmp) {
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
+      newtype->offsets[i] = newtype->size;
+      /* add the element's size */
+      newtype->size += ttype2->size;
+      /* bump the aggregate alignment as required */
+      if (ttype2->alignment > newtype->alignment) {
+	newtype->alignment = ttype2->alignment;
       }
-#if HAVE_WIDE_INT
-    } else if (obj->typePtr == ffidl_wideInt_ObjType) {
-      if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	goto escape;
+    }
+    newtype->size = ((newtype->size-1) | (newtype->alignment-1)) + 1; /* tail padding as in libffi */
+    if (type_prep(newtype) != TCL_OK) {
+      type_free(newtype);
+      Tcl_AppendResult(interp, "type definition error", NULL);
+      return TCL_ERROR;
+    }
+    if (nfields > 0) {
+      /* a NULL terminated table for Tcl_GetIndexFromObj, names following */
+      size_t bytes = (nfields+1)*sizeof(char *);
+      char *name;
+      for (i = 0; i < nfields; i += 1) {
+	bytes += strlen(Tcl_GetString(fieldv[i]))+1;
       }
-      dtmp = (double)wtmp;
-      if (dtmp != wtmp) {
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-	  Tcl_AppendResult(interp, ", converting callback return value", NULL);
-	  goto escape;
-	}
+      newtype->fields = (char **)Tcl_Alloc(bytes);
+      name = (char *)(newtype->fields+nfields+1);
+      for (i = 0; i < nfields; i += 1) {
+	newtype->fields[i] = strcpy(name, Tcl_GetString(fieldv[i]));
+	name += strlen(name)+1;
       }
+      newtype->fields[nfields] = NULL;
+    }
+    /* define new type */
+    type_define(client, tname1, newtype);
+    type_inc_ref(newtype);
+  }
+  /* return success */
+  return TCL_OK;
+}
+
+/*
+ * Struct fields.
+ *
+ * ::ffidl::struct reads and writes the fields of a type defined with
+ * -fields at the offsets worked out by typedef, in a binary string, a
+ * buffer or native memory at a pointer, without scanning the rest.
+ */
+/* make an object of the value of type at addr */
+static Tcl_Obj *field_get(ffidl_type *type, void *addr)
+{
+  switch (type->typecode) {
+  case FFIDL_INT:	return Tcl_NewLongObj((long)(*(int *)addr));
+  case FFIDL_FLOAT:	return Tcl_NewDoubleObj((double)(*(float *)addr));
+  case FFIDL_DOUBLE:	return Tcl_NewDoubleObj(*(double *)addr);
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:	return Tcl_NewDoubleObj((double)(*(long double *)addr));
+#endif
+  case FFIDL_UINT8:	return Tcl_NewLongObj((long)(*(UINT8_T *)addr));
+  case FFIDL_SINT8:	return Tcl_NewLongObj((long)(*(SINT8_T *)addr));
+  case FFIDL_UINT16:	return Tcl_NewLongObj((long)(*(UINT16_T *)addr));
+  case FFIDL_SINT16:	return Tcl_NewLongObj((long)(*(SINT16_T *)addr));
+  case FFIDL_UINT32:	return Tcl_NewLongObj((long)(*(UINT32_T *)addr));
+  case FFIDL_SINT32:	return Tcl_NewLongObj((long)(*(SINT32_T *)addr));
+#if HAVE_INT64
+  case FFIDL_UINT64:	return Ffidl_NewInt64Obj((Ffidl_Int64)(*(UINT64_T *)addr));
+  case FFIDL_SINT64:	return Ffidl_NewInt64Obj((Ffidl_Int64)(*(SINT64_T *)addr));
 #endif
-    } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR) {
-      Tcl_AppendResult(interp, ", converting callback return value", NULL);
-      goto escape;
+  case FFIDL_STRUCT:	return Tcl_NewByteArrayObj((unsigned char *)addr, type->size);
+  case FFIDL_PTR:	return Ffidl_NewPointerObj(*(void **)addr);
+  case FFIDL_ARRAY:
+    {
+      Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+      size_t i;
+      for (i = 0; i < type->count; i += 1)
+	Tcl_ListObjAppendElement(NULL, list, field_get(type->elements[0], (char *)addr+i*type->elements[0]->size));
+      return list;
     }
+  default:		return Tcl_NewObj();
   }
-  
-  /* convert return value */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	va_return_void(alist); break;
-  case FFIDL_INT:	va_return_int(alist, ltmp); break;
-  case FFIDL_FLOAT:	va_return_float(alist, dtmp); break;
-  case FFIDL_DOUBLE:	va_return_double(alist, dtmp); break;
-  case FFIDL_UINT8:	va_return_uint8(alist, ltmp); break;
-  case FFIDL_SINT8:	va_return_sint8(alist, ltmp); break;
-  case FFIDL_UINT16:	va_return_uint16(alist, ltmp); break;
-  case FFIDL_SINT16:	va_return_sint16(alist, ltmp); break;
-  case FFIDL_UINT32:	va_return_uint32(alist, ltmp); break;
-  case FFIDL_SINT32:	va_return_sint32(alist, ltmp); break;
+}
+/* store obj as a value of type at addr */
+static int field_set(Tcl_Interp *interp, ffidl_type *type, void *addr, Tcl_Obj *obj)
+{
+  char buff[128];
+  long ltmp = 0;
 #if HAVE_INT64
-  case FFIDL_UINT64:	va_return_uint64(alist, wtmp); break;
-  case FFIDL_SINT64:	va_return_sint64(alist, wtmp); break;
+  Ffidl_Int64 wtmp = 0;
 #endif
-  case FFIDL_STRUCT:	
+  double dtmp = 0;
+  void *ptmp;
+  unsigned char *bytes;
+  int len;
+
+  if (type->typecode == FFIDL_PTR) {
+    if (Ffidl_GetPointerFromObj(interp, obj, &ptmp) == TCL_ERROR)
+      return TCL_ERROR;
+    *(void **)addr = ptmp;
+    return TCL_OK;
+  }
+  if (type->class & FFIDL_GETDOUBLE) {
+    if (marshal_get_double(interp, obj, &dtmp) == TCL_ERROR)
+      return TCL_ERROR;
+  } else if (type->class & FFIDL_GETINT) {
+    if (marshal_get_long(interp, obj, &ltmp) == TCL_ERROR)
+      return TCL_ERROR;
+#if HAVE_INT64
+  } else if (type->class & FFIDL_GETWIDEINT) {
+    if (marshal_get_int64(interp, obj, &wtmp) == TCL_ERROR)
+      return TCL_ERROR;
+#endif
+  }
+  switch (type->typecode) {
+  case FFIDL_INT:	*(int *)addr = (int)ltmp; break;
+  case FFIDL_FLOAT:	*(float *)addr = (float)dtmp; break;
+  case FFIDL_DOUBLE:	*(double *)addr = dtmp; break;
+#if HAVE_LONG_DOUBLE
+  case FFIDL_LONGDOUBLE:	*(long double *)addr = (long double)dtmp; break;
+#endif
+  case FFIDL_UINT8:	*(UINT8_T *)addr = (UINT8_T)ltmp; break;
+  case FFIDL_SINT8:	*(SINT8_T *)addr = (SINT8_T)ltmp; break;
+  case FFIDL_UINT16:	*(UINT16_T *)addr = (UINT16_T)ltmp; break;
+  case FFIDL_SINT16:	*(SINT16_T *)addr = (SINT16_T)ltmp; break;
+  case FFIDL_UINT32:	*(UINT32_T *)addr = (UINT32_T)ltmp; break;
+  case FFIDL_SINT32:	*(SINT32_T *)addr = (SINT32_T)ltmp; break;
+#if HAVE_INT64
+  case FFIDL_UINT64:	*(UINT64_T *)addr = (UINT64_T)wtmp; break;
+  case FFIDL_SINT64:	*(SINT64_T *)addr = (SINT64_T)wtmp; break;
+#endif
+  case FFIDL_STRUCT:
+    bytes = Tcl_GetByteArrayFromObj(obj, &len);
+    if (len != type->size) {
+      sprintf(buff, "field value has %u bytes instead of %lu", len, (long)(type->size));
+      Tcl_AppendResult(interp, buff, NULL);
+      return TCL_ERROR;
+    }
+    memcpy(addr, bytes, len);
+    break;
+  case FFIDL_ARRAY:
     {
-      int len;
-      void *bytes = Tcl_GetByteArrayFromObj(obj, &len);
-      if (len != cif->rtype->size) {
-	Tcl_ResetResult(interp);
-	sprintf(buff, "byte array for callback struct return has %u bytes instead of %lu", len, (long)(cif->rtype->size));
+      Tcl_Obj **elts;
+      if (Tcl_ListObjGetElements(interp, obj, &len, &elts) == TCL_ERROR)
+	return TCL_ERROR;
+      if (len != type->count) {
+	sprintf(buff, "field value has %u elements instead of %lu", len, (long)(type->count));
 	Tcl_AppendResult(interp, buff, NULL);
-	goto escape;
+	return TCL_ERROR;
       }
-      _va_return_struct(alist, cif->rtype->size, cif->rtype->alignment, bytes);
-      break;
+      for (len = 0; len < type->count; len += 1)
+	if (field_set(interp, type->elements[0], (char *)addr+len*type->elements[0]->size, elts[len]) == TCL_ERROR)
+	  return TCL_ERROR;
     }
-  case FFIDL_PTR:	va_return_ptr(alist, void *, ltmp); break;
-  case FFIDL_PTR_OBJ:	va_return_ptr(alist, Tcl_Obj *, obj); break;
+    break;
   default:
-    Tcl_ResetResult(interp);
-    sprintf(buff, "unimplemented type for callback return: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto escape;
+    break;
   }
-  /* done */
-  return;
-escape:
-  Tcl_BackgroundError(interp);
+  return TCL_OK;
+}
+
+/* whether obj is read as a binary string rather than as memory */
+static int memory_is_value(Tcl_Obj *obj, int pointer)
+{
+  return ! pointer && obj->typePtr != &ffidl_pointer_ObjType && buffer_from_obj(obj) == NULL;
 }
-#endif
-#endif
 /*
- * Client management.
+ * find the native memory of obj: a buffer, a pointer made by ffidl or,
+ * with pointer set, any address, whose size is unknown and given as -1,
+ * or else the bytes of obj as a binary string.  The value's kind never
+ * decides, so a binary string that shimmered is still read as bytes.
  */
-/* client interp deletion callback for cleanup */
-static void client_delete(ClientData clientData, Tcl_Interp *interp)
+static int memory_from_obj(Tcl_Interp *interp, Tcl_Obj *obj, int pointer, char **basep, int *sizep)
 {
+  void *ptr;
+  if (buffer_from_obj(obj) != NULL) {
+    /* offsets from scripts are ints, so larger buffers are cut short */
+    *basep = (char *)FFIDL_BUFFER(obj)->bytes;
+    *sizep = FFIDL_BUFFER(obj)->size > INT_MAX ? INT_MAX : (int)FFIDL_BUFFER(obj)->size;
+    return TCL_OK;
+  }
+  if (memory_is_value(obj, pointer)) {
+    *basep = (char *)Tcl_GetByteArrayFromObj(obj, sizep);
+    return TCL_OK;
+  }
+  if (Ffidl_GetPointerFromObj(interp, obj, &ptr) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  *basep = (char *)ptr;
+  *sizep = -1;
+  return TCL_OK;
+}
+
+/* usage: ::ffidl::struct get ?-pointer? type struct field ?field ...? | set ?-pointer? type struct field value ?field value ...? */
+static int tcl_ffidl_struct(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    option_ix,
+    type_ix,
+    struct_ix,
+    field_ix,
+    minargs
+  };
+
+  static const char *options[] = {
+    "get",
+    "set",
+    NULL
+  };
+
+  enum {
+    option_get,
+    option_set,
+  };
+
+  char buff[128];
   ffidl_client *client = (ffidl_client *)clientData;
-  Tcl_HashSearch search;
-  Tcl_HashEntry *entry;
+  ffidl_type *type;
+  Tcl_Obj *target, *result;
+  char *base;
+  int option, i, field, len, pointer, value, inplace = 0, status = TCL_ERROR;
 
-  /* there should be no callouts left */
-  for (entry = Tcl_FirstHashEntry(&client->callouts, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    char *name = Tcl_GetHashKey(&client->callouts, entry);
-    /* Couldn't do this while traversing the hash table anyway */
-    /* Tcl_DeleteCommand(interp, name); */
-    fprintf(stderr, "error - dangling callout in client_delete: %s\n", name);
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "option ?-pointer? type struct field ?arg ...?");
+    return TCL_ERROR;
   }
-
-#if USE_CALLBACKS
-  /* free all callbacks */
-  for (entry = Tcl_FirstHashEntry(&client->callbacks, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    ffidl_callback *callback = Tcl_GetHashValue(entry);
-    callback_free(callback);
+  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", 0, &option) == TCL_ERROR) {
+    return TCL_ERROR;
   }
-#endif
-
-  /* there should be no cifs left */
-  for (entry = Tcl_FirstHashEntry(&client->cifs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    char *signature = Tcl_GetHashKey(&client->cifs, entry);
-    fprintf(stderr, "error - dangling ffidl_cif in client_delete: %s\n",signature);
+  pointer = objc > minargs && strcmp(Tcl_GetString(objv[type_ix]), "-pointer") == 0;
+  if (option == option_set && (objc-pointer-field_ix) % 2 != 0) {
+    Tcl_WrongNumArgs(interp, 2, objv, "?-pointer? type struct field value ?field value ...?");
+    return TCL_ERROR;
   }
-
-  /* free all allocated typedefs */
-  for (entry = Tcl_FirstHashEntry(&client->types, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    ffidl_type *type = Tcl_GetHashValue(entry);
-    if ((type->class & FFIDL_STATIC_TYPE) == 0) {
-      type_dec_ref(type);
+  /* past -pointer, the words keep their indices */
+  objc -= pointer;
+  objv += pointer;
+  type = type_lookup_obj(client, objv[type_ix]);
+  if (type == NULL) {
+    Tcl_AppendResult(interp, "undefined type: ", Tcl_GetString(objv[type_ix]), NULL);
+    return TCL_ERROR;
+  }
+  if (type->fields == NULL) {
+    Tcl_AppendResult(interp, "type has no fields: ", Tcl_GetString(objv[type_ix]), NULL);
+    return TCL_ERROR;
+  }
+  /* find the structure, copying a shared binary string before writing it */
+  target = objv[struct_ix];
+  value = memory_is_value(target, pointer);
+  if (value && option == option_set && Tcl_IsShared(target)) {
+    target = Tcl_DuplicateObj(target);
+  }
+  Tcl_IncrRefCount(target);
+  if (memory_from_obj(interp, target, pointer, &base, &len) == TCL_ERROR ||
+      (option == option_set && buffer_writable(interp, target) == TCL_ERROR)) {
+    goto done;
+  }
+  inplace = len >= 0;
+  if (target->typePtr == &ffidl_buffer_ObjType && len < type->size) {
+    Tcl_AppendResult(interp, "buffer is too small for type ", Tcl_GetString(objv[type_ix]), NULL);
+    goto done;
+  }
+  if (value && len != type->size) {
+    sprintf(buff, "binary string has %u bytes instead of %lu", len, (long)(type->size));
+    Tcl_AppendResult(interp, buff, NULL);
+    goto done;
+  }
+  if (option == option_get) {
+    result = objc-field_ix == 1 ? NULL : Tcl_NewListObj(0, NULL);
+    for (i = field_ix; i < objc; i += 1) {
+      if (Tcl_GetIndexFromObjStruct(interp, objv[i], type->fields, sizeof(char *), "field", TCL_EXACT, &field) == TCL_ERROR ||
+	  field >= type->nelts) {
+	if (result != NULL) {
+	  Tcl_DecrRefCount(result);
+	}
+	goto done;
+      }
+      if (result == NULL) {
+	result = field_get(type->elements[field], base+type->offsets[field]);
+      } else {
+	Tcl_ListObjAppendElement(interp, result, field_get(type->elements[field], base+type->offsets[field]));
+      }
+    }
+  } else {
+    for (i = field_ix; i < objc; i += 2) {
+      if (Tcl_GetIndexFromObjStruct(interp, objv[i], type->fields, sizeof(char *), "field", TCL_EXACT, &field) == TCL_ERROR ||
+	  field >= type->nelts ||
+	  field_set(interp, type->elements[field], base+type->offsets[field], objv[i+1]) == TCL_ERROR) {
+	goto done;
+      }
     }
+    result = target;
   }
+  Tcl_SetObjResult(interp, result);
+  status = TCL_OK;
+ done:
+  if (option == option_set && inplace && target->typePtr != &ffidl_buffer_ObjType) {
+    Tcl_InvalidateStringRep(target);
+  }
+  Tcl_DecrRefCount(target);
+  return status;
+}
 
-  /* free all libs */
-  for (entry = Tcl_FirstHashEntry(&client->libs, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-    char *libraryName = Tcl_GetHashKey(&client->libs, entry);
-    ffidl_lib *libentry = Tcl_GetHashValue(entry);
-    ffidlclose(interp, libraryName, libentry->loadHandle, libentry->unloadProc);
-    Tcl_Free((void *)libentry);
+/* find a type that can be packed into an array */
+static ffidl_type *pack_type(Tcl_Interp *interp, ffidl_client *client, Tcl_Obj *obj)
+{
+  ffidl_type *type = type_lookup_obj(client, obj);
+  if (type == NULL) {
+    Tcl_AppendResult(interp, "undefined type: ", Tcl_GetString(obj), NULL);
+    return NULL;
+  }
+  if ((type->class & FFIDL_ELT) == 0 || type->size == 0) {
+    Tcl_AppendResult(interp, "type ", Tcl_GetString(obj), " cannot be packed", NULL);
+    return NULL;
   }
+  return type;
+}
 
-  /* free hashtables */
-  Tcl_DeleteHashTable(&client->callouts);
-#if USE_CALLBACKS
-  Tcl_DeleteHashTable(&client->callbacks);
+/*
+ * Convert n list elements into an array of type at dst, returning the
+ * index of the element that failed, or -1.  Numeric types run in loops
+ * of their own that take integers and doubles straight from the
+ * internal rep, everything else goes through field_set.
+ */
+#define PACK_LONG(ctype)						\
+  for (i = 0; i < n; i += 1) {						\
+    if (elts[i]->typePtr == ffidl_int_ObjType) {			\
+      ((ctype *)dst)[i] = (ctype)elts[i]->internalRep.longValue;	\
+    } else if (marshal_get_long(interp, elts[i], &ltmp) == TCL_OK) {	\
+      ((ctype *)dst)[i] = (ctype)ltmp;					\
+    } else {								\
+      return i;								\
+    }									\
+  }									\
+  return -1
+#define PACK_DOUBLE(ctype)						\
+  for (i = 0; i < n; i += 1) {						\
+    if (elts[i]->typePtr == ffidl_double_ObjType) {			\
+      ((ctype *)dst)[i] = (ctype)elts[i]->internalRep.doubleValue;	\
+    } else if (elts[i]->typePtr == ffidl_int_ObjType) {		\
+      ((ctype *)dst)[i] = (ctype)elts[i]->internalRep.longValue;	\
+    } else if (marshal_get_double(interp, elts[i], &dtmp) == TCL_OK) {	\
+      ((ctype *)dst)[i] = (ctype)dtmp;					\
+    } else {								\
+      return i;								\
+    }									\
+  }									\
+  return -1
+
+static int pack_array(Tcl_Interp *interp, ffidl_type *type, Tcl_Obj **elts, int n, char *dst)
+{
+  long ltmp;
+  double dtmp;
+#if HAVE_INT64
+  Ffidl_Int64 wtmp;
 #endif
-  Tcl_DeleteHashTable(&client->cifs);
-  Tcl_DeleteHashTable(&client->types);
-  Tcl_DeleteHashTable(&client->libs);
+  int i;
 
-  /* free client structure */
-  Tcl_Free((void *)client);
+  switch (type->typecode) {
+  case FFIDL_INT:	PACK_LONG(int);
+  case FFIDL_UINT8:	PACK_LONG(UINT8_T);
+  case FFIDL_SINT8:	PACK_LONG(SINT8_T);
+  case FFIDL_UINT16:	PACK_LONG(UINT16_T);
+  case FFIDL_SINT16:	PACK_LONG(SINT16_T);
+  case FFIDL_UINT32:	PACK_LONG(UINT32_T);
+  case FFIDL_SINT32:	PACK_LONG(SINT32_T);
+  case FFIDL_FLOAT:	PACK_DOUBLE(float);
+  case FFIDL_DOUBLE:	PACK_DOUBLE(double);
+#if HAVE_INT64
+  case FFIDL_UINT64:
+  case FFIDL_SINT64:
+    for (i = 0; i < n; i += 1) {
+      if (marshal_get_int64(interp, elts[i], &wtmp) == TCL_ERROR)
+	return i;
+      ((Ffidl_Int64 *)dst)[i] = wtmp;
+    }
+    return -1;
+#endif
+  default:
+    for (i = 0; i < n; i += 1) {
+      if (field_set(interp, type, dst+i*type->size, elts[i]) == TCL_ERROR)
+	return i;
+    }
+    return -1;
+  }
 }
-/* client allocation and initialization */
-static ffidl_client *client_alloc(Tcl_Interp *interp)
-{
-  ffidl_client *client;
+#undef PACK_LONG
+#undef PACK_DOUBLE
 
-  /* allocate client data structure */
-  client = (ffidl_client *)Tcl_Alloc(sizeof(ffidl_client));
+/* make n objects of the elements of an array of type at src */
+#define UNPACK(ctype, newobj)					\
+  for (i = 0; i < n; i += 1) elts[i] = newobj(((ctype *)src)[i]);	\
+  return
 
-  /* allocate hashtables for this load */
-  Tcl_InitHashTable(&client->types, TCL_STRING_KEYS);
-  Tcl_InitHashTable(&client->callouts, TCL_STRING_KEYS);
-  Tcl_InitHashTable(&client->cifs, TCL_STRING_KEYS);
-  Tcl_InitHashTable(&client->libs, TCL_STRING_KEYS);
-#if USE_CALLBACKS
-  Tcl_InitHashTable(&client->callbacks, TCL_STRING_KEYS);
-#endif
+static void unpack_array(ffidl_type *type, char *src, int n, Tcl_Obj **elts)
+{
+  int i;
 
-  /* initialize types */
-  type_define(client, "void", &ffidl_type_void);
-  type_define(client, "char", &ffidl_type_char);
-  type_define(client, "signed char", &ffidl_type_schar);
-  type_define(client, "unsigned char", &ffidl_type_uchar);
-  type_define(client, "short", &ffidl_type_sshort);
-  type_define(client, "unsigned short", &ffidl_type_ushort);
-  type_define(client, "int", &ffidl_type_sint);
-  type_define(client, "unsigned", &ffidl_type_uint);
-  type_define(client, "long", &ffidl_type_slong);
-  type_define(client, "unsigned long", &ffidl_type_ulong);
-#if HAVE_LONG_LONG
-  type_define(client, "long long", &ffidl_type_slonglong);
-  type_define(client, "unsigned long long", &ffidl_type_ulonglong);
-#endif
-  type_define(client, "float", &ffidl_type_float);
-  type_define(client, "double", &ffidl_type_double);
-#if HAVE_LONG_DOUBLE
-  type_define(client, "long double", &ffidl_type_longdouble);
-#endif
-  type_define(client, "sint8", &ffidl_type_sint8);
-  type_define(client, "uint8", &ffidl_type_uint8);
-  type_define(client, "sint16", &ffidl_type_sint16);
-  type_define(client, "uint16", &ffidl_type_uint16);
-  type_define(client, "sint32", &ffidl_type_sint32);
-  type_define(client, "uint32", &ffidl_type_uint32);
+  switch (type->typecode) {
+  case FFIDL_INT:	UNPACK(int, Tcl_NewLongObj);
+  case FFIDL_UINT8:	UNPACK(UINT8_T, Tcl_NewLongObj);
+  case FFIDL_SINT8:	UNPACK(SINT8_T, Tcl_NewLongObj);
+  case FFIDL_UINT16:	UNPACK(UINT16_T, Tcl_NewLongObj);
+  case FFIDL_SINT16:	UNPACK(SINT16_T, Tcl_NewLongObj);
+  case FFIDL_UINT32:	UNPACK(UINT32_T, Tcl_NewLongObj);
+  case FFIDL_SINT32:	UNPACK(SINT32_T, Tcl_NewLongObj);
+  case FFIDL_FLOAT:	UNPACK(float, Tcl_NewDoubleObj);
+  case FFIDL_DOUBLE:	UNPACK(double, Tcl_NewDoubleObj);
 #if HAVE_INT64
-  type_define(client, "sint64", &ffidl_type_sint64);
-  type_define(client, "uint64", &ffidl_type_uint64);
-#endif
-  type_define(client, "pointer", &ffidl_type_pointer);
-  type_define(client, "pointer-obj", &ffidl_type_pointer_obj);
-  type_define(client, "pointer-utf8", &ffidl_type_pointer_utf8);
-  type_define(client, "pointer-utf16", &ffidl_type_pointer_utf16);
-  type_define(client, "pointer-byte", &ffidl_type_pointer_byte);
-  type_define(client, "pointer-var", &ffidl_type_pointer_var);
-#if USE_CALLBACKS
-  type_define(client, "pointer-proc", &ffidl_type_pointer_proc);
+  case FFIDL_UINT64:	UNPACK(UINT64_T, Ffidl_NewInt64Obj);
+  case FFIDL_SINT64:	UNPACK(SINT64_T, Ffidl_NewInt64Obj);
 #endif
+  default:
+    for (i = 0; i < n; i += 1) elts[i] = field_get(type, src+i*type->size);
+    return;
+  }
+}
+#undef UNPACK
 
-  /* arrange for cleanup on interpreter deletion */
-  Tcl_CallWhenDeleted(interp, client_delete, (ClientData)client);
+/* check that offset keeps the elements of type aligned */
+static int pack_offset_check(Tcl_Interp *interp, ffidl_type *type, Tcl_Obj *typeObj, int offset)
+{
+  char buff[128];
 
-  /* finis */
-  return client;
+  if (type->alignment > 1 && offset % type->alignment != 0) {
+    sprintf(buff, "offset %d is not aligned for type ", offset);
+    Tcl_AppendResult(interp, buff, Tcl_GetString(typeObj), NULL);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
 }
-/*****************************************
- *
- * Functions exported as tcl commands.
- */
 
-/* usage: ::ffidl::info option ?...? */
-static int tcl_ffidl_info(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/* usage: ::ffidl::pack ?-into target ?-offset bytes?? type list */
+static int tcl_ffidl_pack(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
     command_ix,
-    option_ix,
-    minargs
+    type_ix,
+    list_ix,
+    nargs
   };
 
-  int i;
-  char *arg;
-  Tcl_HashTable *table;
-  Tcl_HashSearch search;
-  Tcl_HashEntry *entry;
-  ffidl_type *type;
-  ffidl_client *client = (ffidl_client *)clientData;
   static const char *options[] = {
-#define INFO_ALIGNOF 0
-    "alignof",
-#define INFO_CALLBACKS 1
-    "callbacks",
-#define INFO_CALLOUTS 2
-    "callouts",
-#define INFO_CANONICAL_HOST 3
-    "canonical-host",
-#define INFO_FORMAT 4
-    "format",
-#define INFO_HAVE_INT64 5
-    "have-int64",
-#define INFO_HAVE_LONG_DOUBLE 6
-    "have-long-double",
-#define INFO_HAVE_LONG_LONG 7
-    "have-long-long",
-#define INFO_INTERP 8
-    "interp",
-#define INFO_LIBRARIES 9
-    "libraries",
-#define INFO_SIGNATURES 10
-    "signatures",
-#define INFO_SIZEOF 11
-    "sizeof",
-#define INFO_TYPEDEFS 12
-    "typedefs",
-#define INFO_USE_CALLBACKS 13
-    "use-callbacks",
-#define INFO_USE_FFCALL 14
-    "use-ffcall",
-#define INFO_USE_LIBFFCALL 15
-    "use-libffcall",
-#define INFO_USE_LIBFFI 16
-    "use-libffi",
-#define INFO_USE_LIBFFI_RAW 17
-    "use-libffi-raw",
-#define INFO_NULL 18
-    "NULL",
+    "-into",
+    "-offset",
     NULL
   };
 
-  if (objc < minargs) {
-    Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
-    return TCL_ERROR;
-  }
-
-  if (Tcl_GetIndexFromObj(interp, objv[option_ix], options, "option", TCL_EXACT, &i) == TCL_ERROR)
-    return TCL_ERROR;
+  enum {
+    option_into,
+    option_offset,
+  };
 
-  switch (i) {
-  case INFO_CALLOUTS:		/* return list of callout names */
-    table = &client->callouts;
-  list_table_keys:		/* list the keys in a hash table */
-    if (objc != 2) {
-      Tcl_WrongNumArgs(interp,2,objv,"");
-      return TCL_ERROR;
-    }
-    for (entry = Tcl_FirstHashEntry(table, &search); entry != NULL; entry = Tcl_NextHashEntry(&search))
-      Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), Tcl_NewStringObj(Tcl_GetHashKey(table,entry),-1));
-    return TCL_OK;
-  case INFO_TYPEDEFS:		/* return list of typedef names */
-    table = &client->types;
-    goto list_table_keys;
-  case INFO_SIGNATURES:		/* return list of ffi signatures */
-    table = &client->cifs;
-    goto list_table_keys;
-  case INFO_LIBRARIES:		/* return list of lib names */
-    table = &client->libs;
-    goto list_table_keys;
-  case INFO_CALLBACKS:		/* return list of callback names */
-#if USE_CALLBACKS
-    table = &client->callbacks;
-    goto list_table_keys;
-#else
-    Tcl_AppendResult(interp, "callbacks are not supported in this configuration", NULL);
-    return TCL_ERROR;
-#endif
+  char buff[128], *base;
+  ffidl_client *client = (ffidl_client *)clientData;
+  ffidl_type *type;
+  Tcl_Obj **elts, *result, *into = NULL, *offsetObj = NULL;
+  int n, i, option, offset = 0, size;
 
-  case INFO_SIZEOF:		/* return sizeof type */
-  case INFO_ALIGNOF:		/* return alignof type */
-  case INFO_FORMAT:		/* return binary format of type */
-    if (objc != 3) {
-      Tcl_WrongNumArgs(interp,2,objv,"type");
+  /* options come first, in pairs */
+  while (objc > nargs && (objc - nargs) % 2 == 0) {
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0, &option) == TCL_ERROR) {
       return TCL_ERROR;
     }
-    arg = Tcl_GetString(objv[2]);
-    type = type_lookup(client, arg);
-    if (type == NULL) {
-      Tcl_AppendResult(interp, "undefined type: ", arg, NULL);
-      return TCL_ERROR;
-    }
-    if (i == INFO_SIZEOF) {
-      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->size));
-      return TCL_OK;
-    }
-    if (i == INFO_ALIGNOF) {
-      Tcl_SetObjResult(interp, Tcl_NewIntObj(type->alignment));
-      return TCL_OK;
-    }
-    if (i == INFO_FORMAT) {
-      i = 0;
-      return type_format(interp, type, &i);
-    }
-    Tcl_AppendResult(interp, "lost in ::ffidl::info?", NULL);
-    return TCL_ERROR;
-  case INFO_INTERP:
-    /* return the interp as integer */
-    if (objc != 2) {
-      Tcl_WrongNumArgs(interp,2,objv,"");
+    if (option == option_into) {
+      into = objv[2];
+    } else if (Tcl_GetIntFromObj(interp, objv[2], &offset) == TCL_ERROR) {
       return TCL_ERROR;
-    }
-    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(interp));
-    return TCL_OK;
-  case INFO_USE_FFCALL:
-  case INFO_USE_LIBFFCALL:
-#if USE_LIBFFCALL
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_USE_LIBFFI:
-#if USE_LIBFFI
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_USE_CALLBACKS:
-#if USE_CALLBACKS
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_HAVE_LONG_LONG:
-#if HAVE_LONG_LONG
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_HAVE_LONG_DOUBLE:
-#if HAVE_LONG_DOUBLE
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_USE_LIBFFI_RAW:
-#if USE_LIBFFI_RAW_API
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_HAVE_INT64:
-#if HAVE_INT64
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-#else
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-#endif
-    return TCL_OK;
-  case INFO_CANONICAL_HOST:
-    Tcl_SetObjResult(interp, Tcl_NewStringObj(CANONICAL_HOST,-1));
-    return TCL_OK;
-  case INFO_NULL:
-    Tcl_SetObjResult(interp, Ffidl_NewPointerObj(NULL));
-    return TCL_OK;
+    } else {
+      offsetObj = objv[2];
+    }
+    objc -= 2;
+    objv += 2;
   }
-  
-  /* return an error */
-  Tcl_AppendResult(interp, "missing option implementation: ", Tcl_GetString(objv[option_ix]), NULL);
-  return TCL_ERROR;
+  if (objc != nargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-into target ?-offset bytes?? type list");
+    return TCL_ERROR;
+  }
+  if (offsetObj != NULL && into == NULL) {
+    Tcl_AppendResult(interp, "-offset needs -into", NULL);
+    return TCL_ERROR;
+  }
+  type = pack_type(interp, client, objv[type_ix]);
+  if (type == NULL || pack_offset_check(interp, type, objv[type_ix], offset) == TCL_ERROR ||
+      Tcl_ListObjGetElements(interp, objv[list_ix], &n, &elts) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  if (n > INT_MAX/type->size) {
+    Tcl_AppendResult(interp, "list is too long to pack", NULL);
+    return TCL_ERROR;
+  }
+  if (into != NULL) {
+    /* write into a buffer or native memory, never a value */
+    if (into->typePtr == ffidl_bytearray_ObjType) {
+      Tcl_AppendResult(interp, "-into needs a buffer or a pointer", NULL);
+      return TCL_ERROR;
+    }
+    if (buffer_writable(interp, into) == TCL_ERROR ||
+	memory_from_obj(interp, into, 1, &base, &size) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (offset < 0 || (size >= 0 && (offset > size || n*type->size > size - offset))) {
+      Tcl_AppendResult(interp, "range out of bounds", NULL);
+      return TCL_ERROR;
+    }
+    result = into;
+    base += offset;
+  } else {
+    result = Tcl_NewByteArrayObj(NULL, 0);
+    base = (char *)Tcl_SetByteArrayLength(result, n*type->size);
+    memset(base, 0, n*type->size);
+  }
+  Tcl_IncrRefCount(result);
+  i = pack_array(interp, type, elts, n, base);
+  if (i >= 0) {
+    sprintf(buff, ", packing element %d", i);
+    Tcl_AppendResult(interp, buff, NULL);
+    Tcl_DecrRefCount(result);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, result);
+  Tcl_DecrRefCount(result);
+  return TCL_OK;
 }
 
-/* usage: ffidl-typedef name type1 ?type2 ...? */
-static int tcl_ffidl_typedef(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/* usage: ::ffidl::unpack ?-offset bytes? ?-pointer? type data ?count? */
+static int tcl_ffidl_unpack(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
     command_ix,
-    name_ix,
     type_ix,
-    minargs
+    data_ix,
+    count_ix,
+    minargs = count_ix,
+    maxargs
   };
 
-  char *tname1, *tname2;
-  ffidl_type *newtype, *ttype2;
-  int nelts, i;
   ffidl_client *client = (ffidl_client *)clientData;
+  ffidl_type *type;
+  Tcl_Obj **elts;
+  char *base;
+  int size, count, offset = 0, pointer = 0;
 
-  /* check number of args */
-  if (objc < minargs) {
-    Tcl_WrongNumArgs(interp,1,objv,"name type ?...?");
+  if (objc > 2 && strcmp(Tcl_GetString(objv[1]), "-offset") == 0) {
+    if (Tcl_GetIntFromObj(interp, objv[2], &offset) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    objc -= 2;
+    objv += 2;
+  }
+  if (objc > minargs && strcmp(Tcl_GetString(objv[1]), "-pointer") == 0) {
+    pointer = 1;
+    objc -= 1;
+    objv += 1;
+  }
+  if (objc < minargs || objc > maxargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-offset bytes? ?-pointer? type data ?count?");
     return TCL_ERROR;
   }
-  /* fetch new type name, verify that it is new */
-  tname1 = Tcl_GetString(objv[name_ix]);
-  if (type_lookup(client, tname1) != NULL) {
-    Tcl_AppendResult(interp, "type is already defined: ", tname1, NULL);
+  type = pack_type(interp, client, objv[type_ix]);
+  if (type == NULL || pack_offset_check(interp, type, objv[type_ix], offset) == TCL_ERROR ||
+      memory_from_obj(interp, objv[data_ix], pointer, &base, &size) == TCL_ERROR) {
     return TCL_ERROR;
   }
-  nelts = objc - 2;
-  if (nelts == 1) {
-    /* define tname1 as an alias for tname2 */
-    tname2 = Tcl_GetString(objv[type_ix]);
-    ttype2 = type_lookup(client, tname2);
-    if (ttype2 == NULL) {
-      Tcl_AppendResult(interp, "undefined type: ", tname2, NULL);
+  if (offset < 0 || (size >= 0 && offset > size)) {
+    Tcl_AppendResult(interp, "range out of bounds", NULL);
+    return TCL_ERROR;
+  }
+  base += offset;
+  if (size >= 0) {
+    size -= offset;
+  }
+  if (objc == maxargs) {
+    if (Tcl_GetIntFromObj(interp, objv[count_ix], &count) == TCL_ERROR) {
       return TCL_ERROR;
     }
-    /* define alias */
-    type_define(client, tname1, ttype2);
-    type_inc_ref(ttype2);
-  } else {
-    /* allocate an aggregate type */
-    newtype = type_alloc(client, nelts);
-    if (newtype == NULL) {
-      Tcl_AppendResult(interp, "couldn't allocate the ffi_type", NULL);
+    if (count < 0 || (size >= 0 && count > size/type->size)) {
+      Tcl_AppendResult(interp, "range out of bounds", NULL);
       return TCL_ERROR;
     }
-    /* parse aggregate types */
-    newtype->size = 0;
-    newtype->alignment = 0;
-    for (i = 0; i < nelts; i += 1) {
-      tname2 = Tcl_GetString(objv[type_ix+i]);
-      ttype2 = type_lookup(client, tname2);
-      if (ttype2 == NULL) {
-	type_free(newtype);
-	Tcl_AppendResult(interp, "undefined element type: ", tname2, NULL);
-	return TCL_ERROR;
-      }
-      if ((ttype2->class & FFIDL_ELT) == 0) {
-	type_free(newtype);
-	Tcl_AppendResult(interp, "type ", tname2, " is not permitted in element context", NULL);
-	return TCL_ERROR;
-      }
-      newtype->elements[i] = ttype2;
-      /* accumulate the aggregate size and alignment */
-      /* align current size to element's alignment */
-      if ((ttype2->alignment-1) & newtype->size) {
-	newtype->size = ((newtype->size-1) | (ttype2->alignment-1)) + 1;
-      }
-      /* add the element's size */
-      newtype->size += ttype2->size;
-      /* bump the aggregate alignment as required */
-      if (ttype2->alignment > newtype->alignment) {
-	newtype->alignment = ttype2->alignment;
-      }
+  } else if (size < 0) {
+    Tcl_AppendResult(interp, "count is required to unpack from a pointer", NULL);
+    return TCL_ERROR;
+  } else {
+    count = size/type->size;
+  }
+  if ((size_t)count > (INT_MAX-1)/sizeof(Tcl_Obj *)) {
+    Tcl_AppendResult(interp, "too many elements to unpack", NULL);
+    return TCL_ERROR;
+  }
+  /* the list takes the element objects as they are */
+  elts = (Tcl_Obj **)Tcl_Alloc(count*sizeof(Tcl_Obj *)+1);
+  unpack_array(type, base, count, elts);
+  Tcl_SetObjResult(interp, Tcl_NewListObj(count, elts));
+  Tcl_Free((char *)elts);
+  return TCL_OK;
+}
+
+/*
+ * Find an unshared object to receive a scalar result: the interp's
+ * result if nothing else holds it, else a recycled one only the client
+ * still holds.  Returns NULL if there is none.
+ */
+static Tcl_Obj *callout_result_obj(Tcl_Interp *interp, ffidl_client *client)
+{
+  Tcl_Obj *result = Tcl_GetObjResult(interp);
+  size_t i;
+
+  if ( ! Tcl_IsShared(result)) {
+    return result;
+  }
+  for (i = 0; i < FFIDL_RESULT_CACHE; i += 1) {
+    Tcl_Obj *obj = client->results[i];
+    if (obj == NULL) {
+      continue;
     }
-    newtype->size = ((newtype->size-1) | (newtype->alignment-1)) + 1; /* tail padding as in libffi */
-    if (type_prep(newtype) != TCL_OK) {
-      type_free(newtype);
-      Tcl_AppendResult(interp, "type definition error", NULL);
-      return TCL_ERROR;
+    if (obj == result && obj->refCount == 2) {
+      /* held by the interp and the client only */
+      Tcl_ResetResult(interp);
+    }
+    if (obj->refCount == 1) {
+      return obj;
     }
-    /* define new type */
-    type_define(client, tname1, newtype);
-    type_inc_ref(newtype);
   }
-  /* return success */
+  return NULL;
+}
+/* recycle a newly made scalar result */
+static void callout_result_keep(ffidl_client *client, Tcl_Obj *obj)
+{
+  Tcl_Obj **slot = &client->results[client->nextresult];
+
+  Tcl_IncrRefCount(obj);
+  if (*slot != NULL) {
+    Tcl_DecrRefCount(*slot);
+  }
+  *slot = obj;
+  client->nextresult = (client->nextresult+1) % FFIDL_RESULT_CACHE;
+}
+
+/*
+ * Store a struct result into the callout's -retvar variable, writing
+ * over the variable's bytearray when nothing else holds it.
+ */
+static int callout_store_retvar(Tcl_Interp *interp, ffidl_callout *callout, void *ret)
+{
+  int size = callout->cif->rtype->size;
+  Tcl_Obj *obj = Tcl_ObjGetVar2(interp, callout->retvar, NULL, 0);
+
+  if (obj == NULL || Tcl_IsShared(obj)) {
+    obj = Tcl_NewByteArrayObj(ret, size);
+  } else {
+    memcpy(Tcl_SetByteArrayLength(obj, size), ret, size);
+  }
+  /* set it even if unchanged, so that write traces fire */
+  if (Tcl_ObjSetVar2(interp, callout->retvar, NULL, obj, TCL_LEAVE_ERR_MSG) == NULL) {
+    return TCL_ERROR;
+  }
   return TCL_OK;
 }
 
+/*
+ * Convert the arguments in argv into frame, call the callout's function,
+ * and convert its return value into *objPtr, NULL for void.  If reuse
+ * is set, a scalar result may be written into a recycled object.
+ */
+static int callout_invoke(Tcl_Interp *interp, ffidl_callout *callout, Tcl_Obj *CONST argv[],
+			  ffidl_value *frame, int reuse, Tcl_Obj **objPtr)
+{
+  ffidl_cif *cif = callout->cif;
+  ffidl_value *values = frame+callout->retsize;
+  void *ret = callout->retsize ? (void *)frame : NULL;
+  void **args = (void **)(values+callout->valuesize);
+  ffidl_extstring **held = (ffidl_extstring **)(args+cif->argc);
+  int i, code = TCL_OK;
+
+  if (callout->holds) {
+    memset(held, 0, cif->argc*sizeof(ffidl_extstring *));
+  }
+  /* fetch and convert argument values */
+  for (i = 0; i < cif->argc; i += 1) {
+    args[i] = (void *)((char *)values+callout->offsets[i]);
+    if (callout->marshal[i](interp, callout, i, argv[i], &args[i]) == TCL_ERROR) {
+      code = TCL_ERROR;
+      break;
+    }
+  }
+  /* call */
+  if (code == TCL_OK) {
+    if (callout->stub != NULL) {
+      callout->stub(callout->fn, ret, args);
+    } else {
+      callout_call(callout, ret, args);
+    }
+  }
+  /* convert return value, which may point into a passed string */
+  if (code == TCL_ERROR) {
+    /* nothing to convert */
+  } else if (callout->retvar != NULL) {
+    *objPtr = NULL;
+    code = callout_store_retvar(interp, callout, ret);
+  } else if (reuse && callout->scalar) {
+    Tcl_Obj *obj = callout_result_obj(interp, callout->client);
+    *objPtr = callout->unmarshal(callout, ret, obj);
+    if (obj == NULL) {
+      callout_result_keep(callout->client, *objPtr);
+    }
+  } else {
+    *objPtr = callout->unmarshal(callout, ret, NULL);
+  }
+  /* then let go of the external strings passed */
+  if (callout->holds) {
+    for (i = 0; i < cif->argc; i += 1) {
+      if (held[i] != NULL) {
+	extstring_release(held[i]);
+      }
+    }
+  }
+  return code;
+}
+
 /* usage: depends on the signature defining the ffidl-callout */
 static int tcl_ffidl_call(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
@@ -2951,251 +6925,415 @@ static int tcl_ffidl_call(ClientData clientData, Tcl_Interp *interp, int objc, T
 
   ffidl_callout *callout = (ffidl_callout *)clientData;
   ffidl_cif *cif = callout->cif;
-  int i, itmp;
-  long ltmp;
-  double dtmp;
-#if HAVE_INT64
-  Ffidl_Int64 wtmp;
-#endif
-  Tcl_Obj *obj = NULL;
-  char buff[128];
+  int code;
+  Tcl_Obj *obj;
+  ffidl_value stackframe[FFIDL_FRAME_STACK_VALUES];
+  ffidl_value *frame;
 
   /* usage check */
   if (objc-args_ix != cif->argc) {
     Tcl_WrongNumArgs(interp, 1, objv, callout->usage);
     return TCL_ERROR;
   }
-  /* fetch and convert argument values */
-  for (i = 0; i < cif->argc; i += 1) {
-    /* fetch object */
-    obj = objv[args_ix+i];
-    /* fetch value from object and store value into arg value array */
-    if (cif->atypes[i]->class & FFIDL_GETINT) {
-      if (obj->typePtr == ffidl_double_ObjType) {
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
-	  goto cleanup;
-	ltmp = (long)dtmp;
-	if (dtmp != ltmp)
-	  if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR)
-	    goto cleanup;
-      } else if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR)
-	goto cleanup;
-#if HAVE_INT64
-    } else if (cif->atypes[i]->class & FFIDL_GETWIDEINT) {
-      if (obj->typePtr == ffidl_double_ObjType) {
-	if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
-	  goto cleanup;
-	wtmp = (Ffidl_Int64)dtmp;
-	if (dtmp != wtmp) {
-	  if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	    goto cleanup;
-	  }
-	}
-      } else if (Ffidl_GetInt64FromObj(interp, obj, &wtmp) == TCL_ERROR) {
-	goto cleanup;
-      }
-#endif
-    } else if (cif->atypes[i]->class & FFIDL_GETDOUBLE) {
-      if (obj->typePtr == ffidl_int_ObjType) {
-	if (Tcl_GetLongFromObj(interp, obj, &ltmp) == TCL_ERROR)
-	  goto cleanup;
-	dtmp = (double)ltmp;
-	if (dtmp != ltmp)
-	  if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
-	    goto cleanup;
-#if HAVE_WIDE_INT
-      } else if (obj->typePtr == ffidl_wideInt_ObjType) {
-	if (Tcl_GetWideIntFromObj(interp, obj, &wtmp) == TCL_ERROR)
-	  goto cleanup;
-	dtmp = (double)wtmp;
-	if (dtmp != wtmp)
-	  if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
-	    goto cleanup;
+  /* take a frame for this invocation */
+  if (callout->framesize <= FFIDL_FRAME_STACK_VALUES) {
+    frame = stackframe;
+  } else {
+    frame = callout_frame_alloc(callout->client, callout->framesize);
+  }
+  code = callout_invoke(interp, callout, objv+args_ix, frame, 1, &obj);
+  if (code == TCL_OK && obj != NULL && obj != Tcl_GetObjResult(interp)) {
+    Tcl_SetObjResult(interp, obj);
+  }
+  if (frame != stackframe) {
+    callout_frame_free(callout->client, callout->framesize);
+  }
+  return code;
+}
+
+/* usage: ::ffidl::map callout argLists -> results */
+static int tcl_ffidl_map(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    callout_ix,
+    lists_ix,
+    minargs
+  };
+
+  ffidl_callout *callout;
+  Tcl_Obj *lists, *tuple, *obj, *results;
+  Tcl_Obj **argv;
+  int n, k, argc, code = TCL_OK;
+  char buff[128];
+  ffidl_value stackframe[FFIDL_FRAME_STACK_VALUES];
+  ffidl_value *frame;
+
+  /* usage check */
+  if (objc != minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "callout argLists");
+    return TCL_ERROR;
+  }
+  callout = callout_command(interp, objv[callout_ix]);
+  if (callout == NULL) {
+    return TCL_ERROR;
+  }
+  lists = objv[lists_ix];
+  if (Tcl_ListObjLength(interp, lists, &n) == TCL_ERROR) {
+    return TCL_ERROR;
+  }
+  /* one frame serves all the tuples */
+  if (callout->framesize <= FFIDL_FRAME_STACK_VALUES) {
+    frame = stackframe;
+  } else {
+    frame = callout_frame_alloc(callout->client, callout->framesize);
+  }
+  Tcl_IncrRefCount(lists);
+  results = Tcl_NewListObj(0, NULL);
+  for (k = 0; k < n; k += 1) {
+    /* refetch, argument conversion may run scripts */
+    if (Tcl_ListObjIndex(interp, lists, k, &tuple) == TCL_ERROR || tuple == NULL) {
+      code = TCL_ERROR;
+      break;
+    }
+    Tcl_IncrRefCount(tuple);
+    if (Tcl_ListObjGetElements(interp, tuple, &argc, &argv) == TCL_ERROR) {
+      code = TCL_ERROR;
+    } else if (argc != callout->cif->argc) {
+      Tcl_AppendResult(interp, "wrong # args: should be \"", Tcl_GetString(objv[callout_ix]),
+		       argc ? " " : "", callout->usage, "\"", NULL);
+      code = TCL_ERROR;
+    } else {
+      code = callout_invoke(interp, callout, argv, frame, 0, &obj);
+    }
+    Tcl_DecrRefCount(tuple);
+    if (code == TCL_ERROR) {
+      sprintf(buff, "\n    (argument list %d)", k);
+      Tcl_AddErrorInfo(interp, buff);
+      break;
+    }
+    Tcl_ListObjAppendElement(interp, results, obj != NULL ? obj : Tcl_NewObj());
+  }
+  Tcl_DecrRefCount(lists);
+  if (frame != stackframe) {
+    callout_frame_free(callout->client, callout->framesize);
+  }
+  if (code == TCL_ERROR) {
+    Tcl_DecrRefCount(results);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, results);
+  return TCL_OK;
+}
+
+/* usage: ::ffidl::apply ?-threads n? ?--? callout inBytes ?inBytes2? -> outBytes */
+static int tcl_ffidl_apply(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    callout_ix,
+    in_ix,
+    minargs = in_ix + 1,
+    maxargs = in_ix + FFIDL_APPLY_MAX_ARGS,
+  };
+
+  static const char *options[] = {
+    "-threads",
+    "--",
+    NULL,
+  };
+
+  enum {
+    option_threads,
+    option_break,
+  };
+
+  ffidl_callout *callout;
+  ffidl_cif *cif;
+  ffidl_apply_job *jobs;
+  Tcl_Obj *outObj;
+  unsigned char *in[FFIDL_APPLY_MAX_ARGS], *out;
+  int i, j, n = 0, len, option, nopts, nthreads = 1;
+  char buff[128];
+#if TCL_THREADS
+  Tcl_ThreadId *ids;
+  int *started, pending;
+#endif
+
+  /* fetch options */
+  for (i = 1; i < objc; i += 1) {
+    if (Tcl_GetString(objv[i])[0] != '-') {
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &option) != TCL_OK) {
+      /* No options. */
+      Tcl_ResetResult(interp);
+      break;
+    }
+    if (option == option_break) {
+      /* End of options. */
+      i++;
+      break;
+    }
+    switch (option) {
+    case option_threads:
+      if (++i == objc) {
+	Tcl_AppendResult(interp, "missing value for -threads", NULL);
+	return TCL_ERROR;
+      }
+      if (Tcl_GetIntFromObj(interp, objv[i], &nthreads) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (nthreads < 1) {
+	Tcl_AppendResult(interp, "-threads must be at least 1", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+  }
+  nopts = i - 1;
+  objc -= nopts;
+  /* usage check */
+  if (objc < minargs || objc > maxargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-threads n? ?--? callout inBytes ?inBytes2?");
+    return TCL_ERROR;
+  }
+  objv += nopts;
+  /* fetch and check the callout */
+  callout = callout_command(interp, objv[callout_ix]);
+  if (callout == NULL) {
+    return TCL_ERROR;
+  }
+  cif = callout->cif;
+  if (cif->argc != objc - in_ix) {
+    sprintf(buff, "callout takes %d arguments, %d arrays given", cif->argc, objc - in_ix);
+    Tcl_AppendResult(interp, buff, NULL);
+    return TCL_ERROR;
+  }
+  for (j = 0; j < cif->argc; j += 1) {
+    if ( ! apply_type_numeric(cif->atypes[j])) {
+      Tcl_AppendResult(interp, "callout \"", Tcl_GetString(objv[callout_ix]),
+		       "\" has non-numeric arguments", NULL);
+      return TCL_ERROR;
+    }
+  }
+  if ( ! apply_type_numeric(cif->rtype)) {
+    Tcl_AppendResult(interp, "callout \"", Tcl_GetString(objv[callout_ix]),
+		     "\" has a non-numeric return type", NULL);
+    return TCL_ERROR;
+  }
+  /* fetch the arrays */
+  for (j = 0; j < FFIDL_APPLY_MAX_ARGS; j += 1) {
+    in[j] = NULL;
+  }
+  for (j = 0; j < cif->argc; j += 1) {
+    in[j] = Tcl_GetByteArrayFromObj(objv[in_ix+j], &len);
+    if (len % cif->atypes[j]->size != 0) {
+      sprintf(buff, "array %d does not hold a whole number of elements", j+1);
+      Tcl_AppendResult(interp, buff, NULL);
+      return TCL_ERROR;
+    }
+    if (j > 0 && len / cif->atypes[j]->size != n) {
+      Tcl_AppendResult(interp, "arrays differ in length", NULL);
+      return TCL_ERROR;
+    }
+    n = len / cif->atypes[j]->size;
+  }
+  outObj = Tcl_NewByteArrayObj(NULL, 0);
+  out = Tcl_SetByteArrayLength(outObj, n*cif->rtype->size);
+  /* split the work */
+  if (nthreads > n / FFIDL_APPLY_THREAD_MIN) {
+    nthreads = n / FFIDL_APPLY_THREAD_MIN;
+  }
+#if TCL_THREADS
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+#else
+  nthreads = 1;
+#endif
+  jobs = (ffidl_apply_job *)Tcl_Alloc(nthreads*sizeof(ffidl_apply_job));
+  for (i = 0; i < nthreads; i += 1) {
+    int first = (int)((Tcl_WideInt)n*i/nthreads);
+    int last = (int)((Tcl_WideInt)n*(i+1)/nthreads);
+    jobs[i].callout = callout;
+    jobs[i].n = last - first;
+    for (j = 0; j < FFIDL_APPLY_MAX_ARGS; j += 1) {
+      jobs[i].in[j] = in[j] ? in[j]+first*cif->atypes[j]->size : NULL;
+    }
+    jobs[i].out = out+first*cif->rtype->size;
+#if TCL_THREADS
+    jobs[i].pending = &pending;
+#endif
+  }
+#if TCL_THREADS
+  /* this thread runs the last job */
+  ids = (Tcl_ThreadId *)Tcl_Alloc(nthreads*sizeof(Tcl_ThreadId));
+  started = (int *)Tcl_Alloc(nthreads*sizeof(int));
+  pending = nthreads-1;
+  for (i = 0; i < nthreads-1; i += 1) {
+    started[i] = Tcl_CreateThread(&ids[i], apply_thread, (ClientData)&jobs[i],
+				  TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK;
+    if ( ! started[i]) {
+      apply_work(&jobs[i]);
+    }
+  }
+  apply_run(&jobs[nthreads-1]);
+#if USE_CALLBACKS
+  /* workers calling script callbacks wait for this thread */
+  callback_service_while(&pending);
 #endif
-      } else if (Tcl_GetDoubleFromObj(interp, obj, &dtmp) == TCL_ERROR)
-	goto cleanup;
+  for (i = 0; i < nthreads-1; i += 1) {
+    if (started[i]) {
+      int result;
+      Tcl_JoinThread(ids[i], &result);
     }
-    switch (cif->atypes[i]->typecode) {
-    case FFIDL_INT:
-      *(int *)callout->args[i] = (int)ltmp;
-      continue;
-    case FFIDL_FLOAT:
-      *(float *)callout->args[i] = (float)dtmp;
-      continue;
-    case FFIDL_DOUBLE:
-      *(double *)callout->args[i] = (double)dtmp;
-      continue;
-#if HAVE_LONG_DOUBLE
-    case FFIDL_LONGDOUBLE:
-      *(long double *)callout->args[i] = (long double)dtmp;
-      continue;
+  }
+  Tcl_Free((void *)started);
+  Tcl_Free((void *)ids);
+#else
+  apply_run(&jobs[0]);
 #endif
-    case FFIDL_UINT8:
-      *(UINT8_T *)callout->args[i] = (UINT8_T)ltmp;
-      continue;
-    case FFIDL_SINT8:
-      *(SINT8_T *)callout->args[i] = (SINT8_T)ltmp;
-      continue;
-    case FFIDL_UINT16:
-      *(UINT16_T *)callout->args[i] = (UINT16_T)ltmp;
-      continue;
-    case FFIDL_SINT16:
-      *(SINT16_T *)callout->args[i] = (SINT16_T)ltmp;
-      continue;
-    case FFIDL_UINT32:
-      *(UINT32_T *)callout->args[i] = (UINT32_T)ltmp;
-      continue;
-    case FFIDL_SINT32:
-      *(SINT32_T *)callout->args[i] = (SINT32_T)ltmp;
-      continue;
-#if HAVE_INT64
-    case FFIDL_UINT64:
-      *(UINT64_T *)callout->args[i] = (UINT64_T)wtmp;
-      continue;
-    case FFIDL_SINT64:
-      *(SINT64_T *)callout->args[i] = (SINT64_T)wtmp;
-      continue;
+  Tcl_Free((void *)jobs);
+  Tcl_SetObjResult(interp, outObj);
+  return TCL_OK;
+}
+
+/*
+ * Parse the leading options of ffidl-callout and ffidl-callback,
+ * return the number of words consumed or -1 on error.  retvarp and
+ * asyncp are NULL where -retvar and the callback options do not apply.
+ * A -queue size is rounded up to a power of two.
+ */
+static int binding_options(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], int *rawp, Tcl_Obj **retvarp,
+			   int *asyncp, int *queuep, int *overflowp)
+{
+  static const char *options[] = {
+    "-raw",
+    "-retvar",
+    "-async",
+    "-queue",
+    "-overflow",
+    "--",
+    NULL,
+  };
+
+  enum {
+    option_raw,
+    option_retvar,
+    option_async,
+    option_queue,
+    option_overflow,
+    option_break,
+  };
+
+  static const char *policies[] = {
+    "block",
+    "drop-oldest",
+    "count-drops",
+    NULL,
+  };
+
+  int i, option, size;
+
+#if USE_LIBFFI_RAW_API
+  *rawp = FFIDL_RAW_API_DEFAULT;
+#else
+  *rawp = 0;
 #endif
-    case FFIDL_STRUCT:
-      if (obj->typePtr != ffidl_bytearray_ObjType) {
-	sprintf(buff, "parameter %d must be a binary string", i);
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
+  if (retvarp != NULL) {
+    *retvarp = NULL;
+  }
+  if (asyncp != NULL) {
+    *asyncp = 0;
+    *queuep = 0;
+    *overflowp = -1;
+  }
+  for (i = 1; i < objc; i += 1) {
+    if (Tcl_GetString(objv[i])[0] != '-') {
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &option) != TCL_OK) {
+      /* No options. */
+      Tcl_ResetResult(interp);
+      break;
+    }
+    if (option == option_break) {
+      /* End of options. */
+      i++;
+      break;
+    }
+    switch (option) {
+    case option_raw:
+      if (++i == objc) {
+	Tcl_AppendResult(interp, "missing value for -raw", NULL);
+	return -1;
       }
-      callout->args[i] = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
-      if (itmp != cif->atypes[i]->size) {
-	sprintf(buff, "parameter %d is the wrong size, %u bytes instead of %lu.", i, itmp, (long)(cif->atypes[i]->size));
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
+      if (Tcl_GetBooleanFromObj(interp, objv[i], rawp) != TCL_OK) {
+	return -1;
       }
-      continue;
-    case FFIDL_PTR:
-#if FFIDL_POINTER_IS_LONG
-      *(void **)callout->args[i] = (void *)ltmp;
-#else
-      *(void **)callout->args[i] = (void *)wtmp;
-#endif
-      continue;
-    case FFIDL_PTR_OBJ:
-      *(void **)callout->args[i] = (void *)obj;
-      continue;
-    case FFIDL_PTR_UTF8:
-      *(void **)callout->args[i] = (void *)Tcl_GetString(obj);
-      continue;
-    case FFIDL_PTR_UTF16:
-      *(void **)callout->args[i] = (void *)Tcl_GetUnicode(obj);
-      continue;
-    case FFIDL_PTR_BYTE:
-      if (obj->typePtr != ffidl_bytearray_ObjType) {
-	sprintf(buff, "parameter %d must be a binary string", i);
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
+      break;
+    case option_retvar:
+      if (retvarp == NULL) {
+	Tcl_AppendResult(interp, "-retvar only applies to callouts", NULL);
+	return -1;
       }
-      *(void **)callout->args[i] = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
-      continue;
-    case FFIDL_PTR_VAR:
-      obj = Tcl_ObjGetVar2(interp, objv[args_ix+i], NULL, TCL_LEAVE_ERR_MSG);
-      if (obj == NULL) return TCL_ERROR;
-      if (obj->typePtr != ffidl_bytearray_ObjType) {
-	sprintf(buff, "parameter %d must be a binary string", i);
-	Tcl_AppendResult(interp, buff, NULL);
-	goto cleanup;
+      if (++i == objc) {
+	Tcl_AppendResult(interp, "missing value for -retvar", NULL);
+	return -1;
       }
-      if (Tcl_IsShared(obj)) {
-	obj = Tcl_ObjSetVar2(interp, objv[args_ix+i], NULL, Tcl_DuplicateObj(obj), TCL_LEAVE_ERR_MSG);
-	if (obj == NULL) {
-	  goto cleanup;
-	}
+      *retvarp = objv[i];
+      break;
+    case option_async:
+      if (asyncp == NULL) {
+	Tcl_AppendResult(interp, "-async only applies to callbacks", NULL);
+	return -1;
       }
-      *(void **)callout->args[i] = (void *)Tcl_GetByteArrayFromObj(obj, &itmp);
-      /* printf("pointer-var -> %d\n", cif->avalues[i].v_pointer); */
-      Tcl_InvalidateStringRep(obj);
-      continue;
-#if USE_CALLBACKS
-    case FFIDL_PTR_PROC: {
-      ffidl_callback *callback;
-      ffidl_closure *closure;
-      Tcl_DString ds;
-      char *name = Tcl_GetString(objv[args_ix+i]);
-      Tcl_DStringInit(&ds);
-      if (!strstr(name, "::")) {
-        Tcl_Namespace *ns;
-        ns = Tcl_GetCurrentNamespace(interp);
-        if (ns != Tcl_GetGlobalNamespace(interp)) {
-          Tcl_DStringAppend(&ds, ns->fullName, -1);
-        }
-        Tcl_DStringAppend(&ds, "::", 2);
-        Tcl_DStringAppend(&ds, name, -1);
-        name = Tcl_DStringValue(&ds);
-      }
-      callback = callback_lookup(callout->client, name);
-      Tcl_DStringFree(&ds);
-      if (callback == NULL) {
-	Tcl_AppendResult(interp, "no callback named \"", Tcl_GetString(objv[args_ix+i]), "\" is defined", NULL);
-	goto cleanup;
+      if (++i == objc) {
+	Tcl_AppendResult(interp, "missing value for -async", NULL);
+	return -1;
       }
-      closure = &(callback->closure);
-#if USE_LIBFFI
-      *(void **)callout->args[i] = (void *)closure->executable;
-#elif USE_LIBFFCALL
-      *(void **)callout->args[i] = (void *)closure->lib_closure;
-#endif
-    }
-    continue;
-#endif
-    default:
-      sprintf(buff, "unknown type for argument: %d", cif->atypes[i]->typecode);
-      Tcl_AppendResult(interp, buff, NULL);
-      goto cleanup;
+      if (Tcl_GetBooleanFromObj(interp, objv[i], asyncp) != TCL_OK) {
+	return -1;
+      }
+      break;
+    case option_queue:
+      if (asyncp == NULL) {
+	Tcl_AppendResult(interp, "-queue only applies to callbacks", NULL);
+	return -1;
+      }
+      if (++i == objc) {
+	Tcl_AppendResult(interp, "missing value for -queue", NULL);
+	return -1;
+      }
+      if (Tcl_GetIntFromObj(interp, objv[i], &size) != TCL_OK) {
+	return -1;
+      }
+      if (size < 1 || size > (1<<24)) {
+	Tcl_AppendResult(interp, "queue size must be from 1 to 16777216", NULL);
+	return -1;
+      }
+      for (*queuep = 2; *queuep < size; *queuep *= 2);
+      break;
+    case option_overflow:
+      if (asyncp == NULL) {
+	Tcl_AppendResult(interp, "-overflow only applies to callbacks", NULL);
+	return -1;
+      }
+      if (++i == objc) {
+	Tcl_AppendResult(interp, "missing value for -overflow", NULL);
+	return -1;
+      }
+      if (Tcl_GetIndexFromObj(interp, objv[i], policies, "overflow policy", 0, overflowp) != TCL_OK) {
+	return -1;
+      }
+      break;
     }
-    /* Note: change "continue" to "break" if further work must be done here. */
   }
-  /* prepare for structure return */
-  if (cif->rtype->typecode == FFIDL_STRUCT) {
-    obj = Tcl_NewByteArrayObj(NULL, 0);
-    Tcl_SetByteArrayLength(obj, cif->rtype->size);
-    Tcl_IncrRefCount(obj);
-    callout->ret = Tcl_GetByteArrayFromObj(obj, &itmp);
-  }
-  /* call */
-  callout_call(callout);
-  /* convert return value */
-  switch (cif->rtype->typecode) {
-  case FFIDL_VOID:	break;
-  case FFIDL_INT:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(INT, callout->ret))); break;
-  case FFIDL_FLOAT:	Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double)FFIDL_RVALUE_PEEK_UNWIDEN(FLOAT, callout->ret))); break;
-  case FFIDL_DOUBLE:	Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double)FFIDL_RVALUE_PEEK_UNWIDEN(DOUBLE, callout->ret))); break;
-#if HAVE_LONG_DOUBLE
-  case FFIDL_LONGDOUBLE:Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double)FFIDL_RVALUE_PEEK_UNWIDEN(LONGDOUBLE, callout->ret))); break;
-#endif
-  case FFIDL_UINT8:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(UINT8, callout->ret))); break;
-  case FFIDL_SINT8:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(SINT8, callout->ret))); break;
-  case FFIDL_UINT16:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(UINT16, callout->ret))); break;
-  case FFIDL_SINT16:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(SINT16, callout->ret))); break;
-  case FFIDL_UINT32:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(UINT32, callout->ret))); break;
-  case FFIDL_SINT32:	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)FFIDL_RVALUE_PEEK_UNWIDEN(SINT32, callout->ret))); break;
-#if HAVE_INT64
-  case FFIDL_UINT64:	Tcl_SetObjResult(interp, Ffidl_NewInt64Obj((Ffidl_Int64)FFIDL_RVALUE_PEEK_UNWIDEN(UINT64, callout->ret))); break;
-  case FFIDL_SINT64:	Tcl_SetObjResult(interp, Ffidl_NewInt64Obj((Ffidl_Int64)FFIDL_RVALUE_PEEK_UNWIDEN(SINT64, callout->ret))); break;
-#endif
-  case FFIDL_STRUCT:	Tcl_SetObjResult(interp, obj); Tcl_DecrRefCount(obj); break;
-  case FFIDL_PTR:	Tcl_SetObjResult(interp, Ffidl_NewPointerObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret))); break;
-  case FFIDL_PTR_OBJ:	Tcl_SetObjResult(interp, (Tcl_Obj *)FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret)); break;
-  case FFIDL_PTR_UTF8:	Tcl_SetObjResult(interp, Tcl_NewStringObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret), -1)); break;
-  case FFIDL_PTR_UTF16:	Tcl_SetObjResult(interp, Tcl_NewUnicodeObj(FFIDL_RVALUE_PEEK_UNWIDEN(PTR, callout->ret), -1)); break;
-  default:
-    sprintf(buff, "Invalid return type: %d", cif->rtype->typecode);
-    Tcl_AppendResult(interp, buff, NULL);
-    goto cleanup;
-  }    
-  /* done */
-  return TCL_OK;
-  /* blew it */
- cleanup:
-  return TCL_ERROR;
+  return i - 1;
 }
 
-/* usage: ffidl-callout name {?argument_type ...?} return_type address ?protocol? */
+/* usage: ffidl-callout ?-raw boolean? ?-retvar varName? ?--? name {?argument_type ...?} return_type address ?protocol? */
 static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
@@ -3216,15 +7354,24 @@ static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc
   Tcl_DString usage, ds;
   Tcl_Command res;
   ffidl_cif *cif = NULL;
-  ffidl_callout *callout;
+  ffidl_callout *callout = NULL;
   ffidl_client *client = (ffidl_client *)clientData;
-  int has_protocol = objc - 1 >= protocol_ix;
+  int has_protocol, raw, nopts;
+  Tcl_Obj *retvar;
 
+  /* fetch options */
+  nopts = binding_options(interp, objc, objv, &raw, &retvar, NULL, NULL, NULL);
+  if (nopts < 0) {
+    return TCL_ERROR;
+  }
+  objc -= nopts;
   /* usage check */
   if (objc != minargs && objc != maxargs) {
-    Tcl_WrongNumArgs(interp, 1, objv, "name {?argument_type ...?} return_type address ?protocol?");
+    Tcl_WrongNumArgs(interp, 1, objv, "?-raw boolean? ?-retvar varName? ?--? name {?argument_type ...?} return_type address ?protocol?");
     return TCL_ERROR;
   }
+  objv += nopts;
+  has_protocol = objc - 1 >= protocol_ix;
   Tcl_DStringInit(&ds);
   Tcl_DStringInit(&usage);
   /* fetch name */
@@ -3247,28 +7394,31 @@ static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc
 		&cif) == TCL_ERROR) {
     goto error;
   }
+  if (retvar != NULL && cif->rtype->typecode != FFIDL_STRUCT) {
+    Tcl_AppendResult(interp, "-retvar requires a struct return type", NULL);
+    goto error;
+  }
   /* fetch function pointer */
   if (Ffidl_GetPointerFromObj(interp, objv[address_ix], (void **)&fn) == TCL_ERROR) {
     goto error;
   }
   /* if callout is already defined, redefine it */
-  if ((callout = callout_lookup(client, name))) {
+  if (callout_lookup(client, name)) {
     Tcl_DeleteCommand(interp, name);
   }
   /* build the usage string */
-  Tcl_ListObjGetElements(interp, objv[args_ix], &argc, &argv);
+  cif_args(interp, objv[args_ix], &argc, &argv);
   for (i = 0; i < argc; i += 1) {
     if (i != 0) Tcl_DStringAppend(&usage, " ", 1);
     Tcl_DStringAppend(&usage, Tcl_GetString(argv[i]), -1);
   }
   /* allocate the callout structure, including:
-     - usage string
-     - argument value pointers
-     - argument values */
+     - argument value offsets
+     - argument marshallers
+     - usage string */
   callout = (ffidl_callout *)Tcl_Alloc(sizeof(ffidl_callout)
-				       +cif->argc*sizeof(void*) /* args */
-				       +sizeof(ffidl_value)	/* rvalue */
-				       +cif->argc*sizeof(ffidl_value) /* avalues */
+				       +cif->argc*sizeof(ptrdiff_t) /* offsets */
+				       +cif->argc*sizeof(ffidl_marshal_proc *) /* marshal */
 				       +Tcl_DStringLength(&usage)+1); /* usage */
   if (callout == NULL) {
     Tcl_AppendResult(interp, "can't allocate ffidl_callout for: ", name, NULL);
@@ -3278,28 +7428,32 @@ static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc
   callout->cif = cif;
   callout->fn = fn;
   callout->client = client;
-  /* set up return and argument pointers */
-  callout->args = (void **)(callout+1);
-  ffidl_value *rvalue = (ffidl_value *)(callout->args+cif->argc);
-  ffidl_value *avalues = (ffidl_value *)(rvalue+1);
+  callout->retvar = NULL;
+  callout->entry = NULL;
+  callout->offsets = (ptrdiff_t *)(callout+1);
+  callout->marshal = (ffidl_marshal_proc **)(callout->offsets+cif->argc);
+  callout_prep(callout, raw);
   /* prep return value */
-  if (callout_prep_value(interp, FFIDL_RET, objv[return_ix], cif->rtype,
-			 rvalue, &callout->ret) == TCL_ERROR) {
+  if (callout_prep_value(interp, FFIDL_RET, objv[return_ix], cif->rtype) == TCL_ERROR) {
     goto error;
   }
+  callout->unmarshal = unmarshal_for_type(cif->rtype);
   /* prep argument values */
   for (i = 0; i < argc; i += 1) {
-    if (callout_prep_value(interp, FFIDL_ARG, argv[i], cif->atypes[i],
-			   &avalues[i], &callout->args[i]) == TCL_ERROR) {
+    if (callout_prep_value(interp, FFIDL_ARG, argv[i], cif->atypes[i]) == TCL_ERROR) {
       goto error;
     }
+    callout->marshal[i] = marshal_for_type(cif->atypes[i], callout->use_raw_api);
   }
-  callout_prep(callout);
   /* set up usage string */
-  callout->usage = (char *)((avalues+cif->argc));
+  callout->usage = (char *)(callout->marshal+cif->argc);
   strcpy(callout->usage, Tcl_DStringValue(&usage));
   /* free the usage string */
   Tcl_DStringFree(&usage);
+  if (retvar != NULL) {
+    callout->retvar = retvar;
+    Tcl_IncrRefCount(retvar);
+  }
   /* define the callout */
   callout_define(client, name, callout);
   /* create the tcl command */
@@ -3309,6 +7463,9 @@ static int tcl_ffidl_callout(ClientData clientData, Tcl_Interp *interp, int objc
 error:
   Tcl_DStringFree(&ds);
   Tcl_DStringFree(&usage);
+  if (callout) {
+    Tcl_Free((void *)callout);
+  }
   if (cif) {
     cif_dec_ref(cif);
   }
@@ -3316,7 +7473,191 @@ error:
 }
 
 #if USE_CALLBACKS
-/* usage: ffidl-callback name {?argument_type ...?} return_type ?protocol? ?cmdprefix? -> */
+/* qualify an unqualified callback name with the current namespace, in ds */
+static char *callback_qualify(Tcl_Interp *interp, char *name, Tcl_DString *ds)
+{
+  Tcl_DStringInit(ds);
+  if (!strstr(name, "::")) {
+    Tcl_Namespace *ns;
+    ns = Tcl_GetCurrentNamespace(interp);
+    if (ns != Tcl_GetGlobalNamespace(interp)) {
+      Tcl_DStringAppend(ds, ns->fullName, -1);
+    }
+    Tcl_DStringAppend(ds, "::", 2);
+    Tcl_DStringAppend(ds, name, -1);
+    name = Tcl_DStringValue(ds);
+  }
+  return name;
+}
+
+/* usage: ffidl-callback -native cmp:how ?-offset bytes? ?-desc? ?name? */
+static int tcl_ffidl_callback_native(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  enum {
+    command_ix,
+    native_ix,
+    how_ix,
+    minargs
+  };
+
+  static const char *options[] = {
+    "-desc",
+    "-offset",
+    NULL
+  };
+
+  enum {
+    option_desc,
+    option_offset,
+  };
+
+  ffidl_client *client = (ffidl_client *)clientData;
+  ffidl_compare compare;
+  ffidl_callback *callback = NULL;
+  ffidl_closure *closure;
+  ffidl_cif *cif = NULL;
+  ffidl_type *type;
+  Tcl_Obj *nameObj = NULL, *argsObj, *retObj;
+  Tcl_DString ds;
+  char *how, *end, *name;
+  void (*fn)();
+  int i, option, offset;
+  long length;
+
+  if (objc < minargs) {
+    Tcl_WrongNumArgs(interp, 1, objv, "-native cmp:how ?-offset bytes? ?-desc? ?name?");
+    return TCL_ERROR;
+  }
+  /* fetch the comparison */
+  how = Tcl_GetString(objv[how_ix]);
+  compare.offset = 0;
+  compare.length = 0;
+  compare.sign = 1;
+  if (strncmp(how, "cmp:", 4) != 0) {
+    Tcl_AppendResult(interp, "bad native callback \"", how, "\": must be cmp:type, cmp:memcmp:length or cmp:strcmp", NULL);
+    return TCL_ERROR;
+  }
+  how += 4;
+  if (strcmp(how, "strcmp") == 0) {
+    compare.typecode = FFIDL_PTR_UTF8;
+  } else if (strncmp(how, "memcmp:", 7) == 0) {
+    length = strtol(how+7, &end, 10);
+    if (end == how+7 || *end != '\0' || length <= 0) {
+      Tcl_AppendResult(interp, "bad length in cmp:", how, NULL);
+      return TCL_ERROR;
+    }
+    compare.typecode = FFIDL_PTR_BYTE;
+    compare.length = length;
+  } else {
+    type = type_lookup(client, how);
+    if (type == NULL || type->typecode < FFIDL_INT || type->typecode > FFIDL_SINT64) {
+      Tcl_AppendResult(interp, "type ", how, " cannot be compared", NULL);
+      return TCL_ERROR;
+    }
+    compare.typecode = type->typecode;
+  }
+  /* fetch options and name */
+  for (i = minargs; i < objc; i += 1) {
+    if (i == objc-1 && Tcl_GetIndexFromObj(NULL, objv[i], options, "option", 0, &option) == TCL_ERROR) {
+      nameObj = objv[i];
+      break;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &option) == TCL_ERROR) {
+      return TCL_ERROR;
+    }
+    if (option == option_desc) {
+      compare.sign = -1;
+    } else if (++i == objc) {
+      Tcl_AppendResult(interp, "missing value for -offset", NULL);
+      return TCL_ERROR;
+    } else if (Tcl_GetIntFromObj(interp, objv[i], &offset) == TCL_ERROR) {
+      return TCL_ERROR;
+    } else if (offset < 0) {
+      Tcl_AppendResult(interp, "offset must not be negative", NULL);
+      return TCL_ERROR;
+    } else {
+      compare.offset = offset;
+    }
+  }
+  /* the name defaults to the description */
+  if (nameObj == NULL) {
+    nameObj = Tcl_NewListObj(objc-how_ix, objv+how_ix);
+  }
+  Tcl_IncrRefCount(nameObj);
+  name = callback_qualify(interp, Tcl_GetString(nameObj), &ds);
+  /* an identical comparison is kept, so pointers to it stay good */
+  callback = callback_lookup(client, name);
+  if (callback != NULL && callback->compare.typecode == compare.typecode &&
+      callback->compare.offset == compare.offset && callback->compare.length == compare.length &&
+      callback->compare.sign == compare.sign) {
+    closure = &callback->closure;
+    goto done;
+  }
+  argsObj = Tcl_NewStringObj("pointer pointer", -1);
+  retObj = Tcl_NewStringObj("int", -1);
+  Tcl_IncrRefCount(argsObj);
+  Tcl_IncrRefCount(retObj);
+  i = cif_parse(interp, client, argsObj, retObj, NULL, &cif);
+  Tcl_DecrRefCount(argsObj);
+  Tcl_DecrRefCount(retObj);
+  if (i == TCL_ERROR) {
+    Tcl_DStringFree(&ds);
+    Tcl_DecrRefCount(nameObj);
+    return TCL_ERROR;
+  }
+  callback = (ffidl_callback *)Tcl_Alloc(sizeof(ffidl_callback)+cif->argc*sizeof(Tcl_Obj *));
+  memset(callback, 0, sizeof(ffidl_callback)+cif->argc*sizeof(Tcl_Obj *));
+  callback->cif = cif;
+  callback->interp = interp;
+  callback->thread = Tcl_GetCurrentThread();
+  callback->async = 0;
+  callback->queue = NULL;
+  callback->cmdc = 0;
+  callback->cmdv = (Tcl_Obj **)(callback+1);
+  callback->token = NULL;
+  callback->compare = compare;
+  closure = &callback->closure;
+#if USE_LIBFFI
+#if USE_LIBFFI_RAW_API
+  callback->use_raw_api = 0;
+  callback->offsets = NULL;
+#endif
+  closure->lib_closure = NULL;
+  closure->executable = compare_function(&compare);
+  if (closure->executable == NULL) {
+    closure->lib_closure = ffi_closure_alloc(sizeof(ffi_closure), &closure->executable);
+    if (closure->lib_closure == NULL ||
+	ffi_prep_closure_loc(closure->lib_closure, &cif->lib_cif, compare_callback,
+			     (void *)callback, closure->executable) != FFI_OK) {
+      Tcl_AppendResult(interp, "libffi can't make closure for: ", name, NULL);
+      if (closure->lib_closure != NULL) {
+	ffi_closure_free(closure->lib_closure);
+      }
+      Tcl_Free((void *)callback);
+      cif_dec_ref(cif);
+      Tcl_DStringFree(&ds);
+      Tcl_DecrRefCount(nameObj);
+      return TCL_ERROR;
+    }
+  }
+#elif USE_LIBFFCALL
+  closure->lib_closure = alloc_callback((callback_function_t)&compare_callback, (void *)callback);
+#endif
+  callback_define(client, name, callback);
+
+ done:
+  Tcl_DStringFree(&ds);
+  Tcl_DecrRefCount(nameObj);
+#if USE_LIBFFI
+  fn = (void (*)())closure->executable;
+#elif USE_LIBFFCALL
+  fn = (void (*)())closure->lib_closure;
+#endif
+  Tcl_SetObjResult(interp, Ffidl_NewPointerObj(fn));
+  return TCL_OK;
+}
+
+/* usage: ffidl-callback ?-raw boolean? ?-async boolean? ?-queue size? ?-overflow policy? ?--? name {?argument_type ...?} return_type ?protocol? ?cmdprefix? -> */
 static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
   enum {
@@ -3340,29 +7681,29 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   ffidl_client *client = (ffidl_client *)clientData;
   ffidl_closure *closure = NULL;
   void (*fn)();
-  int has_protocol = objc - 1 >= protocol_ix;
-  int has_cmdprefix = objc - 1 >= cmdprefix_ix;
+  int has_protocol, has_cmdprefix, raw, async, queue, overflow, nopts;
   int i, argc = 0;
   Tcl_Obj **argv = NULL;
 
+  if (objc > 1 && strcmp(Tcl_GetString(objv[1]), "-native") == 0) {
+    return tcl_ffidl_callback_native(clientData, interp, objc, objv);
+  }
+  /* fetch options */
+  nopts = binding_options(interp, objc, objv, &raw, NULL, &async, &queue, &overflow);
+  if (nopts < 0) {
+    return TCL_ERROR;
+  }
+  objc -= nopts;
   /* usage check */
   if (objc < minargs || objc > maxargs) {
-    Tcl_WrongNumArgs(interp, 1, objv, "name {?argument_type ...?} return_type ?protocol? ?cmdprefix?");
+    Tcl_WrongNumArgs(interp, 1, objv, "?-raw boolean? ?-async boolean? ?-queue size? ?-overflow policy? ?--? name {?argument_type ...?} return_type ?protocol? ?cmdprefix?");
     return TCL_ERROR;
   }
+  objv += nopts;
+  has_protocol = objc - 1 >= protocol_ix;
+  has_cmdprefix = objc - 1 >= cmdprefix_ix;
   /* fetch name */
-  Tcl_DStringInit(&ds);
-  name = Tcl_GetString(objv[name_ix]);
-  if (!strstr(name, "::")) {
-    Tcl_Namespace *ns;
-    ns = Tcl_GetCurrentNamespace(interp);
-    if (ns != Tcl_GetGlobalNamespace(interp)) {
-      Tcl_DStringAppend(&ds, ns->fullName, -1);
-    }
-    Tcl_DStringAppend(&ds, "::", 2);
-    Tcl_DStringAppend(&ds, name, -1);
-    name = Tcl_DStringValue(&ds);
-  }
+  name = callback_qualify(interp, Tcl_GetString(objv[name_ix]), &ds);
   /* fetch cif */
   if (cif_parse(interp, client,
 		objv[args_ix],
@@ -3376,12 +7717,49 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
 			     objv[return_ix], cif->rtype) == TCL_ERROR) {
     goto error;
   }
-  Tcl_ListObjGetElements(interp, objv[args_ix], &argc, &argv);
+  cif_args(interp, objv[args_ix], &argc, &argv);
   for (i = 0; i < argc; i += 1)
     if (cif_type_check_context(interp, FFIDL_ARG,
 			       objv[args_ix], cif->atypes[i]) == TCL_ERROR) {
       goto error;
     }
+  /* nothing waits for the result of an asynchronous callback */
+  if ((async || queue) && cif->rtype->typecode != FFIDL_VOID) {
+    Tcl_AppendResult(interp, "asynchronous callbacks must return void", NULL);
+    goto error;
+  }
+  /* the call returns before the arguments are converted, so only their values are kept */
+  if (async || queue) {
+    for (i = 0; i < cif->argc; i += 1) {
+      switch (cif->atypes[i]->typecode) {
+      case FFIDL_PTR_OBJ:
+      case FFIDL_PTR_UTF8:
+      case FFIDL_PTR_UTF16:
+      case FFIDL_PTR_UTF32:
+	Tcl_AppendResult(interp, "asynchronous callbacks cannot take argument type ",
+			 Tcl_GetString(argv[i]), NULL);
+	goto error;
+      default:
+	break;
+      }
+    }
+  }
+  if (overflow >= 0 && ! queue) {
+    Tcl_AppendResult(interp, "-overflow needs -queue", NULL);
+    goto error;
+  }
+#if USE_LIBFFCALL
+  if (async || queue) {
+    Tcl_AppendResult(interp, "asynchronous callbacks need libffi", NULL);
+    goto error;
+  }
+#endif
+#if ! TCL_THREADS
+  if (queue) {
+    Tcl_AppendResult(interp, "queued callbacks need a threaded Tcl", NULL);
+    goto error;
+  }
+#endif
   /* create Tcl proc */
   if (has_cmdprefix) {
     Tcl_Obj *cmdprefix = objv[cmdprefix_ix];
@@ -3405,10 +7783,6 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   callback = (ffidl_callback *)Tcl_Alloc(sizeof(ffidl_callback)
 					 /* cmdprefix and argument Tcl_Objs */
 					 +(cmdc+cif->argc)*sizeof(Tcl_Obj *)
-#if USE_LIBFFI_RAW_API
-					 /* raw argument offsets */
-					 +cif->argc*sizeof(ptrdiff_t)
-#endif
   );
   if (callback == NULL) {
     Tcl_AppendResult(interp, "can't allocate ffidl_callback for: ", name, NULL);
@@ -3417,32 +7791,45 @@ static int tcl_ffidl_callback(ClientData clientData, Tcl_Interp *interp, int obj
   /* initialize the callback */
   callback->cif = cif;
   callback->interp = interp;
+  callback->thread = Tcl_GetCurrentThread();
+  callback->async = async;
+  callback->queue = NULL;
+  callback->users = 0;
+  callback->closed = 0;
+  callback->gone = NULL;
+#if TCL_THREADS && USE_LIBFFI
+  if (queue) {
+    /* queued calls are copied out of plain closure arguments */
+    callback->queue = queue_new(cif, queue, overflow < 0 ? FFIDL_QUEUE_BLOCK : overflow);
+    raw = 0;
+  }
+#endif
   /* store the command prefix' Tcl_Objs */
   callback->cmdc = cmdc;
   callback->cmdv = (Tcl_Obj **)(callback+1);
   memcpy(callback->cmdv, cmdv, cmdc*sizeof(Tcl_Obj *));
+  memset(callback->cmdv+cmdc, 0, cif->argc*sizeof(Tcl_Obj *));
+  callback->depth = 0;
+  callback->token = NULL;
+  callback->compare.typecode = FFIDL_VOID;
   closure = &(callback->closure);
 #if USE_LIBFFI
-  closure->lib_closure = ffi_closure_alloc(sizeof(ffi_closure), &(closure->executable));
 #if USE_LIBFFI_RAW_API
-  callback->offsets = (ptrdiff_t *)(callback->cmdv+cmdc+cif->argc);
-  callback->use_raw_api = cif_raw_supported(cif);
-  callback->use_raw_api = 0;
-  if (callback->use_raw_api &&
-      ffi_prep_raw_closure_loc((ffi_raw_closure *)closure->lib_closure, &callback->cif->lib_cif,
-				 (void (*)(ffi_cif*,void*,ffi_raw*,void*))callback_callback,
-                                 (void *)callback, closure->executable) == FFI_OK) {
-    if (TCL_OK != cif_raw_prep_offsets(callback->cif, callback->offsets)) {
-      goto error;
-    }
-    /* Prepared successfully, continue. */
-  }
-  else
+  /* a raw closure is larger than a plain one where the raw API is emulated */
+  closure->lib_closure = ffi_closure_alloc(sizeof(ffi_raw_closure) > sizeof(ffi_closure) ?
+					   sizeof(ffi_raw_closure) : sizeof(ffi_closure),
+					   &(closure->executable));
+  /* fall back to a plain closure when the signature has no raw layout */
+  callback->offsets = cif->raw_offsets;
+  callback->use_raw_api = raw && cif->raw_offsets != NULL &&
+    ffi_prep_raw_closure_loc((ffi_raw_closure *)closure->lib_closure, &callback->cif->lib_cif,
+			     (void (*)(ffi_cif*,void*,ffi_raw*,void*))callback_callback,
+			     (void *)callback, closure->executable) == FFI_OK;
+  if (!callback->use_raw_api)
+#else
+  closure->lib_closure = ffi_closure_alloc(sizeof(ffi_closure), &(closure->executable));
 #endif
   {
-#if USE_LIBFFI_RAW_API
-    callback->use_raw_api = 0;
-#endif
     if (ffi_prep_closure_loc(closure->lib_closure, &callback->cif->lib_cif,
                             (void (*)(ffi_cif*,void*,void**,void*))callback_callback,
                             (void *)callback, closure->executable) != FFI_OK) {
@@ -3486,6 +7873,13 @@ error:
 #endif
   }
   if (callback) {
+#if TCL_THREADS
+    if (callback->queue != NULL) {
+      Tcl_ConditionFinalize(&callback->queue->room);
+      Tcl_Free(callback->queue->cells);
+      Tcl_Free((char *)callback->queue);
+    }
+#endif
       Tcl_Free((void *)callback);
   }
   return TCL_ERROR;
@@ -3794,6 +8188,15 @@ int Ffidl_Init(Tcl_Interp *interp)
   Tcl_CreateObjCommand(interp,"::ffidl::symbol", tcl_ffidl_symbol, (ClientData) client, NULL);
   Tcl_CreateObjCommand(interp,"::ffidl::stubsymbol", tcl_ffidl_stubsymbol, (ClientData) client, NULL);
   Tcl_CreateObjCommand(interp,"::ffidl::callout", tcl_ffidl_callout, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::map", tcl_ffidl_map, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::apply", tcl_ffidl_apply, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::pointer", tcl_ffidl_pointer, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::buffer", tcl_ffidl_buffer, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::mmap", tcl_ffidl_mmap, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::channel", tcl_ffidl_channel, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::struct", tcl_ffidl_struct, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::pack", tcl_ffidl_pack, (ClientData) client, NULL);
+  Tcl_CreateObjCommand(interp,"::ffidl::unpack", tcl_ffidl_unpack, (ClientData) client, NULL);
 #if USE_CALLBACKS
   Tcl_CreateObjCommand(interp,"::ffidl::callback", tcl_ffidl_callback, (ClientData) client, NULL);
 #endif
@@ -3805,6 +8208,7 @@ int Ffidl_Init(Tcl_Interp *interp)
   ffidl_wideInt_ObjType = Tcl_GetObjType("wideInt");
 #endif
   ffidl_double_ObjType = Tcl_GetObjType("double");
+  ffidl_list_ObjType = Tcl_GetObjType("list");
 
   /* done */
   return TCL_OK;
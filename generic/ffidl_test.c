@@ -507,3 +507,43 @@ EXTERN void ffidl_isort(int *base, int nmemb, int (*compar)(const int *,const in
     }
   }
 }
+EXTERN void ffidl_fvoid(void (*f)(int i), int n)
+{
+  int i;
+  for (i = 0; i < n; i += 1) f(i);
+}
+/*
+ * callbacks from a thread of their own
+ */
+static struct {
+  Tcl_ThreadId id;
+  int (*fint)(int a, int b);
+  void (*fvoid)(int i);
+  int a, b, result;
+} spawned;
+static Tcl_ThreadCreateType ffidl_spawned(ClientData clientData)
+{
+  int i;
+  if (spawned.fint != NULL) {
+    spawned.result = spawned.fint(spawned.a, spawned.b);
+  } else {
+    for (i = 0; i < spawned.a; i += 1) spawned.fvoid(i);
+  }
+  TCL_THREAD_CREATE_RETURN;
+}
+EXTERN int ffidl_fint_spawn(int (*f)(int a, int b), int a, int b)
+{
+  spawned.fint = f; spawned.fvoid = NULL; spawned.a = a; spawned.b = b;
+  return Tcl_CreateThread(&spawned.id, ffidl_spawned, NULL, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE);
+}
+EXTERN int ffidl_fvoid_spawn(void (*f)(int i), int n)
+{
+  spawned.fint = NULL; spawned.fvoid = f; spawned.a = n; spawned.result = 0;
+  return Tcl_CreateThread(&spawned.id, ffidl_spawned, NULL, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE);
+}
+EXTERN int ffidl_spawn_join(void)
+{
+  int status;
+  Tcl_JoinThread(spawned.id, &status);
+  return spawned.result;
+}